@@ -0,0 +1,4 @@
+program q1;
+begin
+  write(42)
+end.
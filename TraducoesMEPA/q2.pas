@@ -0,0 +1,18 @@
+program q2;
+var n, i, a, b, t: integer;
+begin
+  read(n);
+  i := 1;
+  a := 1;
+  b := 0;
+  while i <= n do
+  begin
+    t := b + a;
+    b := a;
+    a := t;
+    i := i + 1;
+    write(i)
+  end;
+  write(n);
+  write(b)
+end.
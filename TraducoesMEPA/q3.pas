@@ -0,0 +1,17 @@
+program q3;
+var m, n, s, t, square: integer;
+begin
+  read(m);
+  read(n);
+  s := 0;
+  t := 0;
+  while m <= n do
+  begin
+    square := m * m;
+    s := square + s;
+    write(m);
+    write(s);
+    m := m + 1;
+    write(m)
+  end
+end.
@@ -0,0 +1,12 @@
+program q4;
+var x, y: integer;
+begin
+  read(x);
+  y := 1;
+  while x > 1 do
+  begin
+    y := x * y;
+    x := x - 1
+  end;
+  write(y)
+end.
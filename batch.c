@@ -0,0 +1,260 @@
+#include "header/vm.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// A program to run, the file LEIT reads from and the file its output goes
+// to (empty when there is none), and how the run went.
+typedef struct Job {
+  char program[BUFFER_SIZE], input[BUFFER_SIZE], output[BUFFER_SIZE];
+  char status[BUFFER_SIZE];
+  long executed;            // instructions run, or -1 if it didn't finish
+  double seconds;
+  long outputSize;
+} Job;
+
+// The jobs left to a worker. It takes them from the bottom and the other
+// workers steal them from the top.
+typedef struct Deque {
+  pthread_mutex_t lock;
+  int top, bottom;
+} Deque;
+
+typedef struct Batch {
+  Job *jobs;
+  int count;
+  Deque *deques;
+  int workers;
+  long stackSize, budget, timeout;
+  int fuse, registers;
+} Batch;
+
+typedef struct Worker {
+  Batch *batch;
+  int id;
+  pthread_t thread;
+} Worker;
+
+// Reads the job list: a line per job with the program and, optionally, its
+// input and output files. Empty lines and lines starting with # are skipped.
+static Job *readJobs(FILE *file, int *count) {
+  char line[3 * BUFFER_SIZE];
+  int capacity = 64;
+  Job *jobs = (Job*)malloc(capacity * sizeof(Job));
+
+  *count = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char program[BUFFER_SIZE], input[BUFFER_SIZE] = "", output[BUFFER_SIZE] = "";
+    if (sscanf(line, "%2047s %2047s %2047s", program, input, output) < 1 || program[0] == '#')
+      continue;
+    if (*count == capacity) {
+      capacity *= 2;
+      jobs = (Job*)realloc(jobs, capacity * sizeof(Job));
+    }
+    Job *job = &jobs[(*count)++];
+    memset(job, 0, sizeof(Job));
+    strcpy(job->program, program);
+    strcpy(job->input, input);
+    strcpy(job->output, output);
+    job->executed = -1;
+  }
+  return jobs;
+}
+
+// The VM running a job on this thread, if any.
+static __thread VM *runningVM;
+
+// Signals of a trap in a VM: a fault or an arithmetic exception it doesn't
+// check for. A job that traps stops like one that raised a runtime error.
+static int traps[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL};
+#define TRAP_COUNT ((int)(sizeof(traps) / sizeof(traps[0])))
+
+static void trapped(int number) {
+  VM *vm = runningVM;
+  if (vm == NULL) {
+    // not in a job: die of the signal as without the handler
+    signal(number, SIG_DFL);
+    raise(number);
+    return;
+  }
+  runningVM = NULL;
+  vm->error = number == SIGFPE ? "arithmetic trap" : "memory fault";
+  vm->errorAt = -1;
+  siglongjmp(*vm->abort, 1);
+}
+
+// Loads the program of a job into its own VM and runs it, with the job's
+// input and an output buffer, until it stops or runs out of budget or time.
+static void runJob(Batch *batch, Job *job) {
+  FILE *file = fopen(job->program, "rb");
+  if (file == NULL) {
+    strcpy(job->status, "cannot open program");
+    return;
+  }
+  int errorLine;
+  Program *program = readProgram(file, &errorLine);
+  fclose(file);
+  if (program == NULL) {
+    strcpy(job->status, "invalid program");
+    return;
+  }
+  VM vm;
+  if (batch->fuse) fuseInstructions(program);
+  if (!loadVM(&vm, program, batch->stackSize, batch->registers)) {
+    freeProgram(program);
+    free(vm.code);
+    strcpy(job->status, "invalid program");
+    return;
+  }
+  freeProgram(program);
+
+  int input = job->input[0] != '\0' ? open(job->input, O_RDONLY) : -1;
+  if (input == -1 && job->input[0] != '\0') {
+    freeVM(&vm);
+    strcpy(job->status, "cannot open input");
+    return;
+  }
+  sigjmp_buf abort;
+  struct timespec start, end;
+
+  openInput(&vm.input, input);
+  openOutput(&vm.output, -1);
+  vm.budget = batch->budget;
+  vm.abort = &abort;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  vm.deadline = start.tv_sec + start.tv_nsec / 1e9 + batch->timeout;
+  if (sigsetjmp(abort, 1) == 0) {
+    runningVM = &vm;
+    runVM(&vm);
+    runningVM = NULL;
+    job->executed = vm.executed;
+    strcpy(job->status, "ok");
+  } else if (vm.errorAt >= 0) {
+    runningVM = NULL;
+    snprintf(job->status, BUFFER_SIZE, "%s at instruction %ld", vm.error, vm.errorAt);
+  } else {
+    strcpy(job->status, vm.error);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  job->outputSize = vm.output.size;
+  if (job->output[0] != '\0') {
+    FILE *output = fopen(job->output, "wb");
+    if (output == NULL ||
+        fwrite(vm.output.data, 1, vm.output.size, output) != (size_t)vm.output.size)
+      strcpy(job->status, "cannot write output");
+    if (output != NULL) fclose(output);
+  }
+  freeVM(&vm);
+  if (input != -1) close(input);
+}
+
+// Takes the next job from the bottom of the worker's own deque, or -1.
+static int takeJob(Deque *deque) {
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top < deque->bottom) job = --deque->bottom;
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+// Steals a job from the top of another worker's deque, or returns -1 when
+// every deque is empty.
+static int stealJob(Batch *batch, int id) {
+  for (int i = 1; i < batch->workers; i++) {
+    Deque *deque = &batch->deques[(id + i) % batch->workers];
+    int job = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) job = deque->top++;
+    pthread_mutex_unlock(&deque->lock);
+    if (job != -1) return job;
+  }
+  return -1;
+}
+
+static void *work(void *argument) {
+  Worker *worker = (Worker*)argument;
+  Batch *batch = worker->batch;
+  int job;
+
+  // no job makes new ones, so once nothing is left to steal the worker is done
+  while ((job = takeJob(&batch->deques[worker->id])) != -1 ||
+         (job = stealJob(batch, worker->id)) != -1)
+    runJob(batch, &batch->jobs[job]);
+  return NULL;
+}
+
+static void writeSummary(Batch *batch, FILE *file) {
+  fprintf(file, "job\tprogram\tinput\tstatus\tinstructions\ttime\toutput\n");
+  for (int i = 0; i < batch->count; i++) {
+    Job *job = &batch->jobs[i];
+    fprintf(file, "%d\t%s\t%s\t%s\t", i + 1, job->program, job->input[0] != '\0' ? job->input : "-",
+            job->status);
+    if (job->executed >= 0)
+      fprintf(file, "%ld\t%.6f\t%ld\n", job->executed, job->seconds, job->outputSize);
+    else
+      fprintf(file, "-\t%.6f\t%ld\n", job->seconds, job->outputSize);
+  }
+}
+
+// Runs every job of the list on a pool of threads (one per processor when
+// threads is 0), each job on its own VM with a stack of stackSize cells, at
+// most budget instructions and timeout seconds, and writes a line per job to
+// the summary file, or stdout. Returns how many jobs ran, or -1 if the list
+// or the summary can't be opened.
+int runBatch(char *jobsPath, char *summaryPath, int threads, long stackSize, long budget,
+             long timeout, int fuse, int registers) {
+  FILE *file = fopen(jobsPath, "r");
+  if (file == NULL) {
+    perror("Error opening job list");
+    return -1;
+  }
+  Batch batch = {NULL, 0, NULL, 0, stackSize, budget, timeout, fuse, registers};
+  batch.jobs = readJobs(file, &batch.count);
+  fclose(file);
+
+  if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > batch.count) threads = batch.count;
+  if (threads < 1) threads = 1;
+  batch.workers = threads;
+  batch.deques = (Deque*)malloc(threads * sizeof(Deque));
+  Worker *workers = (Worker*)malloc(threads * sizeof(Worker));
+
+  // each worker starts with a contiguous share of the jobs
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&batch.deques[i].lock, NULL);
+    batch.deques[i].top = (long)batch.count * i / threads;
+    batch.deques[i].bottom = (long)batch.count * (i + 1) / threads;
+    workers[i].batch = &batch;
+    workers[i].id = i;
+  }
+  // contain the traps of a job to that job while the workers run
+  struct sigaction trap, saved[TRAP_COUNT];
+  memset(&trap, 0, sizeof(trap));
+  trap.sa_handler = trapped;
+  sigemptyset(&trap.sa_mask);
+  for (int i = 0; i < TRAP_COUNT; i++) sigaction(traps[i], &trap, &saved[i]);
+  for (int i = 0; i < threads; i++) pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+  for (int i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+  for (int i = 0; i < TRAP_COUNT; i++) sigaction(traps[i], &saved[i], NULL);
+
+  int ran = batch.count;
+  FILE *summary = summaryPath != NULL ? fopen(summaryPath, "w") : stdout;
+  if (summary == NULL) {
+    perror("Error opening summary");
+    ran = -1;
+  } else {
+    writeSummary(&batch, summary);
+    if (summary != stdout) fclose(summary);
+  }
+  for (int i = 0; i < threads; i++) pthread_mutex_destroy(&batch.deques[i].lock);
+  free(workers);
+  free(batch.deques);
+  free(batch.jobs);
+  return ran;
+}
@@ -0,0 +1,21 @@
+program calls;
+var i, n, scale, total: integer;
+
+function weight(x: integer): integer;
+begin
+  scale := scale + 1;
+  weight := x * 4 + scale
+end;
+
+begin
+  read(n);
+  scale := 1;
+  total := 0;
+  i := 1;
+  while i <= n do
+  begin
+    total := total + weight(i * 2) - scale * n + i * 9;
+    i := i + 1
+  end;
+  write(total, scale)
+end.
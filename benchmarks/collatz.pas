@@ -0,0 +1,36 @@
+program collatz;
+var i, n, longest, start, total: integer;
+
+function steps(x: integer): integer;
+var count: integer;
+begin
+  count := 0;
+  while x <> 1 do
+  begin
+    if x - x div 2 * 2 = 0 then
+      x := x div 2
+    else
+      x := 3 * x + 1;
+    count := count + 1
+  end;
+  steps := count
+end;
+
+begin
+  read(n);
+  longest := 0;
+  start := 1;
+  total := 0;
+  i := 1;
+  while i <= n do
+  begin
+    total := total + steps(i);
+    if steps(i) > longest then
+    begin
+      longest := steps(i);
+      start := i
+    end;
+    i := i + 1
+  end;
+  write(start, longest, total)
+end.
@@ -0,0 +1,13 @@
+program invariant;
+var i, n, a, b, total: integer;
+begin
+  read(n, a, b);
+  i := 0;
+  total := 0;
+  while i < n * n do
+  begin
+    total := total + a * b - i;
+    i := i + 1
+  end;
+  write(total)
+end.
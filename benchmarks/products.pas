@@ -0,0 +1,40 @@
+program products;
+var i, j, n, sum: integer;
+
+procedure table(n: integer; var total: integer);
+var i, k: integer;
+begin
+  i := 0;
+  while i < n do
+  begin
+    k := 0;
+    while k < n do
+    begin
+      total := total + i * 7 + k * 3;
+      if k * 3 > n then
+        total := total - k * 3 + i * 7;
+      k := k + 1
+    end;
+    i := i + 1
+  end
+end;
+
+begin
+  read(n);
+  sum := 0;
+  i := 0;
+  while i < n do
+  begin
+    j := n;
+    while j > 0 do
+    begin
+      sum := sum + j * 5 - i * n;
+      if j * 5 < i * n then
+        sum := sum + j * 5;
+      j := j - 2
+    end;
+    i := i + 1
+  end;
+  table(n, sum);
+  write(sum)
+end.
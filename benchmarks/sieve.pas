@@ -0,0 +1,57 @@
+program sieve;
+var flags: array[2..50000] of boolean;
+    last: array[0..9] of integer;
+    i, j, r, rounds, primes: integer;
+
+begin
+  read(rounds);
+  r := 0;
+  while r < rounds do
+  begin
+    i := 2;
+    while i <= 50000 do
+    begin
+      flags[i] := true;
+      i := i + 1
+    end;
+    i := 2;
+    while i <= 223 do
+    begin
+      if flags[i] then
+      begin
+        j := i * i;
+        while j <= 50000 do
+        begin
+          flags[j] := false;
+          j := j + i
+        end
+      end;
+      i := i + 1
+    end;
+    primes := 0;
+    i := 0;
+    while i <= 9 do
+    begin
+      last[i] := 0;
+      i := i + 1
+    end;
+    i := 50000;
+    while i >= 2 do
+    begin
+      if flags[i] then
+      begin
+        primes := primes + 1;
+        last[i - i div 10 * 10] := last[i - i div 10 * 10] + 1
+      end;
+      i := i - 1
+    end;
+    r := r + 1
+  end;
+  write(primes);
+  i := 0;
+  while i <= 9 do
+  begin
+    write(last[i]);
+    i := i + 1
+  end
+end.
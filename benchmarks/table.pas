@@ -0,0 +1,14 @@
+program table;
+var i, n, total: integer;
+
+begin
+  read(n);
+  total := 0;
+  i := 1;
+  while i <= n do
+  begin
+    total := total + i * i;
+    write(i * i, total);
+    i := i + 1
+  end
+end.
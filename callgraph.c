@@ -0,0 +1,272 @@
+#include "header/optimizer.h"
+#include "header/generator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNBOUNDED -1
+
+// Call graph
+
+// Builds the call graph of the program from its CHPR instructions.
+CallGraph *buildCallGraph(Program *program, FrameInfo *info, int *targets) {
+  CallGraph *graph = (CallGraph*)malloc(sizeof(CallGraph));
+  int n = info->count;
+  char *closure = (char*)calloc(n * n + 1, 1);
+
+  graph->count = n;
+  graph->calls = (char*)calloc(n * n + 1, 1);
+  graph->reachable = (char*)calloc(n + 1, 1);
+  graph->leaf = (char*)malloc(n + 1);
+  graph->recursive = (char*)calloc(n + 1, 1);
+  memset(graph->leaf, 1, n + 1);
+
+  for (int i = 0; i < program->count; i++) {
+    if (program->code[i].op != OP_CHPR || targets[i] == -1) continue;
+    int caller = info->frameOf[i], callee = info->frameOf[targets[i]];
+    graph->calls[caller * n + callee] = 1;
+    graph->leaf[caller] = 0;
+  }
+
+  // what each frame calls, directly or not
+  memcpy(closure, graph->calls, n * n);
+  for (int k = 0; k < n; k++)
+    for (int i = 0; i < n; i++)
+      if (closure[i * n + k])
+        for (int j = 0; j < n; j++)
+          if (closure[k * n + j]) closure[i * n + j] = 1;
+
+  for (int f = 0; f < n; f++) {
+    graph->recursive[f] = closure[f * n + f];
+    graph->reachable[f] = info->frames[f].parent == -1 || (n > 0 && closure[f]);
+  }
+  free(closure);
+  return graph;
+}
+
+void freeCallGraph(CallGraph *graph) {
+  free(graph->calls);
+  free(graph->reachable);
+  free(graph->leaf);
+  free(graph->recursive);
+  free(graph);
+}
+
+// Removes the routines the main program never calls, directly or not,
+// along with the routines nested in them. Returns the number removed.
+int removeDeadRoutines(Program *program) {
+  FrameInfo *info = findFrames(program);
+  int *targets = labelTargets(program);
+  CallGraph *graph = buildCallGraph(program, info, targets);
+  int removed = 0, leaves = 0, recursive = 0;
+
+  for (int f = 0; f < info->count; f++) {
+    Frame *frame = &info->frames[f];
+    if (graph->reachable[f]) {
+      if (frame->parent != -1) {
+        leaves += graph->leaf[f];
+        recursive += graph->recursive[f];
+      }
+      continue;
+    }
+    if (program->code[frame->entry].op == OP_NONE) continue;
+    // nothing that is left can jump into a dead routine
+    for (int i = frame->entry; i <= frame->exit; i++) {
+      program->code[i].op = OP_NONE;
+      program->code[i].label[0] = '\0';
+    }
+    removed++;
+  }
+  compactProgram(program);
+
+  if (printStats)
+    fprintf(diagnostics, "callgraph: removed %d routines, %d leaf, %d recursive\n",
+            removed, leaves, recursive);
+  freeCallGraph(graph);
+  free(targets);
+  freeFrames(info);
+  return removed;
+}
+
+// Frame report
+
+// Finds the highest the stack gets in the frame over its base (D[k]),
+// locals and expressions included, and the height at each of its
+// instructions. Returns UNBOUNDED when an instruction's effect on the stack
+// can't be told or paths reach it at different heights, as the height then
+// isn't a bound.
+static int frameDepth(Program *program, FrameInfo *info, int *targets, int f,
+                      int *depth) {
+  Frame *frame = &info->frames[f];
+  int *worklist = (int*)malloc((frame->exit - frame->entry + 2) * sizeof(int));
+  int pending = 0, maxDepth = 0;
+
+  for (int i = frame->entry; i <= frame->exit; i++)
+    if (info->frameOf[i] == f) depth[i] = -1;
+  depth[frame->entry + 1] = 0;
+  worklist[pending++] = frame->entry + 1;
+
+  while (pending > 0 && maxDepth != UNBOUNDED) {
+    int i = worklist[--pending], height = depth[i], known = 1;
+    Instr *instr = &program->code[i];
+    int next = i + 1, jump = -1;
+
+    if (height > maxDepth) maxDepth = height;
+    switch (instr->op) {
+      case OP_RTPR: case OP_PARA: case OP_DSVR:
+        next = -1;
+        break;
+      case OP_NADA:
+        break;
+      case OP_DSVS:
+        next = -1;
+        jump = targets[i];
+        break;
+      case OP_DSVF:
+        height--;
+        jump = targets[i];
+        break;
+      case OP_ENRT:
+        height = instr->b;
+        break;
+      default:
+        height += stackEffect(program, info, targets, i, &known);
+        break;
+    }
+    if (!known) {
+      maxDepth = UNBOUNDED;
+      break;
+    }
+    if (height > maxDepth) maxDepth = height;
+    int successors[2] = {next, jump};
+    for (int s = 0; s < 2; s++) {
+      int t = successors[s];
+      if (t < frame->entry || t > frame->exit || info->frameOf[t] != f) continue;
+      if (depth[t] != -1) {
+        if (depth[t] != height) maxDepth = UNBOUNDED;
+        continue;
+      }
+      depth[t] = height;
+      worklist[pending++] = t;
+    }
+  }
+  free(worklist);
+  return maxDepth;
+}
+
+// Finds the highest the stack gets over the base of the frame, with the
+// frames of the routines it calls on top, or UNBOUNDED for recursions and
+// frames whose stack can't be followed.
+static int stackNeeded(Program *program, FrameInfo *info, int *targets, CallGraph *graph,
+                       int *depth, int *maxDepth, int *needed, int f) {
+  Frame *frame = &info->frames[f];
+
+  if (needed[f] != -2) return needed[f];
+  needed[f] = graph->recursive[f] || maxDepth[f] == UNBOUNDED ? UNBOUNDED : maxDepth[f];
+  for (int i = frame->entry; i <= frame->exit && needed[f] != UNBOUNDED; i++) {
+    if (program->code[i].op != OP_CHPR || info->frameOf[i] != f || depth[i] == -1 ||
+        targets[i] == -1)
+      continue;
+    int callee = info->frameOf[targets[i]];
+    int callStack = stackNeeded(program, info, targets, graph, depth, maxDepth, needed,
+                                callee);
+    // CHPR pushes the return address and the caller level, ENPR the display
+    if (callStack == UNBOUNDED)
+      needed[f] = UNBOUNDED;
+    else if (depth[i] + 3 + callStack > needed[f])
+      needed[f] = depth[i] + 3 + callStack;
+  }
+  return needed[f];
+}
+
+// Works out the deepest each frame gets (maxDepth) and the stack it needs
+// with its calls (needed), and the height at each instruction (depth).
+static void frameStacks(Program *program, FrameInfo *info, int *targets, CallGraph *graph,
+                        int *depth, int *maxDepth, int *needed) {
+  for (int f = 0; f < info->count; f++) {
+    maxDepth[f] = frameDepth(program, info, targets, f, depth);
+    needed[f] = -2;
+  }
+  for (int f = 0; f < info->count; f++)
+    stackNeeded(program, info, targets, graph, depth, maxDepth, needed, f);
+}
+
+// Returns the cells of stack the whole program needs, or 0 if a recursion
+// leaves it unbounded.
+long programStack(Program *program) {
+  FrameInfo *info = findFrames(program);
+  int *targets = labelTargets(program);
+  CallGraph *graph = buildCallGraph(program, info, targets);
+  int *depth = (int*)malloc((program->count + 1) * sizeof(int));
+  int *maxDepth = (int*)malloc((info->count + 1) * sizeof(int));
+  int *needed = (int*)malloc((info->count + 1) * sizeof(int));
+  long cells = 0;
+
+  frameStacks(program, info, targets, graph, depth, maxDepth, needed);
+  for (int f = 0; f < info->count; f++) {
+    if (info->frames[f].parent == -1 && program->code[info->frames[f].entry].op == OP_INPP)
+      cells = needed[f] == UNBOUNDED ? 0 : needed[f];
+  }
+
+  free(depth);
+  free(maxDepth);
+  free(needed);
+  freeCallGraph(graph);
+  free(targets);
+  freeFrames(info);
+  return cells;
+}
+
+// Writes a line per routine of the program with its frame size (parameters,
+// links, locals and temporaries) and the stack it needs, calls included.
+// Returns 0 if the file can't be written.
+int writeFrameReport(Program *program, char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) return 0;
+
+  FrameInfo *info = findFrames(program);
+  int *targets = labelTargets(program);
+  CallGraph *graph = buildCallGraph(program, info, targets);
+  int *depth = (int*)malloc((program->count + 1) * sizeof(int));
+  int *maxDepth = (int*)malloc((info->count + 1) * sizeof(int));
+  int *needed = (int*)malloc((info->count + 1) * sizeof(int));
+
+  frameStacks(program, info, targets, graph, depth, maxDepth, needed);
+  fprintf(file, "%-16s %5s %6s %6s %6s %9s %4s %9s  %s\n", "routine", "level", "params",
+          "locals", "frame", "stack", "leaf", "recursive", "calls");
+  for (int f = 0; f < info->count; f++) {
+    Frame *frame = &info->frames[f];
+    Instr *entry = &program->code[frame->entry];
+    int params = entry->op == OP_ENPR ? program->code[frame->exit].b : 0;
+    int links = entry->op == OP_ENPR ? 3 : 0;
+    char size[16], stack[16];
+
+    if (maxDepth[f] == UNBOUNDED)
+      strcpy(size, "?");
+    else
+      sprintf(size, "%d", params + links + maxDepth[f]);
+    if (needed[f] == UNBOUNDED)
+      strcpy(stack, "unbounded");
+    else
+      sprintf(stack, "%d", params + links + needed[f]);
+    fprintf(file, "%-16s %5d %6d %6d %6s %9s %4s %9s  ", routineName(entry->label),
+            frame->level, params, frame->locals, size, stack,
+            graph->leaf[f] ? "yes" : "no", graph->recursive[f] ? "yes" : "no");
+    int calls = 0;
+    for (int g = 0; g < info->count; g++) {
+      if (!graph->calls[f * info->count + g]) continue;
+      fprintf(file, "%s%s", calls++ > 0 ? "," : "",
+              routineName(program->code[info->frames[g].entry].label));
+    }
+    fprintf(file, "%s\n", calls == 0 ? "-" : "");
+  }
+
+  free(depth);
+  free(maxDepth);
+  free(needed);
+  freeCallGraph(graph);
+  free(targets);
+  freeFrames(info);
+  fclose(file);
+  return 1;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Client of the compile server (compiler --server <socket>). It sends the
+// program, or its path with --path, and prints the code to stdout and what
+// the compiler reported to stderr, exiting with 1 if the program didn't
+// compile. --shutdown stops the server.
+
+static int writeFully(int fd, char *buffer, long size) {
+  for (long done = 0; done < size;) {
+    ssize_t count = write(fd, buffer + done, size - done);
+    if (count <= 0) return 0;
+    done += count;
+  }
+  return 1;
+}
+
+// Copies size bytes of the answer to the file.
+static int copyAnswer(int fd, FILE *file, long size) {
+  char buffer[1 << 16];
+  while (size > 0) {
+    ssize_t count = read(fd, buffer, size < (long)sizeof(buffer) ? size : (long)sizeof(buffer));
+    if (count <= 0 || fwrite(buffer, 1, count, file) != (size_t)count) return 0;
+    size -= count;
+  }
+  return 1;
+}
+
+// Reads the whole source, from a file or stdin ("-").
+static char *readSource(char *path, long *size) {
+  FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  long capacity = 1 << 16;
+  char *data;
+
+  if (file == NULL) return NULL;
+  data = (char*)malloc(capacity);
+  *size = 0;
+  for (size_t count; (count = fread(data + *size, 1, capacity - *size, file)) > 0;) {
+    *size += count;
+    if (*size == capacity) {
+      capacity *= 2;
+      data = (char*)realloc(data, capacity);
+    }
+  }
+  if (file != stdin) fclose(file);
+  return data;
+}
+
+static int connectTo(char *socketPath) {
+  struct sockaddr_un address;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (fd == -1 || strlen(socketPath) >= sizeof(address.sun_path)) return -1;
+  strcpy(address.sun_path, socketPath);
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  int sendPath = 0, stop = 0, next = 1;
+  char header[64], status[16], line[128], resolved[PATH_MAX];
+  char *body;
+  long size, codeSize, messagesSize;
+
+  for (; next < argc && argv[next][0] == '-' && argv[next][1] == '-'; next++) {
+    if (strcmp(argv[next], "--path") == 0) sendPath = 1;
+    else if (strcmp(argv[next], "--shutdown") == 0) stop = 1;
+    else break;
+  }
+  if (argc - next != (stop ? 1 : 2)) {
+    fprintf(stderr, "Usage: %s [--path] <socket> <file>|-\n"
+                    "       %s --shutdown <socket>\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  int fd = connectTo(argv[next]);
+  if (fd == -1) {
+    perror("Error connecting to server");
+    return 1;
+  }
+  if (stop) {
+    int sent = writeFully(fd, "shutdown\n", 9);
+    close(fd);
+    return sent ? 0 : 1;
+  }
+
+  // the server opens paths from its own directory, so they go absolute
+  if (sendPath) {
+    if (realpath(argv[next + 1], resolved) == NULL) {
+      perror("Error opening file");
+      return 1;
+    }
+    body = strdup(resolved);
+    size = strlen(body);
+  } else if ((body = readSource(argv[next + 1], &size)) == NULL) {
+    perror("Error opening file");
+    return 1;
+  }
+  snprintf(header, sizeof(header), "%s %ld\n", sendPath ? "path" : "source", size);
+  if (!writeFully(fd, header, strlen(header)) || !writeFully(fd, body, size)) {
+    perror("Error sending request");
+    return 1;
+  }
+  free(body);
+
+  // the answer: "<status> <code size> <diagnostics size>", the code and the diagnostics
+  int length = 0;
+  while (length < (int)sizeof(line) - 1 && read(fd, &line[length], 1) == 1 && line[length] != '\n')
+    length++;
+  line[length] = '\0';
+  if (sscanf(line, "%15s %ld %ld", status, &codeSize, &messagesSize) != 3 ||
+      !copyAnswer(fd, stdout, codeSize) || !copyAnswer(fd, stderr, messagesSize)) {
+    fprintf(stderr, "Error: invalid answer from server\n");
+    return 1;
+  }
+  close(fd);
+  return strcmp(status, "ok") == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -2,28 +2,137 @@
 #include "header/lexer.h"
 #include "header/parser.h"
 #include "header/generator.h"
+#include "header/optimizer.h"
+#include "header/driver.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Adds the source files named in a file list, one per line, skipping empty
+// lines and lines starting with #. Returns 0 if the list can't be read.
+static int readFileList(char *listPath, char ***paths, int *count, int *capacity) {
+  FILE *file = fopen(listPath, "r");
+  char line[BUFFER_SIZE];
+
+  if (file == NULL) return 0;
+  while (fgets(line, BUFFER_SIZE, file) != NULL) {
+    char path[BUFFER_SIZE];
+    if (sscanf(line, "%2047s", path) != 1 || path[0] == '#') continue;
+    if (*count == *capacity) {
+      *capacity *= 2;
+      *paths = (char**)realloc(*paths, *capacity * sizeof(char*));
+    }
+    (*paths)[(*count)++] = strdup(path);
+  }
+  fclose(file);
+  return 1;
+}
 
 int main(int argc, char *argv[]) {
   Node *tokenList;
+  CompileOptions options = {"mepa", 0, 0, NULL, NULL, NULL};
+  int capacity = 16, count = 0, threads = -1, batch = 0;
+  char *socketPath = NULL;
+  char **paths = (char**)malloc(capacity * sizeof(char*));
+  int validUsage = 1;
+  struct timespec start, end;
+
+  // read the options and the source file paths
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      printStats = 1;
+    } else if (strcmp(argv[i], "--time") == 0) {
+      options.timed = 1;
+    } else if (strcmp(argv[i], "--time-passes") == 0) {
+      timePasses = 1;
+    } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' &&
+               argv[i][2] <= '2' && argv[i][3] == '\0') {
+      optimizationLevel = argv[i][2] - '0';
+    } else if (strncmp(argv[i], "--disable-pass=", 15) == 0) {
+      if (!disablePass(argv[i] + 15)) {
+        fprintf(stderr, "Error: unknown pass \"%s\"\n", argv[i] + 15);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--inline-threshold=", 19) == 0) {
+      char *end;
+      inlineThreshold = (int)strtol(argv[i] + 19, &end, 10);
+      if (end == argv[i] + 19 || *end != '\0' || inlineThreshold < 0) validUsage = 0;
+    } else if (strcmp(argv[i], "--emit=mepa") == 0 || strcmp(argv[i], "--emit=bin") == 0 ||
+               strcmp(argv[i], "--emit=c") == 0) {
+      options.emit = argv[i] + 7;
+    } else if (strcmp(argv[i], "--superinstructions") == 0) {
+      options.superinstructions = 1;
+    } else if (strncmp(argv[i], "--frame-report=", 15) == 0 && argv[i][15] != '\0') {
+      options.reportPath = argv[i] + 15;
+    } else if (strncmp(argv[i], "--line-table=", 13) == 0 && argv[i][13] != '\0') {
+      options.lineTablePath = argv[i] + 13;
+    } else if (strncmp(argv[i], "--output-dir=", 13) == 0 && argv[i][13] != '\0') {
+      options.outputDir = argv[i] + 13;
+    } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (strncmp(argv[i], "-j", 2) == 0) {
+      // -j N or -jN, where 0 means one thread per processor
+      char *value = argv[i][2] != '\0' ? argv[i] + 2 : i + 1 < argc ? argv[++i] : "", *end;
+      threads = (int)strtol(value, &end, 10);
+      if (end == value || *end != '\0' || threads < 0) validUsage = 0;
+      batch = 1;
+    } else if (argv[i][0] == '@' && argv[i][1] != '\0') {
+      if (!readFileList(argv[i] + 1, &paths, &count, &capacity)) {
+        perror("Error opening file list");
+        return 1;
+      }
+      batch = 1;
+    } else if (argv[i][0] != '-') {
+      if (count == capacity) {
+        capacity *= 2;
+        paths = (char**)realloc(paths, capacity * sizeof(char*));
+      }
+      paths[count++] = argv[i];
+    } else {
+      validUsage = 0;
+    }
+  }
+  if (count > 1) batch = 1;
 
-  // check if the number of passed arguments is less than 2
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+  // a single source file goes to stdout, a batch to a file per source and a
+  // server answers with the code; the frame report and line table are
+  // written for a single file only
+  int multiple = batch || socketPath != NULL;
+  if (!validUsage || (count == 0 && !multiple) || (socketPath != NULL && count > 0) ||
+      (multiple && (options.reportPath != NULL || options.lineTablePath != NULL)) ||
+      ((!batch || socketPath != NULL) && options.outputDir != NULL)) {
+    fprintf(stderr, "Usage: %s [-O0|-O1|-O2] [--disable-pass=<pass>] "
+                    "[--inline-threshold=<n>] [--frame-report=<path>] [--line-table=<path>] "
+                    "[--emit=mepa|bin|c] "
+                    "[--superinstructions] [--time] [--time-passes] [--stats] <file>\n"
+                    "       %s [options] [-j <threads>] [--output-dir=<dir>] "
+                    "<file>... | @<file list>\n"
+                    "       %s [options] [-j <threads>] --server <socket>\n",
+            argv[0], argv[0], argv[0]);
     return 1;
   }
+  if (socketPath != NULL) return runServer(socketPath, threads > 0 ? threads : 0, &options);
+  if (batch) return compileBatch(paths, count, threads > 0 ? threads : 0, &options) == 0 ? 0 : 1;
+  char *sourcePath = paths[0];
+  diagnostics = stderr;
 
   // try to open the pascal file in read mode
-  FILE *sourceFile = fopen(argv[1], "r");
+  FILE *sourceFile = fopen(sourcePath, "r");
   if (sourceFile == NULL) {
     perror("Error opening file");
     return 1;
   }
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
   tokenList = lexer(sourceFile);
   // printTokenList(tokenList);
   // printTokensCount(tokenList);
-  parser(tokenList);
-  printCode();  
+  if (!compileProgram(tokenList, stdout, &options)) return 1;
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (options.timed)
+    fprintf(stderr, "compiled in %.3f ms\n",
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
 
   // close the file
   fclose(sourceFile);
@@ -0,0 +1,241 @@
+#include "header/driver.h"
+#include "header/lexer.h"
+#include "header/parser.h"
+#include "header/generator.h"
+#include "header/optimizer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// A file of a batch and how its compilation went.
+typedef struct Unit {
+  char *path;
+  char outputPath[BUFFER_SIZE];
+  CompileStatus status;
+  int instructions;
+  char *diagnostics;        // what the compiler reported, written in order
+  size_t diagnosticsSize;
+  int done;
+} Unit;
+
+typedef struct Batch {
+  Unit *units;
+  int count;
+  int *order;               // units by decreasing size of their source
+  int next;                 // next unit of order to compile
+  int written;              // units whose diagnostics are written
+  pthread_mutex_t lock;
+  CompileOptions *options;
+} Batch;
+
+static double elapsedMs(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// Compiles the tokens of a program and writes its code to the output, in
+// the form the options ask for. Errors in the program stop the compilation
+// in the parser. Returns 0 if the frame report or line table can't be
+// written.
+int compileProgram(Node *tokenList, FILE *output, CompileOptions *options) {
+  parser(tokenList);
+  optimizeCode();
+  if (options->reportPath != NULL && !writeFrameReport(code, options->reportPath)) {
+    fprintf(diagnostics, "Error writing frame report: %s\n", strerror(errno));
+    return 0;
+  }
+  // binary programs carry the stack they need, for the VM to allocate
+  if (strcmp(options->emit, "bin") == 0) code->stackSize = programStack(code);
+  if (options->superinstructions) fuseInstructions(code);
+  // the line table numbers the instructions as they are written
+  if (options->lineTablePath != NULL && !writeLineTable(options->lineTablePath)) {
+    fprintf(diagnostics, "Error writing line table: %s\n", strerror(errno));
+    return 0;
+  }
+  if (strcmp(options->emit, "bin") == 0)
+    writeBinaryProgram(code, output);
+  else if (strcmp(options->emit, "c") == 0)
+    writeCProgram(code, output);
+  else
+    printCode(output);
+  return 1;
+}
+
+// Compiles the program read from the source on the calling thread, writing
+// its code to the output and what the compiler reports to the thread's
+// diagnostics. An error in the program comes back here instead of exiting,
+// and the state of the compilation is freed either way.
+CompileStatus compileStream(FILE *source, FILE *output, CompileOptions *options,
+                            int *instructions) {
+  Node *tokenList = lexer(source);
+  CompileStatus status;
+  jmp_buf abort;
+
+  compileAbort = &abort;
+  if (setjmp(abort) == 0) {
+    status = compileProgram(tokenList, output, options) ? COMPILE_OK : COMPILE_FAILED;
+    *instructions = code->count;
+  } else {
+    status = COMPILE_REJECTED;
+  }
+  compileAbort = NULL;
+  freeTokenList(tokenList);
+  freeSymbols();
+  freeCodeGenerator();
+  return status;
+}
+
+// Batches
+
+// Names the output of a source file: its path, or its name in the output
+// directory, with the extension of the code (.mepa, .bin or .c) instead of
+// .pas.
+static void outputPath(char *path, CompileOptions *options, char *output) {
+  char *name = path, *slash = strrchr(path, '/');
+  size_t length;
+
+  if (options->outputDir != NULL && slash != NULL) name = slash + 1;
+  length = strlen(name);
+  if (length > 4 && strcmp(name + length - 4, ".pas") == 0) length -= 4;
+  if (options->outputDir != NULL)
+    snprintf(output, BUFFER_SIZE, "%s/%.*s.%s", options->outputDir, (int)length, name,
+             options->emit);
+  else
+    snprintf(output, BUFFER_SIZE, "%.*s.%s", (int)length, name, options->emit);
+}
+
+// Compiles a file of the batch on the calling thread, into a buffer that is
+// only written out when the whole compilation succeeds.
+static void compileUnit(Batch *batch, Unit *unit) {
+  char *text = NULL;
+  size_t textSize = 0;
+  FILE *output = open_memstream(&text, &textSize), *source;
+  struct timespec start, end;
+
+  diagnostics = open_memstream(&unit->diagnostics, &unit->diagnosticsSize);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unit->status = COMPILE_FAILED;
+  source = fopen(unit->path, "r");
+  if (source == NULL) {
+    fprintf(diagnostics, "Error opening file: %s\n", strerror(errno));
+  } else {
+    unit->status = compileStream(source, output, batch->options, &unit->instructions);
+    fclose(source);
+  }
+  fclose(output);
+
+  if (unit->status == COMPILE_OK) {
+    FILE *file = fopen(unit->outputPath, "wb");
+    if (file == NULL || fwrite(text, 1, textSize, file) != textSize) {
+      fprintf(diagnostics, "Error writing %s: %s\n", unit->outputPath, strerror(errno));
+      unit->status = COMPILE_FAILED;
+    }
+    if (file != NULL && fclose(file) != 0) unit->status = COMPILE_FAILED;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (batch->options->timed)
+    fprintf(diagnostics, "compiled in %.3f ms\n", elapsedMs(start, end));
+  fclose(diagnostics);
+  diagnostics = NULL;
+  free(text);
+}
+
+// Writes what the compiler reported for each file, its path before every
+// line, as soon as every file before it is done, so the diagnostics come
+// in the order of the batch whichever thread compiled them.
+static void writeDiagnostics(Batch *batch) {
+  while (batch->written < batch->count && batch->units[batch->written].done) {
+    Unit *unit = &batch->units[batch->written++];
+    char *line = unit->diagnostics;
+    while (line != NULL && *line != '\0') {
+      char *end = strchr(line, '\n');
+      int length = end != NULL ? (int)(end - line) : (int)strlen(line);
+      fprintf(stderr, "%s: %.*s\n", unit->path, length, line);
+      line = end != NULL ? end + 1 : line + length;
+    }
+    free(unit->diagnostics);
+    unit->diagnostics = NULL;
+  }
+}
+
+static void *work(void *argument) {
+  Batch *batch = (Batch*)argument;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    int next = batch->next < batch->count ? batch->order[batch->next++] : -1;
+    pthread_mutex_unlock(&batch->lock);
+    if (next == -1) break;
+
+    compileUnit(batch, &batch->units[next]);
+    pthread_mutex_lock(&batch->lock);
+    batch->units[next].done = 1;
+    writeDiagnostics(batch);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+// A unit and its size, to sort the units.
+typedef struct Sized {
+  long size;
+  int index;
+} Sized;
+
+static int compareSizes(const void *a, const void *b) {
+  long x = ((Sized*)a)->size, y = ((Sized*)b)->size;
+  return x < y ? 1 : x > y ? -1 : ((Sized*)a)->index - ((Sized*)b)->index;
+}
+
+// Compiles every file on a pool of threads (one per processor when threads
+// is 0), writing each one's code next to it or to the output directory, and
+// then a summary of the
+// batch to stderr. Larger files start first so that no thread is left with
+// a long one at the end. Returns the number of files that didn't compile.
+int compileBatch(char **paths, int count, int threads, CompileOptions *options) {
+  Batch batch = {NULL, count, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, options};
+  struct timespec start, end;
+  struct stat info;
+  Sized *sizes = (Sized*)malloc((count > 0 ? count : 1) * sizeof(Sized));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  batch.units = (Unit*)calloc(count > 0 ? count : 1, sizeof(Unit));
+  batch.order = (int*)malloc((count > 0 ? count : 1) * sizeof(int));
+  for (int i = 0; i < count; i++) {
+    batch.units[i].path = paths[i];
+    outputPath(paths[i], options, batch.units[i].outputPath);
+    sizes[i] = (Sized){stat(paths[i], &info) == 0 ? (long)info.st_size : 0, i};
+  }
+  qsort(sizes, count, sizeof(Sized), compareSizes);
+  for (int i = 0; i < count; i++) batch.order[i] = sizes[i].index;
+  free(sizes);
+
+  if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count) threads = count;
+  if (threads < 1) threads = 1;
+  pthread_t *workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, work, &batch);
+  for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  int compiled = 0, rejected = 0, failed = 0;
+  long instructions = 0;
+  for (int i = 0; i < count; i++) {
+    Unit *unit = &batch.units[i];
+    compiled += unit->status == COMPILE_OK;
+    rejected += unit->status == COMPILE_REJECTED;
+    failed += unit->status == COMPILE_FAILED;
+    if (unit->status == COMPILE_OK) instructions += unit->instructions;
+  }
+  fprintf(stderr, "compiled %d of %d files (%d rejected, %d failed), %ld instructions, "
+                  "%d threads, %.3f ms\n",
+          compiled, count, rejected, failed, instructions, threads, elapsedMs(start, end));
+  pthread_mutex_destroy(&batch.lock);
+  free(workers);
+  free(batch.units);
+  free(batch.order);
+  return rejected + failed;
+}
\ No newline at end of file
@@ -0,0 +1,285 @@
+#include "header/optimizer.h"
+#include "header/parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define EVAL_STEPS 100000       // instructions run for a single call
+#define EVAL_DEPTH 64           // activations open at once
+#define EVAL_CELLS 4096         // stack cells
+#define EVAL_LEVELS 64          // display registers
+
+// Purity
+
+// Instructions a pure function may run, besides CRVL/ARMZ of its own frame
+// and calls of pure functions.
+static int isEvaluable(Opcode op) {
+  int pops, pushes;
+  if (isPure(op, &pops, &pushes)) return op != OP_CRVI && op != OP_CREN;
+  switch (op) {
+    case OP_AMEM: case OP_DMEM: case OP_NADA: case OP_ARMZ:
+    case OP_DIVI: case OP_DIVF: case OP_DSVS: case OP_DSVF:
+    case OP_CHPR: case OP_ENPR: case OP_RTPR:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Finds the functions that only read their parameters and locals, assign
+// their result and call other such functions. pure[f] is set for them.
+static void findPureFunctions(Program *program, FrameInfo *info, int *targets,
+                              char *pure) {
+  for (int f = 0; f < info->count; f++) {
+    Frame *frame = &info->frames[f];
+    int params, isFunction = 0;
+
+    pure[f] = 0;
+    if (program->code[frame->entry].op != OP_ENPR) continue;
+    params = program->code[frame->exit].b;
+    pure[f] = 1;
+    for (int g = 0; g < info->count; g++)
+      if (info->frames[g].parent == f) pure[f] = 0;
+    for (int i = frame->entry; i <= frame->exit && pure[f]; i++) {
+      Instr *instr = &program->code[i];
+      if (!isEvaluable(instr->op)) pure[f] = 0;
+      if ((instr->op == OP_CRVL || instr->op == OP_ARMZ) && instr->a != frame->level)
+        pure[f] = 0;
+      if (instr->op == OP_CHPR && targets[i] == -1) pure[f] = 0;
+      if (instr->op == OP_ARMZ && instr->b == -(params + 4)) isFunction = 1;
+    }
+    if (!isFunction) pure[f] = 0;
+  }
+
+  // a function calling an impure one isn't pure either
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int i = 0; i < program->count; i++) {
+      int f = info->frameOf[i];
+      if (program->code[i].op != OP_CHPR || f == -1 || !pure[f]) continue;
+      if (!pure[info->frameOf[targets[i]]]) {
+        pure[f] = 0;
+        changed = 1;
+      }
+    }
+  }
+}
+
+// Evaluation
+
+// A MEPA machine running pure functions over compile-time constants.
+typedef struct Machine {
+  Constant cells[EVAL_CELLS];
+  char defined[EVAL_CELLS];
+  int display[EVAL_LEVELS];
+  int top, depth;
+} Machine;
+
+static int push(Machine *m, Constant value) {
+  if (m->top + 1 >= EVAL_CELLS) return 0;
+  m->cells[++m->top] = value;
+  m->defined[m->top] = 1;
+  return 1;
+}
+
+// Runs the binary operation on the two values on top of the stack.
+static int binary(Machine *m, char *op) {
+  Constant result;
+  if (m->top < 1 || !m->defined[m->top] || !m->defined[m->top - 1]) return 0;
+  if (!foldBinary(op, m->cells[m->top - 1], m->cells[m->top], &result)) return 0;
+  m->top -= 2;
+  return push(m, result);
+}
+
+static char *binaryOperator(Opcode op) {
+  switch (op) {
+    case OP_SOMA: case OP_SOMF: return "+";
+    case OP_SUBT: case OP_SUBF: return "-";
+    case OP_MULT: case OP_MULF: return "*";
+    case OP_DIVF: return "/";
+    case OP_DIVI: return "div";
+    case OP_CONJ: return "and";
+    case OP_DISJ: return "or";
+    case OP_CMIG: return "=";
+    case OP_CMDG: return "<>";
+    case OP_CMME: return "<";
+    case OP_CMEG: return "<=";
+    case OP_CMAG: return ">=";
+    case OP_CMMA: return ">";
+    default: return NULL;
+  }
+}
+
+// Runs the call at index over the constant arguments pushed before it.
+// Returns 0 if it can't be done within the limits, or the code would fail
+// or read an unassigned value.
+static int evaluateCall(Program *program, int *targets, int call, Constant *args,
+                        int count, Constant *result) {
+  Machine *m = (Machine*)calloc(1, sizeof(Machine));
+  int pc = call, ok = 1;
+
+  m->top = -1;
+  m->top++;                             // the result
+  for (int i = 0; i < count; i++) push(m, args[i]);
+
+  for (int steps = 0; ok && steps < EVAL_STEPS; steps++) {
+    Instr *instr = &program->code[pc];
+    Constant *topValue = &m->cells[m->top];
+    int next = pc + 1, address;
+
+    switch (instr->op) {
+      case OP_CHPR:
+        if (++m->depth > EVAL_DEPTH || instr->a >= EVAL_LEVELS) {
+          ok = 0;
+          break;
+        }
+        ok = push(m, intConstant(pc + 1)) && push(m, intConstant(instr->a));
+        next = targets[pc];
+        break;
+      case OP_ENPR:
+        if (instr->a >= EVAL_LEVELS) {
+          ok = 0;
+          break;
+        }
+        ok = push(m, intConstant(m->display[instr->a]));
+        m->display[instr->a] = m->top + 1;
+        break;
+      case OP_RTPR:
+        m->display[instr->a] = (int)m->cells[m->top].intValue;
+        next = (int)m->cells[m->top - 2].intValue;
+        m->top -= instr->b + 3;
+        if (--m->depth == 0) {
+          *result = m->cells[0];
+          ok = m->defined[0] ? 2 : 0;
+        }
+        break;
+      case OP_AMEM:
+        if (m->top + instr->a >= EVAL_CELLS) {
+          ok = 0;
+          break;
+        }
+        for (int i = 1; i <= instr->a; i++) m->defined[m->top + i] = 0;
+        m->top += instr->a;
+        break;
+      case OP_DMEM:
+        m->top -= instr->a;
+        break;
+      case OP_NADA:
+        break;
+      case OP_CRCT:
+        ok = push(m, instr->value);
+        break;
+      case OP_CRVL:
+        address = m->display[instr->a] + instr->b;
+        ok = address >= 0 && address <= m->top && m->defined[address] &&
+             push(m, m->cells[address]);
+        break;
+      case OP_ARMZ:
+        address = m->display[instr->a] + instr->b;
+        ok = address >= 0 && address < m->top && m->defined[m->top];
+        if (ok) {
+          m->cells[address] = *topValue;
+          m->defined[address] = 1;
+          m->top--;
+        }
+        break;
+      case OP_DSVS:
+        next = targets[pc];
+        break;
+      case OP_DSVF:
+        ok = m->defined[m->top];
+        if (ok && topValue->intValue == 0) next = targets[pc];
+        m->top--;
+        break;
+      case OP_INVR:
+        ok = m->defined[m->top] && topValue->intValue != LONG_MIN;
+        topValue->intValue = -topValue->intValue;
+        break;
+      case OP_INVF:
+        ok = m->defined[m->top];
+        topValue->realValue = -topValue->realValue;
+        break;
+      case OP_NEGA:
+        ok = m->defined[m->top];
+        *topValue = intConstant(!topValue->intValue);
+        break;
+      case OP_ITOF:
+        ok = m->defined[m->top];
+        *topValue = realConstant((double)topValue->intValue);
+        break;
+      case OP_CMPF: {
+        ok = m->top >= 1 && m->defined[m->top] && m->defined[m->top - 1];
+        if (!ok) break;
+        Constant a = m->cells[m->top - 1], b = m->cells[m->top];
+        double x = a.isReal ? a.realValue : a.intValue, y = b.isReal ? b.realValue : b.intValue;
+        m->top -= 2;
+        ok = push(m, intConstant((x > y) - (x < y)));
+        break;
+      }
+      default:
+        ok = binaryOperator(instr->op) != NULL && binary(m, binaryOperator(instr->op));
+        break;
+    }
+    if (ok == 2) break;
+    if (m->top < -1) ok = 0;
+    pc = next;
+    if (pc < 0 || pc >= program->count) ok = 0;
+  }
+
+  free(m);
+  return ok == 2;
+}
+
+// Replaces the calls of pure functions with constant arguments by the
+// result they give, worked out at compile time within step and recursion
+// limits. Calls that would fail at runtime are left alone. Returns the
+// number of calls replaced.
+int evaluatePureCalls(Program *program) {
+  int evaluated = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+    char *pure = (char*)malloc(info->count + 1);
+
+    findPureFunctions(program, info, targets, pure);
+    changed = 0;
+    for (int call = 0; call < program->count && !changed; call++) {
+      if (program->code[call].op != OP_CHPR || targets[call] == -1 ||
+          !pure[info->frameOf[targets[call]]])
+        continue;
+
+      // AMEM 1, then a CRCT per argument
+      Frame *callee = &info->frames[info->frameOf[targets[call]]];
+      int params = program->code[callee->exit].b, start = call - params - 1;
+      int constant = start >= 0 && program->code[start].op == OP_AMEM &&
+                     program->code[start].a == 1;
+      for (int i = start + 1; constant && i <= call; i++) {
+        if (program->code[i].label[0] != '\0' || (i < call && program->code[i].op != OP_CRCT))
+          constant = 0;
+      }
+      if (!constant) continue;
+
+      Constant *args = (Constant*)malloc((params + 1) * sizeof(Constant)), result;
+      for (int i = 0; i < params; i++) args[i] = program->code[start + 1 + i].value;
+      if (evaluateCall(program, targets, call, args, params, &result)) {
+        Instr *value = &program->code[start];
+        value->op = OP_CRCT;
+        value->a = value->b = 0;
+        value->value = result;
+        for (int i = start + 1; i <= call; i++) deleteInstr(program, i);
+        compactProgram(program);
+        changed = 1;
+        evaluated++;
+      }
+      free(args);
+    }
+    free(pure);
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "purecall: evaluated %d calls\n", evaluated);
+  return evaluated;
+}
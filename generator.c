@@ -2,27 +2,139 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
 
-CodeNode *codeList = NULL;
+_Thread_local Program *code = NULL;
+_Thread_local int labelCount = 0;
+_Thread_local int codeLine = 0, codeColumn = 0;
+_Thread_local FILE *diagnostics = NULL;
+_Thread_local jmp_buf *compileAbort = NULL;
 
-// Adds a MEPA instruction to the code.
+// Source names of the routines, by entry label ("" for the main program).
+typedef struct RoutineName {
+  char label[LABEL_SIZE];
+  char name[BUFFER_SIZE];
+} RoutineName;
+
+static _Thread_local RoutineName *routineNames = NULL;
+static _Thread_local int routineNameCount = 0;
+
+// Adds a MEPA instruction to the end of the code.
 void addCode(char *instruction) {
-  CodeNode *newNode = (CodeNode*)malloc(sizeof(CodeNode));
-  strcpy(newNode->instruction, instruction);
-  newNode->next = codeList;
-  codeList = newNode;
+  insertCode(code->count, instruction);
+}
+
+// Adds a MEPA instruction built from a printf-like format.
+void addCodef(char *format, ...) {
+  char instruction[BUFFER_SIZE];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(instruction, BUFFER_SIZE, format, args);
+  va_end(args);
+  addCode(instruction);
+}
+
+// Returns the position of the next instruction, to insert code there later.
+int codeMark() {
+  return code->count;
+}
+
+// Inserts a MEPA instruction before the one at the given position.
+void insertCode(int index, char *instruction) {
+  Instr instr;
+  if (parseInstruction(instruction, &instr) != 1) {
+    fprintf(diagnostics, "Error: invalid instruction \"%s\" generated\n", instruction);
+    abortCompilation();
+  }
+  instr.line = codeLine;
+  instr.column = codeColumn;
+  insertInstr(code, index, instr);
+}
+
+// Marks the last instruction, an AMEM or DMEM, as the allocation or release
+// of the locals of the routine, which the optimizer can't tell apart from
+// the AMEM reserving a function result by its operands.
+void markFrameLocals() {
+  code->code[code->count - 1].frameLocals = 1;
+}
+
+// Writes a new unique MEPA label into the buffer.
+void newLabel(char *label) {
+  snprintf(label, LABEL_SIZE, "L%d", ++labelCount);
+}
+
+// Records the source name of the routine entered at the label.
+void nameRoutine(char *label, char *name) {
+  routineNames = (RoutineName*)realloc(routineNames,
+                                       (routineNameCount + 1) * sizeof(RoutineName));
+  snprintf(routineNames[routineNameCount].label, LABEL_SIZE, "%s", label);
+  snprintf(routineNames[routineNameCount].name, BUFFER_SIZE, "%s", name);
+  routineNameCount++;
+}
+
+// Returns the source name of the routine entered at the label, or the label.
+char *routineName(char *label) {
+  for (int i = 0; i < routineNameCount; i++) {
+    if (strcmp(routineNames[i].label, label) == 0) return routineNames[i].name;
+  }
+  return label;
+}
+
+// Writes the line table of the code to the file: the name of the program and
+// of each routine by entry label, then the source line and column of the
+// statement each instruction came from. Instructions the optimizer made
+// take the position of the one before them. Returns 0 if it can't be written.
+int writeLineTable(char *path) {
+  FILE *file = fopen(path, "w");
+  int line = 0, column = 0;
+
+  if (file == NULL) return 0;
+  for (int i = 0; i < routineNameCount; i++) {
+    if (routineNames[i].label[0] == '\0')
+      fprintf(file, "program %s\n", routineNames[i].name);
+    else if (findLabel(code, routineNames[i].label) != -1)
+      fprintf(file, "routine %s %s\n", routineNames[i].label, routineNames[i].name);
+  }
+  for (int i = 0; i < code->count; i++) {
+    if (code->code[i].line > 0) {
+      line = code->code[i].line;
+      column = code->code[i].column;
+    }
+    fprintf(file, "%d %d %d\n", i, line, column);
+  }
+  return fclose(file) == 0;
 }
 
 // Initialises code generator.
 void initCodeGenerator() {
-  codeList = NULL;
+  freeCodeGenerator();
+  code = newProgram();
+  labelCount = 0;
+  codeLine = codeColumn = 0;
+}
+
+// Frees the code and routine names of the last compilation.
+void freeCodeGenerator() {
+  if (code != NULL) freeProgram(code);
+  code = NULL;
+  free(routineNames);
+  routineNames = NULL;
+  routineNameCount = 0;
+}
+
+// Stops the compilation after its error was reported: a batch goes on with
+// the next file, and a single compilation exits.
+void abortCompilation() {
+  if (compileAbort != NULL) longjmp(*compileAbort, 1);
+  exit(1);
 }
 
-// Prints the generated MEPA code.
-void printCode() {
-  CodeNode *current = codeList;
-  while (current != NULL) {
-    printf("%s\n", current->instruction);
-    current = current->next;
+// Prints the generated MEPA code to the file.
+void printCode(FILE *file) {
+  char instruction[BUFFER_SIZE];
+  for (int i = 0; i < code->count; i++) {
+    formatInstruction(&code->code[i], instruction);
+    fprintf(file, "%s\n", instruction);
   }
 }
\ No newline at end of file
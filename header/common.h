@@ -2,6 +2,7 @@
 #define COMMON_H
 
 #define BUFFER_SIZE 2048
+#define LABEL_SIZE 32
 
 typedef enum TokenType {
   KEYWORD,
@@ -26,4 +27,11 @@ typedef struct Node {
   struct Node *next;
 } Node;
 
+// Compile-time value of an expression, a variable or a MEPA constant.
+typedef struct Constant {
+  int isReal;
+  long intValue;
+  double realValue;
+} Constant;
+
 #endif // COMMON_H
\ No newline at end of file
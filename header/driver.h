@@ -0,0 +1,30 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include "common.h"
+#include <stdio.h>
+
+// How to compile, the same for every file of a batch.
+typedef struct CompileOptions {
+  char *emit;                 // "mepa", "bin" or "c"
+  int superinstructions;
+  int timed;                  // report how long each file took
+  char *reportPath;           // frame report, or NULL
+  char *lineTablePath;        // line table, or NULL
+  char *outputDir;            // where a batch writes the code, NULL for next to each file
+} CompileOptions;
+
+// How the compilation of a file went.
+typedef enum CompileStatus {
+  COMPILE_OK,
+  COMPILE_REJECTED,           // the compiler found an error in it
+  COMPILE_FAILED              // it couldn't be read or its code written
+} CompileStatus;
+
+int compileProgram(Node *tokenList, FILE *output, CompileOptions *options);
+CompileStatus compileStream(FILE *source, FILE *output, CompileOptions *options,
+                            int *instructions);
+int compileBatch(char **paths, int count, int threads, CompileOptions *options);
+int runServer(char *socketPath, int threads, CompileOptions *options);
+
+#endif // DRIVER_H
\ No newline at end of file
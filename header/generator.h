@@ -2,16 +2,34 @@
 #define GENERATOR_H
 
 #include "common.h"
+#include "ir.h"
+#include <setjmp.h>
+#include <stdio.h>
 
-typedef struct CodeNode {
-  char instruction[BUFFER_SIZE];
-  struct CodeNode *next;
-} CodeNode;
+// The state of a compilation is kept per thread, so that a batch compiles
+// files on several threads at once.
 
-extern CodeNode *codeList;
+// The generated code, kept as instructions for the optimizer.
+extern _Thread_local Program *code;
+// Source position given to the instructions generated from now on.
+extern _Thread_local int codeLine, codeColumn;
+// Where errors and statistics go: stderr, or a buffer of the batch worker.
+extern _Thread_local FILE *diagnostics;
+// Where an error goes back to in a batch, NULL to exit instead.
+extern _Thread_local jmp_buf *compileAbort;
 
 void addCode(char *instruction);
+void addCodef(char *format, ...);
+int codeMark();
+void insertCode(int index, char *instruction);
+void markFrameLocals();
+void newLabel(char *label);
+void nameRoutine(char *label, char *name);
+char *routineName(char *label);
 void initCodeGenerator();
-void printCode();
+void freeCodeGenerator();
+void abortCompilation();
+void printCode(FILE *file);
+int writeLineTable(char *path);
 
 #endif // GENERATOR_H
\ No newline at end of file
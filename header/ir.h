@@ -0,0 +1,79 @@
+#ifndef IR_H
+#define IR_H
+
+#include "common.h"
+#include <stdio.h>
+
+// MEPA instructions, in the order of opcodeNames[]
+typedef enum Opcode {
+  OP_INPP, OP_PARA, OP_AMEM, OP_DMEM, OP_NADA,
+  OP_CRCT, OP_CRVL, OP_ARMZ, OP_CRVI, OP_ARMI, OP_CREN,
+  OP_SOMA, OP_SUBT, OP_MULT, OP_DIVI, OP_INVR,
+  OP_CONJ, OP_DISJ, OP_NEGA,
+  OP_CMME, OP_CMMA, OP_CMIG, OP_CMDG, OP_CMEG, OP_CMAG,
+  OP_DSVS, OP_DSVF, OP_DSVR, OP_ENRT,
+  OP_CHPR, OP_ENPR, OP_RTPR,
+  OP_LEIT, OP_IMPR,
+  OP_DIVF, OP_SOMF, OP_SUBF, OP_MULF, OP_INVF, OP_CMPF, OP_ITOF,
+  OP_LEIF, OP_IMPF,
+  OP_INCV, OP_SOVV,
+  OP_DVME, OP_DVMA, OP_DVIG, OP_DVDG, OP_DVEG, OP_DVAG,
+  OP_CRVX, OP_ARMX, OP_VERI,
+  OP_COUNT,
+  OP_NONE = OP_COUNT      // removed instruction, dropped by compactProgram()
+} Opcode;
+
+typedef enum OperandKind {
+  NO_OPERANDS,
+  ONE_NUMBER,             // AMEM m, ENPR k
+  TWO_NUMBERS,            // CRVL k n, RTPR k n, ENRT k n, VERI lo hi
+  CONSTANT_OPERAND,       // CRCT c
+  LABEL_OPERAND,          // DSVS p
+  LABEL_AND_NUMBER,       // CHPR p k
+  LABEL_AND_TWO_NUMBERS,  // DSVR p j k
+  TWO_NUMBERS_AND_CONSTANT, // INCV k n c
+  FOUR_NUMBERS,           // SOVV k n1 n2 n3, CRVX k n lo hi
+  LABEL_AND_THREE_NUMBERS // DVEG p k n1 n2
+} OperandKind;
+
+// The IR is the MEPA code itself: a linear list of stack instructions with
+// labels, not SSA or three-address code. Values have no names while on the
+// operand stack, and variables are frame slots stored any number of times.
+typedef struct Instr {
+  Opcode op;
+  char label[LABEL_SIZE];   // label defined at this instruction, or ""
+  char target[LABEL_SIZE];  // label operand, or ""
+  int a, b, c, d;           // numeric operands
+  Constant value;           // CRCT operand
+  int line, column;         // source position of its statement, 0 if unknown
+  int frameLocals;          // an AMEM/DMEM of a routine's locals, not of a function
+                            // result or a value dropped
+} Instr;
+
+typedef struct Program {
+  Instr *code;
+  int count, capacity;
+  long stackSize;           // cells of stack the program needs, 0 if unknown
+} Program;
+
+extern const char *opcodeNames[];
+extern const OperandKind operandKinds[];
+
+Program *newProgram();
+void freeProgram(Program *program);
+Instr *appendInstr(Program *program, Instr instr);
+void insertInstr(Program *program, int index, Instr instr);
+void compactProgram(Program *program);
+Instr makeInstr(Opcode op, int a, int b);
+int parseInstruction(char *text, Instr *instr);
+void formatConstant(Constant c, char *buffer);
+void formatInstruction(Instr *instr, char *buffer);
+int *labelTargets(Program *program);
+int findLabel(Program *program, char *label);
+Program *readProgram(FILE *file, int *errorLine);
+void writeBinaryProgram(Program *program, FILE *file);
+void writeCProgram(Program *program, FILE *file);
+int fuseInstructions(Program *program);
+long stackSlack(Program *program);
+
+#endif // IR_H
\ No newline at end of file
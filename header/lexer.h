@@ -7,5 +7,6 @@
 Node *lexer(FILE *sourceFile);
 void printTokenList(Node *tokenList);
 void printTokensCount(Node *list);
+void freeTokenList(Node *tokenList);
 
 #endif // LEXER_H
\ No newline at end of file
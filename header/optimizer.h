@@ -0,0 +1,93 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "ir.h"
+
+// A routine activation record: the main program or a procedure/function,
+// from its INPP/ENPR up to its PARA/RTPR (nested routines included).
+typedef struct Frame {
+  int level;
+  int entry, exit;
+  int parent;             // enclosing frame, -1 for the main program
+  int alloc, release;     // AMEM and DMEM of the locals, -1 if there are none
+  int locals;
+} Frame;
+
+typedef struct FrameInfo {
+  Frame *frames;
+  int count;
+  int *frameOf;           // innermost frame of each instruction
+} FrameInfo;
+
+typedef struct Block {
+  int start, end;         // first and last instruction
+  int succ[2];
+  int succCount;
+} Block;
+
+typedef struct CFG {
+  Block *blocks;
+  int count;
+  int *blockOf;           // block of each instruction
+  int *targets;           // resolved label operand of each instruction
+} CFG;
+
+// Calls between the frames of a FrameInfo, as a count x count matrix.
+typedef struct CallGraph {
+  int count;
+  char *calls;            // calls[caller * count + callee]
+  char *reachable;        // called, directly or not, by the main program
+  char *leaf;             // calls nothing
+  char *recursive;        // calls itself, directly or not
+} CallGraph;
+
+// A pass rewrites the instruction list in place. With no SSA form, def-use
+// chains or dominator tree, a pass recovers what it needs from the stack
+// code (frames, blocks, the stack effect of each instruction) and matches
+// the instruction sequences it knows, leaving any other code alone.
+typedef struct Pass {
+  char *name;
+  int minLevel;           // lowest -O level that runs the pass
+  int (*run)(Program *program);
+  int disabled;
+} Pass;
+
+extern Pass passes[];
+extern int passCount;
+extern int optimizationLevel;
+extern int timePasses;
+extern int printStats;
+extern int inlineThreshold;
+
+FrameInfo *findFrames(Program *program);
+int accessFrame(FrameInfo *info, int index, int level);
+void freeFrames(FrameInfo *info);
+CFG *buildCFG(Program *program);
+void freeCFG(CFG *cfg);
+void deleteInstr(Program *program, int index);
+int isPure(Opcode op, int *pops, int *pushes);
+int isSlotAccess(Opcode op);
+int addLocals(Program *program, int index, int count);
+int stackEffect(Program *program, FrameInfo *info, int *targets, int index,
+                int *known);
+int findArguments(Program *program, FrameInfo *info, int *targets, int call,
+                  int count, int *starts);
+CallGraph *buildCallGraph(Program *program, FrameInfo *info, int *targets);
+void freeCallGraph(CallGraph *graph);
+int removeDeadRoutines(Program *program);
+int writeFrameReport(Program *program, char *path);
+long programStack(Program *program);
+int evaluatePureCalls(Program *program);
+int eliminateDeadCode(Program *program);
+int shareSlots(Program *program);
+int inlineCalls(Program *program);
+int copyVarParams(Program *program);
+int eliminateTailCalls(Program *program);
+int hoistInvariants(Program *program);
+int reduceStrength(Program *program);
+int removeBoundsChecks(Program *program);
+int passEnabled(char *name);
+int disablePass(char *name);
+void optimizeCode();
+
+#endif // OPTIMIZER_H
\ No newline at end of file
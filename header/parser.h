@@ -2,6 +2,7 @@
 #define PARSER_H
 
 #include "common.h"
+#include "generator.h"
 
 typedef enum ErrorType {
   UNEXPECTED_TYPE,
@@ -10,14 +11,67 @@ typedef enum ErrorType {
   INVALID_STATEMENT,
   INVALID_FACTOR,
   UNDECLARED_SYMBOL,
-  INVALID_END
+  INVALID_END,
+  INVALID_ASSIGNMENT,
+  INVALID_CALL,
+  INVALID_ARGUMENT,
+  TYPE_MISMATCH,
+  INVALID_INDEX
 } ErrorType;
 
+typedef enum SymbolCategory {
+  PREDECLARED,
+  PROGRAM_NAME,
+  VARIABLE,
+  PARAMETER,
+  PROCEDURE,
+  FUNCTION,
+  LABEL
+} SymbolCategory;
+
+typedef enum DataType {
+  NO_TYPE,                        // procedures, labels and other names
+  INTEGER_TYPE,
+  REAL_TYPE,
+  BOOLEAN_TYPE
+} DataType;
+
 typedef struct SymbolNode {
   char name[BUFFER_SIZE];
+  SymbolCategory category;
+  DataType type;                  // variables, parameters and function results
+  int level, offset;              // MEPA address (or body level for routines)
+  int isArray;                    // array variables, of elements of the type
+  int low, high;                  // bounds of the index of arrays
+  int isReference;                // var parameters
+  int paramCount;                 // procedures and functions
+  struct SymbolNode **params;
+  char label[LABEL_SIZE];         // entry of routines, target of labels
+  int isNonLocal;                 // label reached by a goto from a nested routine
+  int isConstant;                 // constant propagation
+  Constant value;
   struct SymbolNode *next;
+  struct SymbolNode *allocated;   // the symbol added before, out of scope or not
 } SymbolNode;
 
+// Result of compiling an expression: constants are not emitted until needed.
+typedef struct ExprResult {
+  int isConstant;
+  Constant value;
+  DataType type;
+} ExprResult;
+
+// Snapshot of the known constant values of the symbols in scope.
+typedef struct ConstState {
+  int count;
+  SymbolNode **symbols;
+  Constant *values;
+} ConstState;
+
 void parser(Node *tokenList);
+void freeSymbols();
+Constant intConstant(long value);
+Constant realConstant(double value);
+int foldBinary(char *op, Constant a, Constant b, Constant *result);
 
 #endif // PARSER_H
\ No newline at end of file
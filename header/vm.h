@@ -0,0 +1,163 @@
+#ifndef VM_H
+#define VM_H
+
+#include "ir.h"
+#include <setjmp.h>
+
+#define DISPLAY_SIZE 64
+#define STACK_SIZE (1 << 20)    // default stack, in cells
+#define BATCH_TIMEOUT 60        // seconds a batch job may run by default
+
+// Integer arithmetic wraps around on overflow, computed on unsigned cells,
+// the same in every backend.
+#define WRAP(x, op, y) ((long)((unsigned long)(x) op (unsigned long)(y)))
+
+// A MEPA memory cell. Instructions know the type they work on, so cells
+// carry no tag.
+typedef union Cell {
+  long i;
+  double f;
+} Cell;
+
+// A decoded instruction: the address of its handler, the operands, the
+// resolved jump target and the level it runs at, when it is known.
+typedef struct Code {
+  void *handler;
+  int a, b, c, d;
+  Cell value;
+  struct Code *target;
+  Opcode op;
+  int level;                // level of the routine it runs in, or -1
+} Code;
+
+// Instructions of the register code. Arithmetic works on operands, which
+// are cells of a frame, virtual registers or constants, and the instructions
+// that manage frames keep the MEPA meaning.
+typedef enum RegisterOp {
+  REG_MOV, REG_ADD, REG_SUB, REG_MUL, REG_DIV, REG_AND, REG_OR,
+  REG_LT, REG_GT, REG_EQ, REG_NE, REG_LE, REG_GE,
+  REG_ADDF, REG_SUBF, REG_MULF, REG_DIVF, REG_CMPF,
+  REG_NEG, REG_NOT, REG_NEGF, REG_ITOF,
+  REG_LOADI, REG_STOREI, REG_LOADX, REG_STOREX, REG_ADDR, REG_CHECK,
+  REG_JUMP, REG_JF, REG_JLT, REG_JGT, REG_JEQ, REG_JNE, REG_JLE, REG_JGE,
+  REG_PUSH, REG_POP, REG_READ, REG_READF, REG_WRITE, REG_WRITEF,
+  REG_INPP, REG_PARA, REG_AMEM, REG_DMEM, REG_DSVR, REG_ENRT,
+  REG_CHPR, REG_ENPR, REG_RTPR,
+  REG_COUNT
+} RegisterOp;
+
+// Bases of operands past the display levels
+#define REGISTERS DISPLAY_SIZE
+#define CONSTANTS (DISPLAY_SIZE + 1)
+#define REGISTER_COUNT 256        // virtual registers, plus 2 for values popped
+
+// bases[base][offset]: M[D[k] + n] for a level, a register or a constant.
+typedef struct Operand {
+  int base, offset;
+} Operand;
+
+typedef struct RegisterCode {
+  void *handler;
+  Operand dst, a, b;
+  struct RegisterCode *target;
+  int level, count;           // operands of the frame and array instructions
+  int source;                 // the MEPA instruction, for errors
+  RegisterOp op;
+} RegisterCode;
+
+// Input of a VM: a regular file mapped whole, or a buffer read into from a
+// descriptor.
+typedef struct Input {
+  int fd;                   // -1 when there is no input
+  char *data;
+  long size, position, capacity;
+  int mapped, ended;        // ended once the descriptor has nothing left
+} Input;
+
+// Output of a VM, written to the descriptor when the buffer fills or kept
+// whole in memory when it is -1.
+typedef struct Output {
+  int fd;
+  char *data;
+  long size, capacity;
+} Output;
+
+// A routine run from a chain of calls, in the tree of the calls a profiled
+// run made.
+typedef struct Context {
+  int routine;              // instruction it is entered at, 0 for the program
+  int parent, child, sibling; // contexts of the tree, -1 for none
+  long instructions;        // instructions run in it, not in the routines it calls
+} Context;
+
+// A call not returned from yet, and the stack it was made with.
+typedef struct ProfileCall {
+  int context;              // context of the caller
+  long sp;
+} ProfileCall;
+
+// Counts of a profiled run. Each basic block counts the times it is entered,
+// which is how many times each of its instructions ran.
+typedef struct Profile {
+  int count;                // instructions, with the PARA past the last one
+  void **handlers;          // handler of each instruction, run after counting
+  long *entered;            // times each block was entered, by first instruction
+  int *length;              // instructions of the block each one starts
+  int *lines, *columns;     // source position of each instruction, 0 if unknown
+  int *routines;            // instruction each one's routine is entered at
+  char **names;             // name of the routine entered at each instruction
+  Context *contexts;
+  int contextCount, contextCapacity, context;
+  ProfileCall *calls;
+  int callCount, callCapacity;
+} Profile;
+
+typedef struct VM {
+  Code *code;
+  int count;
+  RegisterCode *registerCode; // the code translated to registers, or NULL
+  int registerCount;
+  Cell *constants;
+  Cell *cells;              // the stack, with guard cells around it
+  Cell *memory;             // M[0]: INPP's cell and the guard are below it
+  long stackSize;
+  long executed;            // instructions run
+  long budget;              // instructions it may run, checked at jumps
+  double deadline;          // CLOCK_MONOTONIC seconds it must stop by, or 0
+  Input input;              // where LEIT reads
+  Output output;            // and IMPR writes
+  sigjmp_buf *abort;        // where runtime errors return to, or NULL to exit
+  char *error;              // the runtime error it stopped with
+  long errorAt;             // and the instruction that raised it, or -1
+  Profile *profile;         // counts of a profiled run, or NULL
+} VM;
+
+int loadVM(VM *vm, Program *program, long stackSize, int registers);
+void runVM(VM *vm);
+void freeVM(VM *vm);
+void runtimeError(VM *vm, Code *pc, char *message);
+long checkBudget(VM *vm, Code *pc, long executed);
+void openInput(Input *input, int fd);
+void closeInput(Input *input);
+void openOutput(Output *output, int fd);
+void flushOutput(Output *output);
+void closeOutput(Output *output);
+long readInteger(VM *vm, Code *pc);
+double readReal(VM *vm, Code *pc);
+void writeInteger(VM *vm, long value);
+void writeReal(VM *vm, double value);
+Profile *newProfile(VM *vm, Program *program, char *lineTablePath);
+void enterContext(Profile *profile, int routine, long sp);
+void leaveContext(Profile *profile);
+void unwindContexts(Profile *profile, long base);
+void writeProfile(VM *vm, FILE *file);
+void writeStacks(VM *vm, FILE *file);
+void freeProfile(Profile *profile);
+int runBatch(char *jobsPath, char *summaryPath, int threads, long stackSize, long budget,
+             long timeout, int fuse, int registers);
+int runJit(VM *vm);
+void translateRegisters(VM *vm);
+void runRegisters(VM *vm);
+void freeRegisters(VM *vm);
+
+#endif // VM_H
\ No newline at end of file
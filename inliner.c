@@ -0,0 +1,464 @@
+#include "header/optimizer.h"
+#include "header/generator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int inlineThreshold = 20;
+
+// A routine that can be inlined: it calls nothing, has no nested routines
+// and no gotos out of it.
+typedef struct Callee {
+  int frame;
+  int level;
+  int params;
+  int first, last;        // body, without the frame entry and exit
+  int calls;              // call sites in the program
+} Callee;
+
+// Checks if the routine entered at index can be inlined.
+static int findCallee(Program *program, FrameInfo *info, int *targets, int entry,
+                      Callee *callee) {
+  int f = info->frameOf[entry];
+  Frame *frame = &info->frames[f];
+
+  if (program->code[entry].op != OP_ENPR || frame->entry != entry) return 0;
+  for (int g = 0; g < info->count; g++)
+    if (info->frames[g].parent == f) return 0;
+  for (int i = frame->entry; i <= frame->exit; i++) {
+    Opcode op = program->code[i].op;
+    if (op == OP_CHPR || op == OP_DSVR || op == OP_ENRT) return 0;
+  }
+
+  callee->frame = f;
+  callee->level = frame->level;
+  callee->params = program->code[frame->exit].b;
+  callee->first = frame->alloc != -1 ? frame->alloc + 1 : entry + 1;
+  callee->last = frame->release != -1 ? frame->release - 1 : frame->exit - 1;
+  callee->calls = 0;
+  for (int i = 0; i < program->count; i++)
+    if (program->code[i].op == OP_CHPR && targets[i] == entry) callee->calls++;
+  return 1;
+}
+
+// Checks if the callee uses a parameter only to reach a variable by address.
+static int isReferenceParam(Program *program, Callee *callee, int offset) {
+  int used = 0;
+  for (int i = callee->first; i <= callee->last; i++) {
+    Instr *instr = &program->code[i];
+    if (!isSlotAccess(instr->op) || instr->a != callee->level || instr->b != offset)
+      continue;
+    if (instr->op != OP_CRVI && instr->op != OP_ARMI) return 0;
+    used = 1;
+  }
+  return used;
+}
+
+// Checks if the callee reaches a variable through the parameter at offset,
+// which makes it a var parameter.
+static int isDereferenced(Program *program, Callee *callee, int offset) {
+  for (int i = callee->first; i <= callee->last; i++) {
+    Instr *instr = &program->code[i];
+    if ((instr->op == OP_CRVI || instr->op == OP_ARMI) && instr->a == callee->level &&
+        instr->b == offset)
+      return 1;
+  }
+  return 0;
+}
+
+static void addInstr(Instr **code, int *count, Instr instr) {
+  *code = (Instr*)realloc(*code, (*count + 1) * sizeof(Instr));
+  (*code)[(*count)++] = instr;
+}
+
+// Replaces the call at index by a copy of the callee body working on new
+// locals of the caller. Returns 0 if the call was left alone.
+static int inlineCall(Program *program, FrameInfo *info, int *targets, int call,
+                      Callee *callee) {
+  int params = callee->params, level = callee->level;
+  int callerLevel = info->frames[info->frameOf[call]].level;
+  int locals = info->frames[callee->frame].locals;
+  int resultOffset = -(params + 4), isFunction = 0;
+  int *starts = (int*)malloc((params + 1) * sizeof(int));
+  int *reference = (int*)calloc(params + 1, sizeof(int));
+
+  for (int i = 0; i < params; i++) starts[i] = -1;
+  if (!findArguments(program, info, targets, call, params, starts)) {
+    free(starts);
+    free(reference);
+    return 0;
+  }
+  for (int i = callee->first; i <= callee->last; i++) {
+    if (isSlotAccess(program->code[i].op) && program->code[i].a == level &&
+        program->code[i].b == resultOffset)
+      isFunction = 1;
+  }
+  // a function call reserves the result before the arguments
+  int argsStart = params > 0 ? starts[0] : call;
+  if (isFunction && (argsStart == 0 || program->code[argsStart - 1].op != OP_AMEM ||
+                     program->code[argsStart - 1].a != 1 ||
+                     program->code[argsStart].label[0] != '\0')) {
+    free(starts);
+    free(reference);
+    return 0;
+  }
+
+  // a var parameter given a plain variable reaches it directly
+  for (int i = 0; i < params; i++) {
+    int end = i + 1 < params ? starts[i + 1] : call;
+    reference[i] = end == starts[i] + 1 && program->code[starts[i]].op == OP_CREN &&
+                   isReferenceParam(program, callee, -(params + 3) + i);
+  }
+
+  // the parameters, then the locals and the result get new caller slots
+  int base = info->frames[info->frameOf[call]].locals;
+  Instr *code = NULL;
+  int count = 0;
+
+  for (int i = params - 1; i >= 0; i--)
+    if (!reference[i]) addInstr(&code, &count, makeInstr(OP_ARMZ, callerLevel, base + i));
+
+  // labels of the body are renamed, jumps to the exit go past the copy
+  char (*oldLabels)[LABEL_SIZE] = malloc((callee->last - callee->first + 2) * LABEL_SIZE);
+  char (*newLabels)[LABEL_SIZE] = malloc((callee->last - callee->first + 2) * LABEL_SIZE);
+  char exitLabel[LABEL_SIZE];
+  int labels = 0, exitUsed = 0;
+  newLabel(exitLabel);
+  for (int i = callee->first; i <= callee->last; i++) {
+    if (program->code[i].label[0] == '\0') continue;
+    strcpy(oldLabels[labels], program->code[i].label);
+    newLabel(newLabels[labels++]);
+  }
+
+  Frame *frame = &info->frames[callee->frame];
+  for (int i = callee->first; i <= callee->last; i++) {
+    Instr instr = program->code[i];
+    for (int l = 0; l < labels; l++) {
+      if (strcmp(instr.label, oldLabels[l]) == 0) strcpy(instr.label, newLabels[l]);
+      if (strcmp(instr.target, oldLabels[l]) == 0) strcpy(instr.target, newLabels[l]);
+    }
+    if (instr.target[0] != '\0' && targets[i] > callee->last && targets[i] <= frame->exit) {
+      strcpy(instr.target, exitLabel);
+      exitUsed = 1;
+    }
+
+    if (isSlotAccess(instr.op) && instr.a == level) {
+      int offset = instr.b;
+      if (offset >= 0) {
+        instr.b = base + params + offset;
+      } else if (offset == resultOffset) {
+        instr.b = base + params + locals;
+      } else {
+        int param = offset + params + 3;
+        if (reference[param]) {
+          Instr *address = &program->code[starts[param]];
+          instr.op = instr.op == OP_CRVI ? OP_CRVL : OP_ARMZ;
+          instr.a = address->a;
+          instr.b = address->b;
+          addInstr(&code, &count, instr);
+          continue;
+        }
+        instr.b = base + param;
+      }
+      instr.a = callerLevel;
+    }
+    addInstr(&code, &count, instr);
+  }
+
+  if (exitUsed) {
+    Instr exit = makeInstr(OP_NADA, 0, 0);
+    strcpy(exit.label, exitLabel);
+    addInstr(&code, &count, exit);
+  }
+  if (isFunction)
+    addInstr(&code, &count, makeInstr(OP_CRVL, callerLevel, base + params + locals));
+  if (count == 0) addInstr(&code, &count, makeInstr(OP_NADA, 0, 0));
+
+  // the copy takes the place of the call
+  if (program->code[call].label[0] != '\0') {
+    if (code[0].label[0] != '\0') {
+      addInstr(&code, &count, code[count - 1]);
+      memmove(&code[1], &code[0], (count - 2) * sizeof(Instr));
+      code[0] = makeInstr(OP_NADA, 0, 0);
+    }
+    strcpy(code[0].label, program->code[call].label);
+  }
+  program->code[call] = code[0];
+  for (int i = count - 1; i >= 1; i--) insertInstr(program, call + 1, code[i]);
+
+  for (int i = params - 1; i >= 0; i--)
+    if (reference[i]) deleteInstr(program, starts[i]);
+  if (isFunction) deleteInstr(program, argsStart - 1);
+  compactProgram(program);
+
+  addLocals(program, argsStart > 0 ? argsStart - 1 : 0,
+            params + locals + (isFunction ? 1 : 0));
+
+  free(code);
+  free(oldLabels);
+  free(newLabels);
+  free(starts);
+  free(reference);
+  return 1;
+}
+
+// Replaces the calls to small routines that call nothing by copies of their
+// bodies. Routines with at most inlineThreshold instructions, or called
+// from a single place, are inlined. Returns the number of calls inlined.
+int inlineCalls(Program *program) {
+  int inlined = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+    Callee callee;
+
+    changed = 0;
+    for (int i = 0; i < program->count && !changed; i++) {
+      if (program->code[i].op != OP_CHPR || targets[i] == -1 ||
+          !findCallee(program, info, targets, targets[i], &callee))
+        continue;
+      if (callee.last - callee.first + 1 > inlineThreshold && callee.calls > 1) continue;
+      changed = inlineCall(program, info, targets, i, &callee);
+      inlined += changed;
+    }
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "inline: inlined %d calls\n", inlined);
+  return inlined;
+}
+
+// Tail calls
+
+// Follows NADAs and unconditional jumps from index. Returns where the code
+// really goes on.
+static int followJumps(Program *program, int *targets, int index) {
+  for (int steps = 0; steps < program->count && index < program->count; steps++) {
+    if (program->code[index].op == OP_NADA)
+      index++;
+    else if (program->code[index].op == OP_DSVS && targets[index] != -1)
+      index = targets[index];
+    else
+      break;
+  }
+  return index;
+}
+
+// Turns the call of a routine to itself at index into stores of the
+// arguments to its parameters and a jump back to its body, when nothing but
+// the return follows the call and no argument is the address of something in
+// the frame, which the next activation would then share. Returns 0 if the
+// call was left alone.
+static int eliminateTailCall(Program *program, FrameInfo *info, int *targets, int call) {
+  Frame *frame = &info->frames[info->frameOf[call]];
+  int level = frame->level, params = program->code[frame->exit].b;
+  int next = call + 1, isFunction = 0;
+
+  // "f := f(...)" stores the result right before returning
+  if (next < program->count && program->code[next].op == OP_ARMZ &&
+      program->code[next].a == level && program->code[next].b == -(params + 4) &&
+      program->code[next].label[0] == '\0') {
+    isFunction = 1;
+    next++;
+  }
+  next = followJumps(program, targets, next);
+  if (next != frame->exit && next != frame->release) return 0;
+
+  int *starts = (int*)malloc((params + 1) * sizeof(int));
+  for (int i = 0; i < params; i++) starts[i] = -1;
+  int found = findArguments(program, info, targets, call, params, starts);
+  int argsStart = params > 0 ? starts[0] : call;
+  free(starts);
+  if (!found || (isFunction && (argsStart == 0 || program->code[argsStart - 1].op != OP_AMEM ||
+                                program->code[argsStart - 1].a != 1 ||
+                                program->code[argsStart].label[0] != '\0')))
+    return 0;
+  for (int i = argsStart; i < call; i++) {
+    if (program->code[i].op == OP_CREN && program->code[i].a == level) return 0;
+  }
+
+  // the body starts after the locals are allocated
+  Instr *body = &program->code[frame->alloc != -1 ? frame->alloc + 1 : frame->entry + 1];
+  if (body->label[0] == '\0') newLabel(body->label);
+  Instr jump = makeInstr(OP_DSVS, 0, 0);
+  strcpy(jump.target, body->label);
+
+  // the arguments are on the stack, the last one on top
+  if (params == 0) {
+    strcpy(jump.label, program->code[call].label);
+    program->code[call] = jump;
+  } else {
+    insertInstr(program, call + 1, jump);
+    for (int i = 0; i < params - 1; i++)
+      insertInstr(program, call + 1, makeInstr(OP_ARMZ, level, -(params + 3) + i));
+    Instr *store = &program->code[call];
+    char label[LABEL_SIZE];
+    strcpy(label, store->label);
+    *store = makeInstr(OP_ARMZ, level, -4);
+    strcpy(store->label, label);
+  }
+  if (isFunction) {
+    deleteInstr(program, call + params + 1);
+    deleteInstr(program, argsStart - 1);
+  }
+  compactProgram(program);
+  return 1;
+}
+
+// Replaces the calls of routines to themselves that are the last thing
+// they do by jumps, so that the recursion runs in a single frame. Returns
+// the number of calls replaced.
+int eliminateTailCalls(Program *program) {
+  int eliminated = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+
+    changed = 0;
+    for (int i = 0; i < program->count && !changed; i++) {
+      if (program->code[i].op != OP_CHPR || targets[i] == -1 ||
+          info->frameOf[targets[i]] != info->frameOf[i])
+        continue;
+      changed = eliminateTailCall(program, info, targets, i);
+      eliminated += changed;
+    }
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "tailcall: replaced %d calls\n", eliminated);
+  return eliminated;
+}
+
+// Var parameters
+
+// Checks if the instruction at index is inside a loop of the callee, between
+// a label and a jump back to it.
+static int inCalleeLoop(Program *program, int *targets, Callee *callee, int index) {
+  for (int i = index; i <= callee->last; i++) {
+    int target = targets[i];
+    if (program->code[i].target[0] != '\0' && target >= callee->first && target <= index)
+      return 1;
+  }
+  return 0;
+}
+
+// Checks that every call of the callee passes a plain variable as the var
+// parameter at position param, one the callee can't reach in any other way.
+static int isUnaliased(Program *program, FrameInfo *info, int *targets, Callee *callee,
+                       int entry, int param) {
+  int *starts = (int*)malloc((callee->params + 1) * sizeof(int));
+  int unaliased = 1;
+
+  for (int call = 0; call < program->count && unaliased; call++) {
+    if (program->code[call].op != OP_CHPR || targets[call] != entry) continue;
+    for (int i = 0; i < callee->params; i++) starts[i] = -1;
+    if (!findArguments(program, info, targets, call, callee->params, starts)) {
+      unaliased = 0;
+      break;
+    }
+    int end = param + 1 < callee->params ? starts[param + 1] : call;
+    Instr *address = &program->code[starts[param]];
+    if (end != starts[param] + 1 || address->op != OP_CREN) {
+      unaliased = 0;
+      break;
+    }
+    // every other var argument must be another plain variable: an address
+    // computed or loaded from a slot, like a var parameter passed on, may be
+    // this one
+    for (int i = 0; i < callee->params; i++) {
+      int otherEnd = i + 1 < callee->params ? starts[i + 1] : call;
+      Instr *other = &program->code[starts[i]];
+      if (i == param || !isDereferenced(program, callee, -(callee->params + 3) + i)) continue;
+      if (otherEnd != starts[i] + 1 || other->op != OP_CREN ||
+          (other->a == address->a && other->b == address->b))
+        unaliased = 0;
+    }
+    // nor may the callee reach it as a variable of an enclosing routine
+    for (int i = callee->first; i <= callee->last; i++) {
+      Instr *instr = &program->code[i];
+      if (isSlotAccess(instr->op) && instr->a < callee->level &&
+          instr->a == address->a && instr->b == address->b)
+        unaliased = 0;
+    }
+  }
+  free(starts);
+  return unaliased;
+}
+
+// Gives the var parameter at position param a local copy: it is loaded on
+// entry, used directly in the body and stored back before the return if the
+// body changes it.
+static void copyParam(Program *program, int entry, int param) {
+  FrameInfo *info = findFrames(program);
+  Frame *frame = &info->frames[info->frameOf[entry]];
+  int level = frame->level, params = program->code[frame->exit].b;
+  int offset = -(params + 3) + param, written = 0;
+  freeFrames(info);
+
+  int local = addLocals(program, entry, 1);
+  info = findFrames(program);
+  frame = &info->frames[info->frameOf[entry]];
+  for (int i = frame->alloc + 1; i < frame->release; i++) {
+    Instr *instr = &program->code[i];
+    if (!isSlotAccess(instr->op) || instr->a != level || instr->b != offset) continue;
+    written |= instr->op == OP_ARMI;
+    instr->op = instr->op == OP_CRVI ? OP_CRVL : OP_ARMZ;
+    instr->b = local;
+  }
+
+  // jumps to the exit have to store the copy back too
+  if (written) {
+    Instr *release = &program->code[frame->release];
+    Instr load = makeInstr(OP_CRVL, level, local);
+    strcpy(load.label, release->label);
+    release->label[0] = '\0';
+    insertInstr(program, frame->release, makeInstr(OP_ARMI, level, offset));
+    insertInstr(program, frame->release, load);
+  }
+  insertInstr(program, frame->alloc + 1, makeInstr(OP_ARMZ, level, local));
+  insertInstr(program, frame->alloc + 1, makeInstr(OP_CRVI, level, offset));
+  freeFrames(info);
+}
+
+// Passes var parameters by copy-in/copy-out when they are used inside loops
+// of a routine that calls nothing and no call gives them an aliased variable,
+// so that the loops use a local instead of an indirect access. Returns the
+// number of parameters changed.
+int copyVarParams(Program *program) {
+  int copied = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+    Callee callee;
+
+    changed = 0;
+    for (int entry = 0; entry < program->count && !changed; entry++) {
+      if (program->code[entry].op != OP_ENPR ||
+          !findCallee(program, info, targets, entry, &callee))
+        continue;
+      for (int param = 0; param < callee.params && !changed; param++) {
+        int offset = -(callee.params + 3) + param, hot = 0;
+        if (!isReferenceParam(program, &callee, offset)) continue;
+        for (int i = callee.first; i <= callee.last && !hot; i++) {
+          Instr *instr = &program->code[i];
+          hot = isSlotAccess(instr->op) && instr->a == callee.level && instr->b == offset &&
+                inCalleeLoop(program, targets, &callee, i);
+        }
+        if (!hot || !isUnaliased(program, info, targets, &callee, entry, param)) continue;
+        copyParam(program, entry, param);
+        changed = 1;
+        copied++;
+      }
+    }
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "varparams: copied %d var parameters\n", copied);
+  return copied;
+}
@@ -0,0 +1,198 @@
+#include "header/vm.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INPUT_BUFFER (1 << 16)
+#define OUTPUT_BUFFER (1 << 16)
+#define LONGEST_NUMBER 64       // bytes written for a number, newline included
+
+// Input
+
+// Reads from the descriptor, or nothing when it is -1. A regular file is
+// mapped whole from where the descriptor is, and anything else is read
+// through a buffer.
+void openInput(Input *input, int fd) {
+  struct stat info;
+  off_t offset;
+
+  memset(input, 0, sizeof(Input));
+  input->fd = fd;
+  if (fd < 0) {
+    input->ended = 1;
+    return;
+  }
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 &&
+      (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && offset <= info.st_size) {
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      input->data = (char*)data;
+      input->size = info.st_size;
+      input->position = offset;
+      input->capacity = info.st_size;
+      input->mapped = 1;
+      input->ended = 1;
+      return;
+    }
+  }
+  input->data = (char*)malloc(INPUT_BUFFER);
+  input->capacity = INPUT_BUFFER;
+}
+
+void closeInput(Input *input) {
+  if (input->mapped)
+    munmap(input->data, input->capacity);
+  else
+    free(input->data);
+  input->data = NULL;
+}
+
+// Reads more input after what is left in the buffer, flushing the output
+// first so that a prompt shows before the program waits. Returns 0 at the
+// end of the input or when the buffer is full.
+static int fillInput(VM *vm) {
+  Input *input = &vm->input;
+
+  if (input->ended) return 0;
+  flushOutput(&vm->output);
+  memmove(input->data, input->data + input->position, input->size - input->position);
+  input->size -= input->position;
+  input->position = 0;
+  if (input->size == input->capacity) return 0;
+
+  ssize_t count = read(input->fd, input->data + input->size, input->capacity - input->size);
+  if (count <= 0) {
+    input->ended = 1;
+    return 0;
+  }
+  input->size += count;
+  return 1;
+}
+
+// Skips white space and finds the end of the word that follows, reading
+// until the whole word is in the buffer. Returns 0 if the input ends first.
+static int nextWord(VM *vm, char **start, char **end) {
+  Input *input = &vm->input;
+  long length;
+
+  for (;;) {
+    while (input->position < input->size && isspace((unsigned char)input->data[input->position]))
+      input->position++;
+    if (input->position < input->size) break;
+    if (!fillInput(vm)) return 0;
+  }
+  // fillInput moves what is left to the start of the buffer, so the word is
+  // measured from where it starts
+  for (length = 0;;) {
+    while (input->position + length < input->size &&
+           !isspace((unsigned char)input->data[input->position + length]))
+      length++;
+    if (input->position + length < input->size || !fillInput(vm)) break;
+  }
+  *start = input->data + input->position;
+  *end = *start + length;
+  return 1;
+}
+
+// Reads an integer like scanf("%ld") would, stopping at its last digit and
+// saturating when it overflows.
+long readInteger(VM *vm, Code *pc) {
+  char *p, *end;
+  int negative = 0;
+  unsigned long value = 0, limit;
+
+  if (!nextWord(vm, &p, &end)) runtimeError(vm, pc, "invalid or missing input");
+  if (*p == '-' || *p == '+') negative = *p++ == '-';
+  if (p == end || !isdigit((unsigned char)*p)) runtimeError(vm, pc, "invalid or missing input");
+  limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  for (; p < end && isdigit((unsigned char)*p); p++) {
+    unsigned digit = *p - '0';
+    value = value > (limit - digit) / 10 ? limit : value * 10 + digit;
+  }
+  vm->input.position = p - vm->input.data;
+  return negative ? (long)-value : (long)value;
+}
+
+// Reads a real like scanf("%lf") would. Reals are rare enough in input that
+// strtod does the conversion, on a copy of the word.
+double readReal(VM *vm, Code *pc) {
+  char *start, *end, text[LONGEST_NUMBER * 2], *parsed;
+  double value;
+
+  if (!nextWord(vm, &start, &end)) runtimeError(vm, pc, "invalid or missing input");
+  long length = end - start < (long)sizeof(text) - 1 ? end - start : (long)sizeof(text) - 1;
+  memcpy(text, start, length);
+  text[length] = '\0';
+  value = strtod(text, &parsed);
+  if (parsed == text) runtimeError(vm, pc, "invalid or missing input");
+  vm->input.position += parsed - text;
+  return value;
+}
+
+// Output
+
+// Writes to the descriptor, or keeps everything in memory when it is -1.
+void openOutput(Output *output, int fd) {
+  output->fd = fd;
+  output->data = (char*)malloc(OUTPUT_BUFFER);
+  output->size = 0;
+  output->capacity = OUTPUT_BUFFER;
+}
+
+void flushOutput(Output *output) {
+  long written = 0;
+
+  if (output->fd < 0) return;
+  while (written < output->size) {
+    ssize_t count = write(output->fd, output->data + written, output->size - written);
+    if (count <= 0) break;
+    written += count;
+  }
+  output->size = 0;
+}
+
+void closeOutput(Output *output) {
+  flushOutput(output);
+  free(output->data);
+  output->data = NULL;
+}
+
+// Returns where the next number goes, with room for the longest one.
+static char *reserve(Output *output) {
+  if (output->size + LONGEST_NUMBER > output->capacity) {
+    if (output->fd >= 0) {
+      flushOutput(output);
+    } else {
+      output->capacity *= 2;
+      output->data = (char*)realloc(output->data, output->capacity);
+    }
+  }
+  return output->data + output->size;
+}
+
+void writeInteger(VM *vm, long value) {
+  char digits[24], *end = digits + sizeof(digits), *p = end;
+  char *to = reserve(&vm->output);
+  unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+  *--p = '\n';
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0) *--p = '-';
+  memcpy(to, p, end - p);
+  vm->output.size += end - p;
+}
+
+void writeReal(VM *vm, double value) {
+  char *to = reserve(&vm->output);
+  Constant constant = {1, 0, value};
+  formatConstant(constant, to);
+  vm->output.size += strlen(to);
+  vm->output.data[vm->output.size++] = '\n';
+}
@@ -0,0 +1,510 @@
+#include "header/ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+const char *opcodeNames[] = {
+  "INPP", "PARA", "AMEM", "DMEM", "NADA",
+  "CRCT", "CRVL", "ARMZ", "CRVI", "ARMI", "CREN",
+  "SOMA", "SUBT", "MULT", "DIVI", "INVR",
+  "CONJ", "DISJ", "NEGA",
+  "CMME", "CMMA", "CMIG", "CMDG", "CMEG", "CMAG",
+  "DSVS", "DSVF", "DSVR", "ENRT",
+  "CHPR", "ENPR", "RTPR",
+  "LEIT", "IMPR",
+  "DIVF", "SOMF", "SUBF", "MULF", "INVF", "CMPF", "ITOF",
+  "LEIF", "IMPF",
+  "INCV", "SOVV",
+  "DVME", "DVMA", "DVIG", "DVDG", "DVEG", "DVAG",
+  "CRVX", "ARMX", "VERI"
+};
+
+const OperandKind operandKinds[] = {
+  NO_OPERANDS, NO_OPERANDS, ONE_NUMBER, ONE_NUMBER, NO_OPERANDS,
+  CONSTANT_OPERAND, TWO_NUMBERS, TWO_NUMBERS, TWO_NUMBERS, TWO_NUMBERS, TWO_NUMBERS,
+  NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS,
+  NO_OPERANDS, NO_OPERANDS, NO_OPERANDS,
+  NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS,
+  LABEL_OPERAND, LABEL_OPERAND, LABEL_AND_TWO_NUMBERS, TWO_NUMBERS,
+  LABEL_AND_NUMBER, ONE_NUMBER, TWO_NUMBERS,
+  NO_OPERANDS, NO_OPERANDS,
+  NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS, NO_OPERANDS,
+  NO_OPERANDS, NO_OPERANDS,
+  TWO_NUMBERS_AND_CONSTANT, FOUR_NUMBERS,
+  LABEL_AND_THREE_NUMBERS, LABEL_AND_THREE_NUMBERS, LABEL_AND_THREE_NUMBERS,
+  LABEL_AND_THREE_NUMBERS, LABEL_AND_THREE_NUMBERS, LABEL_AND_THREE_NUMBERS,
+  FOUR_NUMBERS, FOUR_NUMBERS, TWO_NUMBERS
+};
+
+// Creates an empty program.
+Program *newProgram() {
+  Program *program = (Program*)calloc(1, sizeof(Program));
+  program->capacity = 64;
+  program->code = (Instr*)malloc(program->capacity * sizeof(Instr));
+  return program;
+}
+
+void freeProgram(Program *program) {
+  free(program->code);
+  free(program);
+}
+
+// Adds an instruction to the end of the program.
+Instr *appendInstr(Program *program, Instr instr) {
+  insertInstr(program, program->count, instr);
+  return &program->code[program->count - 1];
+}
+
+// Inserts an instruction before the given index.
+void insertInstr(Program *program, int index, Instr instr) {
+  if (program->count == program->capacity) {
+    program->capacity *= 2;
+    program->code = (Instr*)realloc(program->code, program->capacity * sizeof(Instr));
+  }
+  memmove(&program->code[index + 1], &program->code[index],
+          (program->count - index) * sizeof(Instr));
+  program->code[index] = instr;
+  program->count++;
+}
+
+// Drops the instructions marked as OP_NONE.
+void compactProgram(Program *program) {
+  int count = 0;
+  for (int i = 0; i < program->count; i++) {
+    if (program->code[i].op != OP_NONE) program->code[count++] = program->code[i];
+  }
+  program->count = count;
+}
+
+// Builds an unlabelled instruction with numeric operands.
+Instr makeInstr(Opcode op, int a, int b) {
+  Instr instr;
+  memset(&instr, 0, sizeof(Instr));
+  instr.op = op;
+  instr.a = a;
+  instr.b = b;
+  return instr;
+}
+
+// Reads a MEPA constant, which is real when it has a '.' or an exponent.
+static int parseConstant(char *text, Constant *value) {
+  char *end;
+  memset(value, 0, sizeof(Constant));
+  if (strpbrk(text, ".eE") != NULL) {
+    value->isReal = 1;
+    value->realValue = strtod(text, &end);
+  } else {
+    value->intValue = strtol(text, &end, 10);
+  }
+  return end != text && *end == '\0';
+}
+
+static int parseNumber(char *text, int *number) {
+  char *end;
+  if (text == NULL) return 0;
+  *number = (int)strtol(text, &end, 10);
+  return end != text && *end == '\0';
+}
+
+// Parses a line of MEPA text ("[label:] MNEMONIC operands [/comment]").
+// Returns 1 for an instruction, 2 for a line with only a label,
+// 0 for an empty line and -1 for an invalid one.
+int parseInstruction(char *text, Instr *instr) {
+  char line[BUFFER_SIZE], *words[8], *colon, *state;
+  int count = 0, op;
+
+  memset(instr, 0, sizeof(Instr));
+  strncpy(line, text, BUFFER_SIZE - 1);
+  line[BUFFER_SIZE - 1] = '\0';
+  if ((colon = strchr(line, '/')) != NULL) *colon = '\0';
+
+  for (char *word = strtok_r(line, " \t\r\n,", &state); word != NULL && count < 8;
+       word = strtok_r(NULL, " \t\r\n,", &state)) {
+    words[count++] = word;
+  }
+  if (count == 0) return 0;
+
+  // label, either "L1:" or "L1:" glued to the mnemonic as in "L1:NADA"
+  char **rest = words;
+  if ((colon = strchr(words[0], ':')) != NULL) {
+    *colon = '\0';
+    if (strlen(words[0]) >= LABEL_SIZE) return -1;
+    strcpy(instr->label, words[0]);
+    if (colon[1] != '\0') {
+      words[0] = colon + 1;
+    } else {
+      rest++;
+      count--;
+    }
+    if (count == 0) return 2;
+  }
+
+  for (char *c = rest[0]; *c; c++) *c = toupper((unsigned char)*c);
+  for (op = 0; op < OP_COUNT; op++) {
+    if (strcmp(opcodeNames[op], rest[0]) == 0) break;
+  }
+  if (op == OP_COUNT) return -1;
+  instr->op = op;
+
+  char *first = count > 1 ? rest[1] : NULL;
+  char *second = count > 2 ? rest[2] : NULL;
+  char *third = count > 3 ? rest[3] : NULL;
+  char *fourth = count > 4 ? rest[4] : NULL;
+  switch (operandKinds[op]) {
+    case NO_OPERANDS:
+      return 1;
+    case ONE_NUMBER:
+      return parseNumber(first, &instr->a) ? 1 : -1;
+    case TWO_NUMBERS:
+      return parseNumber(first, &instr->a) && parseNumber(second, &instr->b) ? 1 : -1;
+    case CONSTANT_OPERAND:
+      return first != NULL && parseConstant(first, &instr->value) ? 1 : -1;
+    case LABEL_OPERAND:
+    case LABEL_AND_NUMBER:
+    case LABEL_AND_TWO_NUMBERS:
+      if (first == NULL || strlen(first) >= LABEL_SIZE) return -1;
+      strcpy(instr->target, first);
+      // the levels of CHPR and DSVR are optional in older MEPA listings
+      if (second != NULL && !parseNumber(second, &instr->a)) return -1;
+      if (third != NULL && !parseNumber(third, &instr->b)) return -1;
+      return 1;
+    case TWO_NUMBERS_AND_CONSTANT:
+      return parseNumber(first, &instr->a) && parseNumber(second, &instr->b) &&
+             third != NULL && parseConstant(third, &instr->value) ? 1 : -1;
+    case FOUR_NUMBERS:
+      return parseNumber(first, &instr->a) && parseNumber(second, &instr->b) &&
+             parseNumber(third, &instr->c) && parseNumber(fourth, &instr->d) ? 1 : -1;
+    case LABEL_AND_THREE_NUMBERS:
+      if (first == NULL || strlen(first) >= LABEL_SIZE) return -1;
+      strcpy(instr->target, first);
+      return parseNumber(second, &instr->a) && parseNumber(third, &instr->b) &&
+             parseNumber(fourth, &instr->c) ? 1 : -1;
+  }
+  return -1;
+}
+
+// Writes the constant as a MEPA operand. Reals use the shortest
+// representation that reads back exactly, without an exponent unless the
+// value is very large or small, and always carry a '.' or an exponent.
+void formatConstant(Constant c, char *buffer) {
+  double magnitude = c.realValue < 0 ? -c.realValue : c.realValue;
+
+  if (!c.isReal) {
+    sprintf(buffer, "%ld", c.intValue);
+    return;
+  }
+  for (int precision = 1; precision <= 17; precision++) {
+    sprintf(buffer, "%.*g", precision, c.realValue);
+    if (strtod(buffer, NULL) == c.realValue &&
+        (strchr(buffer, 'e') == NULL || magnitude >= 1e15 || magnitude < 1e-4))
+      break;
+  }
+  if (strpbrk(buffer, ".e") == NULL) strcat(buffer, ".0");
+}
+
+// Writes the instruction as a line of MEPA text.
+void formatInstruction(Instr *instr, char *buffer) {
+  char *end = buffer;
+
+  if (instr->label[0] != '\0') end += sprintf(end, "%s: ", instr->label);
+  end += sprintf(end, "%s", opcodeNames[instr->op]);
+
+  switch (operandKinds[instr->op]) {
+    case NO_OPERANDS:
+      break;
+    case ONE_NUMBER:
+      sprintf(end, " %d", instr->a);
+      break;
+    case TWO_NUMBERS:
+      sprintf(end, " %d %d", instr->a, instr->b);
+      break;
+    case CONSTANT_OPERAND:
+      *end++ = ' ';
+      formatConstant(instr->value, end);
+      break;
+    case LABEL_OPERAND:
+      sprintf(end, " %s", instr->target);
+      break;
+    case LABEL_AND_NUMBER:
+      sprintf(end, " %s %d", instr->target, instr->a);
+      break;
+    case LABEL_AND_TWO_NUMBERS:
+      sprintf(end, " %s %d %d", instr->target, instr->a, instr->b);
+      break;
+    case TWO_NUMBERS_AND_CONSTANT:
+      end += sprintf(end, " %d %d ", instr->a, instr->b);
+      formatConstant(instr->value, end);
+      break;
+    case FOUR_NUMBERS:
+      sprintf(end, " %d %d %d %d", instr->a, instr->b, instr->c, instr->d);
+      break;
+    case LABEL_AND_THREE_NUMBERS:
+      sprintf(end, " %s %d %d %d", instr->target, instr->a, instr->b, instr->c);
+      break;
+  }
+}
+
+static unsigned long hashLabel(char *label) {
+  unsigned long hash = 5381;
+  for (; *label; label++) hash = hash * 33 + (unsigned char)*label;
+  return hash;
+}
+
+// Resolves the label operand of every instruction. Returns an array with
+// the index of the target of each instruction, or -1 when it has none or
+// the label is not defined.
+int *labelTargets(Program *program) {
+  int size = 1;
+  while (size < 2 * program->count) size *= 2;
+  int *table = (int*)malloc(size * sizeof(int));
+  int *targets = (int*)malloc((program->count + 1) * sizeof(int));
+
+  for (int i = 0; i < size; i++) table[i] = -1;
+  for (int i = 0; i < program->count; i++) {
+    if (program->code[i].label[0] == '\0') continue;
+    unsigned long slot = hashLabel(program->code[i].label) & (size - 1);
+    while (table[slot] != -1) slot = (slot + 1) & (size - 1);
+    table[slot] = i;
+  }
+
+  for (int i = 0; i < program->count; i++) {
+    targets[i] = -1;
+    if (program->code[i].target[0] == '\0') continue;
+    unsigned long slot = hashLabel(program->code[i].target) & (size - 1);
+    while (table[slot] != -1) {
+      if (strcmp(program->code[table[slot]].label, program->code[i].target) == 0) {
+        targets[i] = table[slot];
+        break;
+      }
+      slot = (slot + 1) & (size - 1);
+    }
+  }
+
+  free(table);
+  return targets;
+}
+
+// Returns the index of the instruction with the given label, or -1.
+int findLabel(Program *program, char *label) {
+  for (int i = 0; i < program->count; i++) {
+    if (strcmp(program->code[i].label, label) == 0) return i;
+  }
+  return -1;
+}
+// Reading and writing programs
+
+// Reads MEPA text. A label on a line of its own belongs to the next
+// instruction. Returns NULL, with the line in *errorLine, on an invalid
+// instruction.
+static Program *readTextProgram(FILE *file, int *errorLine) {
+  Program *program = newProgram();
+  char line[BUFFER_SIZE], pending[LABEL_SIZE] = "";
+  Instr instr;
+
+  for (*errorLine = 1; fgets(line, BUFFER_SIZE, file) != NULL; (*errorLine)++) {
+    int kind = parseInstruction(line, &instr);
+    if (kind == -1) {
+      freeProgram(program);
+      return NULL;
+    }
+    if (kind == 0) continue;
+    // two labels in a row, the first one goes on a NADA
+    if (pending[0] != '\0' && instr.label[0] != '\0') {
+      Instr nada = makeInstr(OP_NADA, 0, 0);
+      strcpy(nada.label, pending);
+      appendInstr(program, nada);
+    } else if (pending[0] != '\0') {
+      strcpy(instr.label, pending);
+    }
+    pending[0] = '\0';
+    if (kind == 2)
+      strcpy(pending, instr.label);
+    else
+      appendInstr(program, instr);
+  }
+  if (pending[0] != '\0') {
+    Instr nada = makeInstr(OP_NADA, 0, 0);
+    strcpy(nada.label, pending);
+    appendInstr(program, nada);
+  }
+  *errorLine = 0;
+  return program;
+}
+
+// Binary MEPA: the magic, the instruction count, the stack the program
+// needs, then for each instruction its opcode, numeric operands, target index
+// (-1 for none) and constant, in host byte order.
+#define BINARY_MAGIC "MEPA\004"
+#define BINARY_MAGIC_SIZE 5
+
+typedef struct BinaryInstr {
+  int op, a, b, c, d, target;
+  int isReal;
+  long intValue;
+  double realValue;
+} BinaryInstr;
+
+// Writes the program as binary MEPA, with its labels resolved.
+void writeBinaryProgram(Program *program, FILE *file) {
+  int *targets = labelTargets(program);
+
+  fwrite(BINARY_MAGIC, 1, BINARY_MAGIC_SIZE, file);
+  fwrite(&program->count, sizeof(int), 1, file);
+  fwrite(&program->stackSize, sizeof(long), 1, file);
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    BinaryInstr record;
+    // cleared first so the padding doesn't differ between runs
+    memset(&record, 0, sizeof(BinaryInstr));
+    record.op = instr->op;
+    record.a = instr->a;
+    record.b = instr->b;
+    record.c = instr->c;
+    record.d = instr->d;
+    record.target = targets[i];
+    record.isReal = instr->value.isReal;
+    record.intValue = instr->value.intValue;
+    record.realValue = instr->value.realValue;
+    fwrite(&record, sizeof(BinaryInstr), 1, file);
+  }
+  free(targets);
+}
+
+// Reads binary MEPA after its magic, naming each jump target "L<index>".
+static Program *readBinaryProgram(FILE *file) {
+  Program *program = newProgram();
+  BinaryInstr record;
+  int count;
+
+  if (fread(&count, sizeof(int), 1, file) != 1 || count < 0 ||
+      fread(&program->stackSize, sizeof(long), 1, file) != 1 || program->stackSize < 0) {
+    freeProgram(program);
+    return NULL;
+  }
+  for (int i = 0; i < count; i++) {
+    if (fread(&record, sizeof(BinaryInstr), 1, file) != 1 || record.op < 0 ||
+        record.op >= OP_COUNT || record.target < -1 || record.target >= count) {
+      freeProgram(program);
+      return NULL;
+    }
+    Instr instr = makeInstr((Opcode)record.op, record.a, record.b);
+    instr.c = record.c;
+    instr.d = record.d;
+    instr.value.isReal = record.isReal;
+    instr.value.intValue = record.intValue;
+    instr.value.realValue = record.realValue;
+    if (record.target != -1) snprintf(instr.target, LABEL_SIZE, "L%d", record.target);
+    appendInstr(program, instr);
+  }
+  for (int i = 0; i < count; i++) {
+    char *target = program->code[i].target;
+    if (target[0] != '\0') strcpy(program->code[atoi(target + 1)].label, target);
+  }
+  return program;
+}
+
+// Reads a MEPA program, as text or binary. Returns NULL when it's invalid,
+// with the offending text line in *errorLine (0 for binary).
+Program *readProgram(FILE *file, int *errorLine) {
+  char magic[BINARY_MAGIC_SIZE];
+
+  *errorLine = 0;
+  if (fread(magic, 1, BINARY_MAGIC_SIZE, file) == BINARY_MAGIC_SIZE &&
+      memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0)
+    return readBinaryProgram(file);
+  rewind(file);
+  return readTextProgram(file, errorLine);
+}
+
+// Superinstructions
+
+// Checks if the instruction at index loads a variable of the given level.
+static int isLoad(Program *program, int index, int level) {
+  return program->code[index].op == OP_CRVL && program->code[index].a == level;
+}
+
+static int compareBranch(Opcode op) {
+  switch (op) {
+    case OP_CMME: return OP_DVME;
+    case OP_CMMA: return OP_DVMA;
+    case OP_CMIG: return OP_DVIG;
+    case OP_CMDG: return OP_DVDG;
+    case OP_CMEG: return OP_DVEG;
+    case OP_CMAG: return OP_DVAG;
+    default: return OP_NONE;
+  }
+}
+
+// Returns the most cells the code can push past the last stack check. The
+// VM and the C code check the stack at AMEM, CHPR and ENRT and at every
+// jump they take, and any other instruction pushes one cell at most, so
+// it's the longest run of instructions between two that always check.
+long stackSlack(Program *program) {
+  long run = 0, longest = 0;
+
+  for (int i = 0; i < program->count; i++) {
+    Opcode op = program->code[i].op;
+    if (op == OP_AMEM || op == OP_CHPR || op == OP_ENRT || op == OP_DSVS ||
+        op == OP_DSVR || op == OP_RTPR || op == OP_PARA) {
+      run = 0;
+    } else if (++run > longest) {
+      longest = run;
+    }
+  }
+  return longest + 1;
+}
+
+// Replaces the sequences of instructions that are common in loops by a
+// single instruction, when no jump lands in the middle of them:
+//   CRVL k n; CRCT c; SOMA|SUBT; ARMZ k n       -> INCV k n c (or -c)
+//   CRVL k n1; CRVL k n2; SOMA; ARMZ k n3       -> SOVV k n1 n2 n3
+//   CRVL k n1; CRVL k n2; CMxx; DSVF p          -> DVxx p k n1 n2
+// Returns the number of sequences replaced.
+int fuseInstructions(Program *program) {
+  int fused = 0;
+
+  for (int i = 0; i + 3 < program->count; i++) {
+    Instr *first = &program->code[i], *second = &program->code[i + 1];
+    Instr *third = &program->code[i + 2], *fourth = &program->code[i + 3];
+    Instr instr;
+
+    if (first->op != OP_CRVL || second->label[0] != '\0' || third->label[0] != '\0' ||
+        fourth->label[0] != '\0')
+      continue;
+
+    if (second->op == OP_CRCT && !second->value.isReal &&
+        (third->op == OP_SOMA || third->op == OP_SUBT) && fourth->op == OP_ARMZ &&
+        fourth->a == first->a && fourth->b == first->b) {
+      instr = makeInstr(OP_INCV, first->a, first->b);
+      instr.value = second->value;
+      if (third->op == OP_SUBT) {
+        if (second->value.intValue == LONG_MIN) continue;
+        instr.value.intValue = -second->value.intValue;
+      }
+    } else if (isLoad(program, i + 1, first->a) && third->op == OP_SOMA &&
+               fourth->op == OP_ARMZ && fourth->a == first->a) {
+      instr = makeInstr(OP_SOVV, first->a, first->b);
+      instr.c = second->b;
+      instr.d = fourth->b;
+    } else if (isLoad(program, i + 1, first->a) && compareBranch(third->op) != OP_NONE &&
+               fourth->op == OP_DSVF) {
+      instr = makeInstr(compareBranch(third->op), first->a, first->b);
+      instr.c = second->b;
+      strcpy(instr.target, fourth->target);
+    } else {
+      continue;
+    }
+
+    strcpy(instr.label, first->label);
+    instr.line = first->line;
+    instr.column = first->column;
+    *first = instr;
+    for (int j = i + 1; j <= i + 3; j++) program->code[j].op = OP_NONE;
+    i += 3;
+    fused++;
+  }
+  compactProgram(program);
+  return fused;
+}
@@ -0,0 +1,667 @@
+#include "header/vm.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+// Registers of the generated code: the value on top of the MEPA stack is
+// kept in RAX while it hasn't been stored, the rest of the stack is in
+// memory up to R12.
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+#define MEMORY RBX              // M
+#define STACK R12               // sp, the last cell stored
+#define DISPLAY R13             // D
+#define STATE R14               // JitState
+#define NATIVE R15              // native address of each instruction
+
+// Condition codes of Jcc/SETcc
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_L = 0xC,
+       CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+// What the generated code and the stubs share.
+typedef struct JitState {
+  Cell *memory;
+  Cell *sp;
+  Cell *limit;
+  Cell *bottom;             // INPP's cell below M[0]
+  long span;                // bytes from bottom to limit
+  long size;                // cells of the stack, past the last address
+  VM *vm;
+  long display[DISPLAY_SIZE];
+} JitState;
+
+// Assembler
+
+typedef struct Jump {
+  long at;                  // position of the rel32
+  int target;               // instruction jumped to
+} Jump;
+
+typedef struct Assembler {
+  unsigned char *code;
+  long size, capacity;
+  Jump *jumps;
+  int jumpCount;
+  int cached;               // the top of the stack is in RAX
+} Assembler;
+
+static void emitByte(Assembler *as, int byte) {
+  as->code[as->size++] = (unsigned char)byte;
+}
+
+static void emitInt32(Assembler *as, int value) {
+  memcpy(as->code + as->size, &value, 4);
+  as->size += 4;
+}
+
+static void emitInt64(Assembler *as, long value) {
+  memcpy(as->code + as->size, &value, 8);
+  as->size += 8;
+}
+
+static void emitOpcode(Assembler *as, int opcode) {
+  if (opcode > 0xff) emitByte(as, opcode >> 8);
+  emitByte(as, opcode & 0xff);
+}
+
+// opcode reg, [base + index * 8 + disp], without an index when it is -1.
+static void emitMem(Assembler *as, int opcode, int reg, int base, int index, int disp) {
+  emitByte(as, 0x48 | (reg >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0));
+  emitOpcode(as, opcode);
+  if (index == -1 && (base & 7) != RSP) {
+    emitByte(as, 0x80 | (reg & 7) << 3 | (base & 7));
+  } else {
+    emitByte(as, 0x80 | (reg & 7) << 3 | RSP);
+    emitByte(as, (index == -1 ? 0 : 3) << 6 | (index == -1 ? RSP : index & 7) << 3 | (base & 7));
+  }
+  emitInt32(as, disp);
+}
+
+// opcode rm, reg (or reg, rm, as the opcode says) between registers.
+static void emitReg(Assembler *as, int opcode, int reg, int rm) {
+  emitByte(as, 0x48 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+  emitOpcode(as, opcode);
+  emitByte(as, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// add/sub/cmp reg, imm32 as 81 /0, /5 and /7.
+static void emitImm(Assembler *as, int extension, int reg, int value) {
+  emitReg(as, 0x81, extension, reg);
+  emitInt32(as, value);
+}
+
+static void emitMovImm(Assembler *as, int reg, long value) {
+  emitByte(as, 0x48 | (reg >= 8 ? 1 : 0));
+  emitByte(as, 0xB8 + (reg & 7));
+  emitInt64(as, value);
+}
+
+// jmp or jcc to an instruction, patched once every instruction has its code.
+static void emitJump(Assembler *as, int cc, int target) {
+  if (cc == -1) {
+    emitByte(as, 0xE9);
+  } else {
+    emitByte(as, 0x0F);
+    emitByte(as, 0x80 + cc);
+  }
+  as->jumps[as->jumpCount].at = as->size;
+  as->jumps[as->jumpCount++].target = target;
+  emitInt32(as, 0);
+}
+
+static void emitCall(Assembler *as, void *function) {
+  emitMovImm(as, RAX, (long)function);
+  emitByte(as, 0xFF);
+  emitByte(as, 0xD0);
+}
+
+// Stack caching
+
+// Stores the top of the stack kept in RAX.
+static void flush(Assembler *as) {
+  if (!as->cached) return;
+  emitImm(as, 0, STACK, 8);
+  emitMem(as, 0x89, RAX, STACK, -1, 0);
+  as->cached = 0;
+}
+
+// Pops the top of the stack into RAX, unless it is there already.
+static void load(Assembler *as) {
+  if (as->cached) return;
+  emitMem(as, 0x8B, RAX, STACK, -1, 0);
+  emitImm(as, 5, STACK, 8);
+  as->cached = 1;
+}
+
+// Loads D[k] into the register.
+static void loadDisplay(Assembler *as, int reg, int level) {
+  emitMem(as, 0x8B, reg, DISPLAY, -1, level * 8);
+}
+
+// Loads the frame of the variable the instruction accesses into RCX and
+// returns the index register to address it with. Globals need no display
+// load when D[0] is known to stay 0, so they return -1.
+static int loadFrame(Assembler *as, Code *pc) {
+  if (pc->a == 0 && pc->level >= 0) return -1;
+  loadDisplay(as, RCX, pc->a);
+  return RCX;
+}
+
+// Stubs
+
+// Stops with an error when sp is past either end of the stack, as the
+// interpreter does.
+static void checkStack(JitState *state, Code *pc, Cell *sp) {
+  if (sp >= state->limit) runtimeError(state->vm, pc, "stack overflow");
+  if (sp < state->bottom) runtimeError(state->vm, pc, "stack underflow");
+}
+
+// Runs an instruction the generated code leaves to C. Returns the index of
+// the next one.
+static long jitStub(JitState *state, long index) {
+  VM *vm = state->vm;
+  Code *pc = &vm->code[index];
+  Cell *M = state->memory, *sp = state->sp;
+  unsigned long size = state->size;
+  long *D = state->display;
+
+  switch (pc->op) {
+    case OP_DSVR: {
+      // the links come from memory the program may have overwritten
+      long k = pc->b;
+      for (unsigned long unwound = 0; k != pc->a; unwound++) {
+        long base = D[k];
+        if (unwound > size || (unsigned long)M[base - 1].i > size ||
+            (unsigned long)M[base - 2].i >= DISPLAY_SIZE)
+          runtimeError(vm, pc, "invalid frame");
+        D[k] = M[base - 1].i;
+        k = M[base - 2].i;
+      }
+      checkStack(state, pc, sp);
+      state->sp = sp;
+      return pc->target - vm->code;
+    }
+    case OP_ENRT:
+      sp = M + D[pc->a] + pc->b - 1;
+      checkStack(state, pc, sp);
+      break;
+    case OP_LEIT: (++sp)->i = readInteger(vm, pc); break;
+    case OP_IMPR: writeInteger(vm, (sp--)->i); break;
+    case OP_LEIF: (++sp)->f = readReal(vm, pc); break;
+    case OP_IMPF: writeReal(vm, (sp--)->f); break;
+    case OP_DIVF:
+      if (sp[0].f == 0.0) runtimeError(vm, pc, "division by zero");
+      sp--;
+      sp[0].f /= sp[1].f;
+      break;
+    case OP_SOMF: sp--; sp[0].f += sp[1].f; break;
+    case OP_SUBF: sp--; sp[0].f -= sp[1].f; break;
+    case OP_MULF: sp--; sp[0].f *= sp[1].f; break;
+    case OP_INVF: sp->f = -sp->f; break;
+    case OP_CMPF: sp--; sp[0].i = (sp[0].f > sp[1].f) - (sp[0].f < sp[1].f); break;
+    case OP_ITOF: sp->f = (double)sp->i; break;
+    default: runtimeError(vm, pc, "instruction not supported");
+  }
+  state->sp = sp;
+  return index + 1;
+}
+
+// sp was at distance bytes from the bottom of the stack.
+static void stackError(JitState *state, long index, long distance) {
+  runtimeError(state->vm, &state->vm->code[index],
+               distance < 0 ? "stack underflow" : "stack overflow");
+}
+
+static void invalidAddress(JitState *state, long index) {
+  runtimeError(state->vm, &state->vm->code[index], "invalid address");
+}
+
+static void invalidFrame(JitState *state, long index) {
+  runtimeError(state->vm, &state->vm->code[index], "invalid frame");
+}
+
+static void divisionByZero(JitState *state, long index) {
+  runtimeError(state->vm, &state->vm->code[index], "division by zero");
+}
+
+static void integerOverflow(JitState *state, long index) {
+  runtimeError(state->vm, &state->vm->code[index], "integer overflow");
+}
+
+static void indexOutOfRange(JitState *state, long index) {
+  runtimeError(state->vm, &state->vm->code[index], "index out of range");
+}
+
+// Calls the stub for the instruction, with the stack in memory.
+static void emitStub(Assembler *as, void *stub, int index) {
+  flush(as);
+  emitMem(as, 0x89, STACK, STATE, -1, offsetof(JitState, sp));
+  emitReg(as, 0x89, STATE, RDI);
+  emitMovImm(as, RSI, index);
+  emitCall(as, stub);
+  emitMem(as, 0x8B, STACK, STATE, -1, offsetof(JitState, sp));
+}
+
+// Calls the error stub for the instruction unless the condition holds.
+static void emitCheck(Assembler *as, int cc, void *stub, int index) {
+  emitByte(as, 0x0F);
+  emitByte(as, 0x80 + cc);
+  long at = as->size;
+  emitInt32(as, 0);
+  emitReg(as, 0x89, STATE, RDI);
+  emitMovImm(as, RSI, index);
+  emitCall(as, stub);
+  int skip = (int)(as->size - at - 4);
+  memcpy(as->code + at, &skip, 4);
+}
+
+// Stops with an error when sp is past either end of the stack, with a single
+// unsigned comparison of its distance from the bottom, left in RDX for the
+// stub.
+static void emitStackCheck(Assembler *as, int index) {
+  emitReg(as, 0x89, STACK, RDX);
+  emitMem(as, 0x2B, RDX, STATE, -1, offsetof(JitState, bottom));
+  emitMem(as, 0x3B, RDX, STATE, -1, offsetof(JitState, span));
+  emitCheck(as, CC_B, stackError, index);
+}
+
+// Stops with an invalid address unless the cell the register holds the
+// index of is in the stack, as AT does in the interpreter.
+static void emitAddressCheck(Assembler *as, int reg, int index) {
+  emitMem(as, 0x3B, reg, STATE, -1, offsetof(JitState, size));
+  emitCheck(as, CC_B, invalidAddress, index);
+}
+
+// Moves sp up (add, extension 0) or down (sub, 5) by a count of cells that
+// may not fit an immediate.
+static void emitMoveStack(Assembler *as, int extension, long cells) {
+  if (cells <= INT_MAX / 8) {
+    emitImm(as, extension, STACK, (int)(cells * 8));
+    return;
+  }
+  emitMovImm(as, RDX, cells * 8);
+  emitReg(as, extension == 0 ? 0x01 : 0x29, RDX, STACK);
+}
+
+// Jumps to the target when the condition holds (always for -1), checking
+// the stack on the way as the interpreter does at the jumps it takes.
+static void emitCheckedJump(Assembler *as, int cc, int target, int index) {
+  long at = -1;
+  if (cc != -1) {
+    // skip the check and the jump when the condition fails
+    emitByte(as, 0x0F);
+    emitByte(as, 0x80 + (cc ^ 1));
+    at = as->size;
+    emitInt32(as, 0);
+  }
+  emitStackCheck(as, index);
+  emitJump(as, -1, target);
+  if (at != -1) {
+    int skip = (int)(as->size - at - 4);
+    memcpy(as->code + at, &skip, 4);
+  }
+}
+
+// Turns the register into 1 if it isn't 0.
+static void emitBoolean(Assembler *as, int reg) {
+  emitReg(as, 0x85, reg, reg);
+  emitByte(as, reg >= 8 ? 0x41 : 0x40);
+  emitByte(as, 0x0F);
+  emitByte(as, 0x95);
+  emitByte(as, 0xC0 | (reg & 7));
+  emitReg(as, 0x0FB6, reg, reg);
+}
+
+// Pops the second operand into RCX and compares it with the top in RAX,
+// leaving the result as 0 or 1 in RAX.
+static void emitCompare(Assembler *as, int cc) {
+  load(as);
+  emitMem(as, 0x8B, RCX, STACK, -1, 0);
+  emitImm(as, 5, STACK, 8);
+  emitReg(as, 0x39, RAX, RCX);
+  emitByte(as, 0x0F);
+  emitByte(as, 0x90 + cc);
+  emitByte(as, 0xC0);
+  emitByte(as, 0x0F);
+  emitByte(as, 0xB6);
+  emitByte(as, 0xC0);
+}
+
+static int compareCondition(Opcode op) {
+  switch (op) {
+    case OP_CMME: case OP_DVME: return CC_L;
+    case OP_CMMA: case OP_DVMA: return CC_G;
+    case OP_CMIG: case OP_DVIG: return CC_E;
+    case OP_CMDG: case OP_DVDG: return CC_NE;
+    case OP_CMEG: case OP_DVEG: return CC_LE;
+    default: return CC_GE;
+  }
+}
+
+// Translation
+
+// Writes the machine code of the instruction at index.
+static void translate(Assembler *as, VM *vm, int index) {
+  Code *pc = &vm->code[index];
+  int target = pc->target != NULL ? (int)(pc->target - vm->code) : -1;
+  int frame, skip;
+  long at;
+
+  switch (pc->op) {
+    case OP_INPP:
+      as->cached = 0;
+      emitReg(as, 0x89, MEMORY, STACK);
+      emitImm(as, 5, STACK, 8);
+      emitMovImm(as, RCX, 0);
+      emitMem(as, 0x89, RCX, DISPLAY, -1, 0);
+      break;
+    case OP_PARA:
+      flush(as);
+      emitMem(as, 0x89, STACK, STATE, -1, offsetof(JitState, sp));
+      emitByte(as, 0x41); emitByte(as, 0x5F);     // pop r15
+      emitByte(as, 0x41); emitByte(as, 0x5E);     // pop r14
+      emitByte(as, 0x41); emitByte(as, 0x5D);     // pop r13
+      emitByte(as, 0x41); emitByte(as, 0x5C);     // pop r12
+      emitByte(as, 0x5B);                         // pop rbx
+      emitByte(as, 0xC3);
+      break;
+    case OP_AMEM:
+      flush(as);
+      emitMoveStack(as, 0, pc->a);
+      emitStackCheck(as, index);
+      break;
+    case OP_DMEM:
+      flush(as);
+      emitMoveStack(as, 5, pc->a);
+      emitStackCheck(as, index);
+      break;
+    case OP_NADA:
+      break;
+    case OP_CRCT:
+      flush(as);
+      emitMovImm(as, RAX, pc->value.i);
+      as->cached = 1;
+      break;
+    case OP_CRVL:
+      flush(as);
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x8B, RAX, MEMORY, frame, pc->b * 8);
+      as->cached = 1;
+      break;
+    case OP_ARMZ:
+      load(as);
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x89, RAX, MEMORY, frame, pc->b * 8);
+      as->cached = 0;
+      break;
+    case OP_CRVI:
+      flush(as);
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x8B, RCX, MEMORY, frame, pc->b * 8);
+      emitAddressCheck(as, RCX, index);
+      emitMem(as, 0x8B, RAX, MEMORY, RCX, 0);
+      as->cached = 1;
+      break;
+    case OP_ARMI:
+      load(as);
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x8B, RCX, MEMORY, frame, pc->b * 8);
+      emitAddressCheck(as, RCX, index);
+      emitMem(as, 0x89, RAX, MEMORY, RCX, 0);
+      as->cached = 0;
+      break;
+    case OP_CRVX:
+      // the index in RAX picks the element, from the frame's cell when the
+      // frame is in RCX
+      load(as);
+      frame = loadFrame(as, pc);
+      if (frame != -1) emitReg(as, 0x01, RCX, RAX);
+      emitImm(as, 0, RAX, pc->b - pc->c);
+      emitAddressCheck(as, RAX, index);
+      emitMem(as, 0x8B, RAX, MEMORY, RAX, 0);
+      break;
+    case OP_ARMX:
+      load(as);
+      emitMem(as, 0x8B, RDX, STACK, -1, 0);
+      emitImm(as, 5, STACK, 8);
+      frame = loadFrame(as, pc);
+      if (frame != -1) emitReg(as, 0x01, RCX, RDX);
+      emitImm(as, 0, RDX, pc->b - pc->c);
+      emitAddressCheck(as, RDX, index);
+      emitMem(as, 0x89, RAX, MEMORY, RDX, 0);
+      as->cached = 0;
+      break;
+    case OP_VERI:
+      load(as);
+      emitImm(as, 7, RAX, pc->a);
+      emitCheck(as, CC_GE, indexOutOfRange, index);
+      emitImm(as, 7, RAX, pc->b);
+      emitCheck(as, CC_LE, indexOutOfRange, index);
+      break;
+    case OP_CREN:
+      flush(as);
+      loadDisplay(as, RAX, pc->a);
+      emitImm(as, 0, RAX, pc->b);
+      as->cached = 1;
+      break;
+    case OP_SOMA: case OP_MULT:
+      load(as);
+      emitMem(as, pc->op == OP_SOMA ? 0x03 : 0x0FAF, RAX, STACK, -1, 0);
+      emitImm(as, 5, STACK, 8);
+      break;
+    case OP_CONJ: case OP_DISJ:
+      load(as);
+      emitMem(as, 0x8B, RCX, STACK, -1, 0);
+      emitImm(as, 5, STACK, 8);
+      emitBoolean(as, RAX);
+      emitBoolean(as, RCX);
+      emitReg(as, pc->op == OP_CONJ ? 0x21 : 0x09, RCX, RAX);
+      break;
+    case OP_DIVI:
+      load(as);
+      emitReg(as, 0x89, RAX, RCX);
+      emitReg(as, 0x85, RCX, RCX);
+      emitCheck(as, CC_NE, divisionByZero, index);
+      emitMem(as, 0x8B, RAX, STACK, -1, 0);
+      emitImm(as, 5, STACK, 8);
+      // LONG_MIN div -1 would trap in idiv
+      emitImm(as, 7, RCX, -1);
+      emitByte(as, 0x0F);
+      emitByte(as, 0x80 + CC_NE);
+      at = as->size;
+      emitInt32(as, 0);
+      emitMovImm(as, RDX, LONG_MIN);
+      emitReg(as, 0x39, RDX, RAX);
+      emitCheck(as, CC_NE, integerOverflow, index);
+      skip = (int)(as->size - at - 4);
+      memcpy(as->code + at, &skip, 4);
+      emitByte(as, 0x48);                         // cqo
+      emitByte(as, 0x99);
+      emitReg(as, 0xF7, 7, RCX);                  // idiv rcx
+      break;
+    case OP_SUBT:
+      load(as);
+      emitMem(as, 0x8B, RCX, STACK, -1, 0);
+      emitImm(as, 5, STACK, 8);
+      emitReg(as, 0x29, RAX, RCX);
+      emitReg(as, 0x89, RCX, RAX);
+      break;
+    case OP_INVR:
+      load(as);
+      emitReg(as, 0xF7, 3, RAX);
+      break;
+    case OP_NEGA:
+      load(as);
+      emitMovImm(as, RCX, 1);
+      emitReg(as, 0x29, RAX, RCX);
+      emitReg(as, 0x89, RCX, RAX);
+      break;
+    case OP_CMME: case OP_CMMA: case OP_CMIG: case OP_CMDG: case OP_CMEG: case OP_CMAG:
+      emitCompare(as, compareCondition(pc->op));
+      break;
+    case OP_DSVS:
+      flush(as);
+      emitCheckedJump(as, -1, target, index);
+      break;
+    case OP_DSVF:
+      load(as);
+      as->cached = 0;
+      emitReg(as, 0x85, RAX, RAX);
+      emitCheckedJump(as, CC_E, target, index);
+      break;
+    case OP_CHPR:
+      flush(as);
+      emitMovImm(as, RCX, index + 1);
+      emitMem(as, 0x89, RCX, STACK, -1, 8);
+      emitMovImm(as, RCX, pc->a);
+      emitMem(as, 0x89, RCX, STACK, -1, 16);
+      emitImm(as, 0, STACK, 16);
+      emitStackCheck(as, index);
+      emitJump(as, -1, target);
+      break;
+    case OP_ENPR:
+      flush(as);
+      loadDisplay(as, RCX, pc->a);
+      emitImm(as, 0, STACK, 8);
+      emitMem(as, 0x89, RCX, STACK, -1, 0);
+      // D[k] = sp - M + 1, in cells
+      emitReg(as, 0x89, STACK, RCX);
+      emitReg(as, 0x29, MEMORY, RCX);
+      emitReg(as, 0xC1, 7, RCX);
+      emitByte(as, 3);
+      emitImm(as, 0, RCX, 1);
+      emitMem(as, 0x89, RCX, DISPLAY, -1, pc->a * 8);
+      break;
+    case OP_RTPR:
+      // the frame and the return point are cells the program may have written
+      flush(as);
+      emitMem(as, 0x8B, RCX, STACK, -1, 0);
+      emitMem(as, 0x3B, RCX, STATE, -1, offsetof(JitState, size));
+      emitCheck(as, CC_BE, invalidFrame, index);
+      emitMem(as, 0x89, RCX, DISPLAY, -1, pc->a * 8);
+      emitMem(as, 0x8B, RAX, STACK, -1, -16);
+      emitImm(as, 7, RAX, vm->count);
+      emitCheck(as, CC_BE, invalidFrame, index);
+      emitMoveStack(as, 5, pc->b + 3L);
+      emitStackCheck(as, index);
+      emitMem(as, 0xFF, 4, NATIVE, RAX, 0);
+      break;
+    case OP_INCV:
+      frame = loadFrame(as, pc);
+      emitMovImm(as, RDX, pc->value.i);
+      emitMem(as, 0x01, RDX, MEMORY, frame, pc->b * 8);
+      break;
+    case OP_SOVV:
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x8B, RDX, MEMORY, frame, pc->b * 8);
+      emitMem(as, 0x03, RDX, MEMORY, frame, pc->c * 8);
+      emitMem(as, 0x89, RDX, MEMORY, frame, pc->d * 8);
+      break;
+    case OP_DVME: case OP_DVMA: case OP_DVIG: case OP_DVDG: case OP_DVEG: case OP_DVAG:
+      flush(as);
+      frame = loadFrame(as, pc);
+      emitMem(as, 0x8B, RDX, MEMORY, frame, pc->b * 8);
+      emitMem(as, 0x3B, RDX, MEMORY, frame, pc->c * 8);
+      // jump when the comparison fails
+      emitCheckedJump(as, compareCondition(pc->op) ^ 1, target, index);
+      break;
+    case OP_DSVR:
+      emitStub(as, jitStub, index);
+      emitMem(as, 0xFF, 4, NATIVE, RAX, 0);
+      break;
+    default:
+      emitStub(as, jitStub, index);
+      break;
+  }
+}
+
+// Translates the program to x86-64 and runs it. Jump targets and return
+// points start with the whole stack in memory, so they can be entered from
+// anywhere.
+int runJit(VM *vm) {
+  // variables are addressed with 32-bit displacements, which the offsets a
+  // stack this large allows would overflow
+  if (vm->stackSize > INT_MAX / 8) return 0;
+
+  char *leader = (char*)calloc(vm->count + 1, 1);
+  void **native = (void**)calloc(vm->count + 1, sizeof(void*));
+  long *offsets = (long*)calloc(vm->count + 1, sizeof(long));
+  Assembler as = {NULL, 0, 256L * (vm->count + 1) + 4096, NULL, 0, 0};
+
+  // an instruction jumps to one place at most
+  as.jumps = (Jump*)malloc((vm->count + 1) * sizeof(Jump));
+  leader[0] = 1;
+  for (int i = 0; i < vm->count; i++) {
+    if (vm->code[i].target != NULL) leader[vm->code[i].target - vm->code] = 1;
+    if (vm->code[i].op == OP_CHPR) leader[i + 1] = 1;
+  }
+
+  as.code = mmap(NULL, as.capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+  if (as.code == MAP_FAILED) {
+    free(leader);
+    free(native);
+    free(offsets);
+    return 0;
+  }
+
+  // void entry(JitState *state, void **native)
+  emitByte(&as, 0x53);                            // push rbx
+  emitByte(&as, 0x41); emitByte(&as, 0x54);       // push r12
+  emitByte(&as, 0x41); emitByte(&as, 0x55);       // push r13
+  emitByte(&as, 0x41); emitByte(&as, 0x56);       // push r14
+  emitByte(&as, 0x41); emitByte(&as, 0x57);       // push r15
+  emitReg(&as, 0x89, RDI, STATE);
+  emitReg(&as, 0x89, RSI, NATIVE);
+  emitMem(&as, 0x8B, MEMORY, STATE, -1, offsetof(JitState, memory));
+  emitMem(&as, 0x8B, STACK, STATE, -1, offsetof(JitState, sp));
+  emitMem(&as, 0x8D, DISPLAY, STATE, -1, offsetof(JitState, display));
+
+  for (int i = 0; i <= vm->count; i++) {
+    if (leader[i]) flush(&as);
+    offsets[i] = as.size;
+    translate(&as, vm, i);
+  }
+  for (int j = 0; j < as.jumpCount; j++) {
+    int rel = (int)(offsets[as.jumps[j].target] - (as.jumps[j].at + 4));
+    memcpy(as.code + as.jumps[j].at, &rel, 4);
+  }
+  for (int i = 0; i <= vm->count; i++) native[i] = as.code + offsets[i];
+  mprotect(as.code, as.capacity, PROT_READ | PROT_EXEC);
+
+  JitState *state = (JitState*)calloc(1, sizeof(JitState));
+  state->memory = vm->memory;
+  state->sp = state->memory - 1;
+  state->limit = state->memory + vm->stackSize;
+  state->bottom = state->memory - 1;
+  state->span = (char*)state->limit - (char*)state->bottom;
+  state->size = vm->stackSize;
+  state->vm = vm;
+  ((void (*)(JitState*, void**))as.code)(state, native);
+  flushOutput(&vm->output);
+
+  munmap(as.code, as.capacity);
+  free(as.jumps);
+  free(state);
+  free(leader);
+  free(native);
+  free(offsets);
+  return 1;
+}
+
+#else
+
+// Other machines run on the interpreter.
+int runJit(VM *vm) {
+  return 0;
+}
+
+#endif
@@ -20,7 +20,7 @@ const char *operators[] = {
 int sizeOperators = sizeof(operators) / sizeof(operators[0]);
 
 const char *compoundOperators[] = {
-  ":=", "<=", "<>", ">="
+  "..", ":=", "<=", "<>", ">="
 };
 int sizeCompoundOperators = sizeof(compoundOperators) / sizeof(compoundOperators[0]);
 
@@ -238,3 +238,13 @@ void printTokensCount(Node *list) {
   printf("COMMENTS: %d\n", comments);
   printf("UNKNOWN: %d\n", unknowns);
 }
+
+// Frees the list of tokens made by the lexer.
+void freeTokenList(Node *tokenList) {
+  while (tokenList != NULL) {
+    Node *next = tokenList->next;
+    free(tokenList->tok);
+    free(tokenList);
+    tokenList = next;
+  }
+}
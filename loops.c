@@ -0,0 +1,670 @@
+#include "header/optimizer.h"
+#include "header/generator.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A while loop: the code from the header label down to the jump back to it,
+// entered only through the header.
+typedef struct Loop {
+  int header, latch;
+  int frame;
+} Loop;
+
+// A frame slot, as a frame of FrameInfo and an offset in it.
+typedef struct Slot {
+  int frame, offset;
+} Slot;
+
+typedef struct SlotList {
+  Slot *slots;
+  int count;
+} SlotList;
+
+// What the code of a loop may change.
+typedef struct LoopEffects {
+  SlotList stores;        // slots stored with ARMZ
+  SlotList escaped;       // slots of the program reached by address or from nested routines
+  int hasCall;
+  int hasIndirectStore;   // ARMI
+} LoopEffects;
+
+static void addSlot(SlotList *list, int frame, int offset) {
+  for (int i = 0; i < list->count; i++)
+    if (list->slots[i].frame == frame && list->slots[i].offset == offset) return;
+  list->slots = (Slot*)realloc(list->slots, (list->count + 1) * sizeof(Slot));
+  list->slots[list->count].frame = frame;
+  list->slots[list->count].offset = offset;
+  list->count++;
+}
+
+static int hasSlot(SlotList *list, int frame, int offset) {
+  for (int i = 0; i < list->count; i++)
+    if (list->slots[i].frame == frame && list->slots[i].offset == offset) return 1;
+  return 0;
+}
+
+// Checks if a loop can't be entered other than through its header.
+static int isLoop(Program *program, FrameInfo *info, int *targets, Loop *loop) {
+  for (int i = loop->header; i <= loop->latch; i++) {
+    Opcode op = program->code[i].op;
+    if (info->frameOf[i] != loop->frame || op == OP_ENPR || op == OP_RTPR ||
+        op == OP_INPP || op == OP_PARA || op == OP_ENRT)
+      return 0;
+  }
+  for (int i = 0; i < program->count; i++) {
+    if (i >= loop->header && i <= loop->latch) continue;
+    if (targets[i] > loop->header && targets[i] <= loop->latch) return 0;
+  }
+  return 1;
+}
+
+static int compareLoops(const void *a, const void *b) {
+  const Loop *x = (const Loop*)a, *y = (const Loop*)b;
+  return (x->latch - x->header) - (y->latch - y->header);
+}
+
+// Finds the loops of the program, formed by the jumps back to a label of the
+// same frame. Inner loops come first.
+static int findLoops(Program *program, FrameInfo *info, int *targets, Loop **loops) {
+  int count = 0;
+
+  *loops = (Loop*)malloc((program->count + 1) * sizeof(Loop));
+  for (int i = 0; i < program->count; i++) {
+    if (program->code[i].op != OP_DSVS || targets[i] == -1 || targets[i] > i) continue;
+    Loop loop = {targets[i], i, info->frameOf[i]};
+    if (isLoop(program, info, targets, &loop)) (*loops)[count++] = loop;
+  }
+  qsort(*loops, count, sizeof(Loop), compareLoops);
+  return count;
+}
+
+static LoopEffects loopEffects(Program *program, FrameInfo *info, Loop *loop) {
+  LoopEffects effects;
+  memset(&effects, 0, sizeof(LoopEffects));
+
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    if (!isSlotAccess(instr->op)) continue;
+    int f = accessFrame(info, i, instr->a);
+    if (f != -1 && (instr->op == OP_CREN || info->frameOf[i] != f))
+      addSlot(&effects.escaped, f, instr->b);
+  }
+  for (int i = loop->header; i <= loop->latch; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->op == OP_ARMZ)
+      addSlot(&effects.stores, accessFrame(info, i, instr->a), instr->b);
+    else if (instr->op == OP_CHPR)
+      effects.hasCall = 1;
+    else if (instr->op == OP_ARMI)
+      effects.hasIndirectStore = 1;
+  }
+  return effects;
+}
+
+static void freeEffects(LoopEffects *effects) {
+  free(effects->stores.slots);
+  free(effects->escaped.slots);
+}
+
+// Checks if a slot keeps its value while the loop runs: it isn't stored in
+// the loop, and calls and stores through addresses can't reach it.
+static int isInvariantSlot(LoopEffects *effects, int frame, int offset) {
+  if (frame == -1 || hasSlot(&effects->stores, frame, offset)) return 0;
+  if ((effects->hasCall || effects->hasIndirectStore) &&
+      hasSlot(&effects->escaped, frame, offset))
+    return 0;
+  return 1;
+}
+
+static int sameInstr(Instr *a, Instr *b) {
+  return a->op == b->op && a->a == b->a && a->b == b->b &&
+         strcmp(a->target, b->target) == 0 &&
+         a->value.isReal == b->value.isReal &&
+         a->value.intValue == b->value.intValue &&
+         a->value.realValue == b->value.realValue;
+}
+
+// Inserts code before the loop header, so that it runs each time the loop
+// is entered. Jumps from outside the loop to the header go through it too.
+static void insertPreheader(Program *program, int *targets, Loop *loop,
+                            Instr *preheader, int count) {
+  Instr *header = &program->code[loop->header];
+  int entered = 0;
+
+  for (int i = 0; i < program->count; i++)
+    if (targets[i] == loop->header && (i < loop->header || i > loop->latch)) entered = 1;
+  if (entered) {
+    char label[LABEL_SIZE];
+    newLabel(label);
+    for (int i = loop->header; i <= loop->latch; i++)
+      if (targets[i] == loop->header) strcpy(program->code[i].target, label);
+    strcpy(preheader[0].label, header->label);
+    strcpy(header->label, label);
+  }
+  for (int i = count - 1; i >= 0; i--) insertInstr(program, loop->header, preheader[i]);
+}
+
+// Loop-invariant code motion
+
+// A value on the stack while simulating the code of a loop.
+typedef struct StackValue {
+  int start, end;         // code computing it
+  int invariant;
+  int operations;
+} StackValue;
+
+typedef struct Candidates {
+  int *start, *end;
+  int count;
+} Candidates;
+
+// Keeps the invariant values computed by arithmetic as candidates to hoist.
+static void flushValue(Candidates *candidates, StackValue *value) {
+  if (!value->invariant || value->operations == 0) return;
+  candidates->start[candidates->count] = value->start;
+  candidates->end[candidates->count] = value->end;
+  candidates->count++;
+}
+
+static void flushStack(Candidates *candidates, StackValue *stack, int *top) {
+  for (int i = 0; i < *top; i++) flushValue(candidates, &stack[i]);
+  *top = 0;
+}
+
+// Finds the largest invariant expressions computed in the loop, simulating
+// the stack over each block.
+static void findInvariants(Program *program, FrameInfo *info, Loop *loop,
+                           LoopEffects *effects, Candidates *candidates) {
+  int size = loop->latch - loop->header + 2, top = 0, pops, pushes;
+  StackValue *stack = (StackValue*)malloc(size * sizeof(StackValue));
+
+  for (int i = loop->header; i <= loop->latch; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->label[0] != '\0') flushStack(candidates, stack, &top);
+
+    StackValue value = {i, i, 0, 0};
+    if (instr->op == OP_CRCT || instr->op == OP_CREN) {
+      value.invariant = 1;
+    } else if (instr->op == OP_CRVL) {
+      value.invariant = isInvariantSlot(effects, accessFrame(info, i, instr->a), instr->b);
+    } else if (instr->op == OP_DIVI || instr->op == OP_DIVF) {
+      // a division may fail, so it stays where the program put it
+      pops = 2;
+      if (top < pops) {
+        flushStack(candidates, stack, &top);
+      } else {
+        flushValue(candidates, &stack[--top]);
+        flushValue(candidates, &stack[--top]);
+        value.start = stack[top].start;
+      }
+    } else if (isPure(instr->op, &pops, &pushes) && pops > 0) {
+      if (top < pops) {
+        flushStack(candidates, stack, &top);
+      } else if (pops == 1) {
+        value = stack[--top];
+        value.end = i;
+        value.operations++;
+      } else {
+        StackValue right = stack[--top], left = stack[--top];
+        if (left.invariant && right.invariant) {
+          value.invariant = 1;
+          value.operations = left.operations + right.operations + 1;
+        } else {
+          flushValue(candidates, &left);
+          flushValue(candidates, &right);
+        }
+        value.start = left.start;
+      }
+    } else {
+      flushStack(candidates, stack, &top);
+      continue;
+    }
+    stack[top++] = value;
+  }
+  flushStack(candidates, stack, &top);
+  free(stack);
+}
+
+static int sameCode(Program *program, int start, int end, int otherStart, int otherEnd) {
+  if (end - start != otherEnd - otherStart) return 0;
+  for (int i = 0; start + i <= end; i++)
+    if (!sameInstr(&program->code[start + i], &program->code[otherStart + i])) return 0;
+  return 1;
+}
+
+// Moves the invariant expressions of a loop to new locals computed in its
+// preheader. Returns the number of expressions hoisted.
+static int hoistLoop(Program *program, FrameInfo *info, int *targets, Loop *loop) {
+  LoopEffects effects = loopEffects(program, info, loop);
+  int size = loop->latch - loop->header + 2;
+  Candidates candidates;
+
+  candidates.start = (int*)malloc(size * sizeof(int));
+  candidates.end = (int*)malloc(size * sizeof(int));
+  candidates.count = 0;
+  findInvariants(program, info, loop, &effects, &candidates);
+  freeEffects(&effects);
+  if (candidates.count == 0) {
+    free(candidates.start);
+    free(candidates.end);
+    return 0;
+  }
+
+  // equal expressions share a local
+  int *local = (int*)malloc(candidates.count * sizeof(int));
+  int locals = 0, preheaderCount = 0, base = info->frames[loop->frame].locals;
+  int level = info->frames[loop->frame].level;
+  Instr *preheader = (Instr*)malloc((size + candidates.count) * sizeof(Instr));
+
+  for (int c = 0; c < candidates.count; c++) {
+    local[c] = -1;
+    for (int d = 0; d < c && local[c] == -1; d++) {
+      if (sameCode(program, candidates.start[c], candidates.end[c],
+                   candidates.start[d], candidates.end[d]))
+        local[c] = local[d];
+    }
+    if (local[c] != -1) continue;
+    local[c] = base + locals++;
+    for (int i = candidates.start[c]; i <= candidates.end[c]; i++) {
+      preheader[preheaderCount] = program->code[i];
+      preheader[preheaderCount++].label[0] = '\0';
+    }
+    preheader[preheaderCount++] = makeInstr(OP_ARMZ, level, local[c]);
+  }
+
+  for (int c = 0; c < candidates.count; c++) {
+    Instr *first = &program->code[candidates.start[c]];
+    for (int i = candidates.start[c] + 1; i <= candidates.end[c]; i++)
+      program->code[i].op = OP_NONE;
+    first->op = OP_CRVL;
+    first->a = level;
+    first->b = local[c];
+    first->target[0] = '\0';
+  }
+
+  insertPreheader(program, targets, loop, preheader, preheaderCount);
+  compactProgram(program);
+  addLocals(program, loop->header, locals);
+
+  int hoisted = candidates.count;
+  free(local);
+  free(preheader);
+  free(candidates.start);
+  free(candidates.end);
+  return hoisted;
+}
+
+// Hoists the expressions that don't change while a loop runs out of it,
+// inner loops first. Returns the number of expressions hoisted.
+int hoistInvariants(Program *program) {
+  int hoisted = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+    Loop *loops;
+    int count = findLoops(program, info, targets, &loops);
+
+    changed = 0;
+    for (int l = 0; l < count && !changed; l++) {
+      changed = hoistLoop(program, info, targets, &loops[l]);
+      hoisted += changed;
+    }
+    free(loops);
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "licm: hoisted %d expressions\n", hoisted);
+  return hoisted;
+}
+
+// Induction variable strength reduction
+
+// Rough cost of an instruction, to weigh a multiplication against the
+// additions replacing it. Every instruction pays for its dispatch, so a
+// product used once per iteration isn't worth a running sum.
+static int instrCost(Opcode op) {
+  return op == OP_MULT || op == OP_DIVI || op == OP_DIVF ? 3 : 1;
+}
+
+static int isIntConstant(Instr *instr) {
+  return instr->op == OP_CRCT && !instr->value.isReal;
+}
+
+// Checks if the instructions from index on load the slot and a constant and
+// then apply op to them, in either order. Returns the constant.
+static int matchSlotOperation(Program *program, FrameInfo *info, int index, Opcode op,
+                              int frame, int offset, int commutes, long *constant) {
+  if (index + 2 >= program->count || program->code[index + 2].op != op ||
+      program->code[index + 1].label[0] != '\0' || program->code[index + 2].label[0] != '\0')
+    return 0;
+
+  Instr *load = &program->code[index], *value = &program->code[index + 1];
+  if (commutes && isIntConstant(load)) {
+    Instr *swap = load;
+    load = value;
+    value = swap;
+  }
+  if (load->op != OP_CRVL || !isIntConstant(value) || load->b != offset ||
+      accessFrame(info, index, load->a) != frame)
+    return 0;
+  *constant = value->value.intValue;
+  return 1;
+}
+
+// Finds the step of the only store of a slot in the loop, which has to be
+// "i := i + c" or "i := i - c". Returns the index of the store or -1.
+static int findStep(Program *program, FrameInfo *info, Loop *loop,
+                    int frame, int offset, long *step) {
+  int store = -1;
+
+  for (int i = loop->header; i <= loop->latch; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->op != OP_ARMZ || instr->b != offset || accessFrame(info, i, instr->a) != frame)
+      continue;
+    if (store != -1 || i < 3 || instr->label[0] != '\0') return -1;
+    store = i;
+  }
+  if (store == -1) return -1;
+  if (matchSlotOperation(program, info, store - 3, OP_SOMA, frame, offset, 1, step))
+    return store;
+  if (matchSlotOperation(program, info, store - 3, OP_SUBT, frame, offset, 0, step)) {
+    *step = -*step;
+    return store;
+  }
+  return -1;
+}
+
+// Replaces the products of an induction variable and a constant in a loop
+// by a new local, which starts as the product in the preheader and grows
+// with the variable. The local is also computed when the program wouldn't
+// compute the product: in the preheader of a loop that doesn't run, and
+// after the last step. Integer arithmetic wraps around in every backend, so
+// those values can overflow harmlessly, and the local always equals the
+// product the program computes. Returns 1 if the loop changed.
+static int reduceLoop(Program *program, FrameInfo *info, int *targets, Loop *loop) {
+  LoopEffects effects = loopEffects(program, info, loop);
+  int level = info->frames[loop->frame].level, reduced = 0;
+
+  for (int i = loop->header; i <= loop->latch && !reduced; i++) {
+    Instr *store = &program->code[i];
+    if (store->op != OP_ARMZ) continue;
+    int frame = accessFrame(info, i, store->a), offset = store->b;
+    long step, factor, otherFactor, increment;
+    if (frame == -1 || ((effects.hasCall || effects.hasIndirectStore) &&
+                        hasSlot(&effects.escaped, frame, offset)))
+      continue;
+    if (findStep(program, info, loop, frame, offset, &step) != i) continue;
+
+    for (int u = loop->header; u <= loop->latch && !reduced; u++) {
+      if (!matchSlotOperation(program, info, u, OP_MULT, frame, offset, 1, &factor)) continue;
+      if (__builtin_mul_overflow(step, factor, &increment) ||
+          increment < -2147483647L || increment > 2147483647L)
+        continue;
+
+      // the products by the same factor, weighed against the new additions
+      int uses = 0;
+      for (int v = loop->header; v <= loop->latch; v++) {
+        if (matchSlotOperation(program, info, v, OP_MULT, frame, offset, 1, &otherFactor) &&
+            otherFactor == factor)
+          uses++;
+      }
+      int before = uses * (instrCost(OP_CRVL) + instrCost(OP_CRCT) + instrCost(OP_MULT));
+      int after = uses * instrCost(OP_CRVL) + instrCost(OP_CRVL) + instrCost(OP_CRCT) +
+                  instrCost(OP_SOMA) + instrCost(OP_ARMZ);
+      if (after >= before) continue;
+
+      int local = info->frames[loop->frame].locals;
+      for (int v = loop->header; v <= loop->latch; v++) {
+        if (!matchSlotOperation(program, info, v, OP_MULT, frame, offset, 1, &otherFactor) ||
+            otherFactor != factor)
+          continue;
+        program->code[v].op = OP_CRVL;
+        program->code[v].a = level;
+        program->code[v].b = local;
+        program->code[v + 1].op = OP_NONE;
+        program->code[v + 2].op = OP_NONE;
+      }
+
+      Instr update[4], preheader[4];
+      Instr load = program->code[i - 3].op == OP_CRVL ? program->code[i - 3]
+                                                       : program->code[i - 2];
+      Instr constant = makeInstr(OP_CRCT, 0, 0);
+      load.label[0] = '\0';
+      update[0] = makeInstr(OP_CRVL, level, local);
+      update[1] = constant;
+      update[1].value.intValue = increment;
+      update[2] = makeInstr(OP_SOMA, 0, 0);
+      update[3] = makeInstr(OP_ARMZ, level, local);
+      preheader[0] = load;
+      preheader[1] = constant;
+      preheader[1].value.intValue = factor;
+      preheader[2] = makeInstr(OP_MULT, 0, 0);
+      preheader[3] = makeInstr(OP_ARMZ, level, local);
+
+      insertPreheader(program, targets, loop, preheader, 4);
+      for (int k = 3; k >= 0; k--) insertInstr(program, i + 5, update[k]);
+      compactProgram(program);
+      addLocals(program, loop->header, 1);
+      reduced = 1;
+    }
+  }
+
+  freeEffects(&effects);
+  return reduced;
+}
+
+// Turns the multiplications of loop counters by constants into running
+// sums. Returns the number of multiplications replaced.
+int reduceStrength(Program *program) {
+  int reduced = 0, changed = 1;
+
+  while (changed) {
+    FrameInfo *info = findFrames(program);
+    int *targets = labelTargets(program);
+    Loop *loops;
+    int count = findLoops(program, info, targets, &loops);
+
+    changed = 0;
+    for (int l = 0; l < count && !changed; l++) {
+      changed = reduceLoop(program, info, targets, &loops[l]);
+      reduced += changed;
+    }
+    free(loops);
+    free(targets);
+    freeFrames(info);
+  }
+
+  if (printStats) fprintf(diagnostics, "ivsr: reduced %d induction variable products\n", reduced);
+  return reduced;
+}
+
+// Bounds check elimination
+
+// Checks if the instruction at to can be reached from the one at from
+// within the loop, without going through its header.
+static int reachesInLoop(Program *program, int *targets, Loop *loop, int from, int to) {
+  int size = loop->latch - loop->header + 1, pending = 0, reached = 0;
+  char *seen = (char*)calloc(size, 1);
+  int *worklist = (int*)malloc(size * sizeof(int));
+
+  seen[from - loop->header] = 1;
+  worklist[pending++] = from;
+  while (pending > 0 && !reached) {
+    int i = worklist[--pending];
+    Opcode op = program->code[i].op;
+    int successors[2] = {i + 1, op != OP_CHPR ? targets[i] : -1};
+
+    reached = i == to;
+    if (op == OP_DSVS || op == OP_DSVR) successors[0] = -1;
+    for (int s = 0; s < 2; s++) {
+      int next = successors[s];
+      if (next <= loop->header || next > loop->latch || seen[next - loop->header]) continue;
+      seen[next - loop->header] = 1;
+      worklist[pending++] = next;
+    }
+  }
+  free(seen);
+  free(worklist);
+  return reached;
+}
+
+// Finds the slot the index checked by the VERI at index is computed from,
+// as sign * slot + delta: "CRVL k n", "CRVL k n; CRCT c; SOMA" (in either
+// order), "CRVL k n; CRCT c; SUBT" or "CRCT c; CRVL k n; SUBT". Returns 0 if
+// it is computed otherwise.
+static int matchIndex(Program *program, FrameInfo *info, int index, int *frame,
+                      int *offset, int *sign, long *delta) {
+  Instr *load;
+
+  if (index < 1 || program->code[index].label[0] != '\0') return 0;
+  load = &program->code[index - 1];
+  *sign = 1;
+  *delta = 0;
+  if (load->op != OP_CRVL) {
+    Opcode op = load->op;
+    if (index < 3 || (op != OP_SOMA && op != OP_SUBT) || load->label[0] != '\0') return 0;
+    load = &program->code[index - 3];
+    if (op == OP_SUBT && isIntConstant(load) && program->code[index - 2].op == OP_CRVL &&
+        program->code[index - 2].label[0] == '\0') {
+      *sign = -1;
+      *delta = load->value.intValue;
+      load = &program->code[index - 2];
+    } else {
+      if (op == OP_SOMA && load->op != OP_CRVL) load = &program->code[index - 2];
+      if (load->op != OP_CRVL ||
+          !matchSlotOperation(program, info, index - 3, op, accessFrame(info, index, load->a),
+                              load->b, op == OP_SOMA, delta))
+        return 0;
+      if (op == OP_SUBT) {
+        if (*delta == LONG_MIN) return 0;
+        *delta = -*delta;
+      }
+    }
+  }
+  *frame = accessFrame(info, index, load->a);
+  *offset = load->b;
+  return *frame != -1;
+}
+
+// Finds the values the slot takes in the loop at the instruction at index.
+// The header of the loop has to test it against a constant and jump out,
+// the loop has to change it only by adding a constant step, after index and
+// at most once each time around, and the loop has to start it at a
+// constant. The test bounds it on one side and the start on the other.
+static int slotRange(Program *program, FrameInfo *info, int *targets, Loop *loop,
+                     LoopEffects *effects, int index, int frame, int offset,
+                     long *low, long *high) {
+  Instr *test = &program->code[loop->header];
+  long step, limit, start, next;
+  int store;
+
+  if ((effects->hasCall || effects->hasIndirectStore) &&
+      hasSlot(&effects->escaped, frame, offset))
+    return 0;
+  if (index <= loop->header + 3 || loop->header < 2 ||
+      program->code[loop->header + 3].op != OP_DSVF ||
+      targets[loop->header + 3] <= loop->latch)
+    return 0;
+  for (int i = loop->header + 1; i <= loop->header + 3; i++)
+    if (program->code[i].label[0] != '\0') return 0;
+
+  // the test, as "slot op limit"
+  Opcode op = program->code[loop->header + 2].op;
+  Instr *value = &program->code[loop->header + 1];
+  if (test->op == OP_CRCT) {
+    Instr *swap = test;
+    test = value;
+    value = swap;
+    op = op == OP_CMME ? OP_CMMA : op == OP_CMMA ? OP_CMME :
+         op == OP_CMEG ? OP_CMAG : op == OP_CMAG ? OP_CMEG : op;
+  }
+  if (test->op != OP_CRVL || test->b != offset ||
+      accessFrame(info, loop->header, test->a) != frame ||
+      value->op != OP_CRCT || value->value.isReal)
+    return 0;
+  limit = value->value.intValue;
+
+  // the start, stored right before the header, which nothing else jumps to
+  Instr *initial = &program->code[loop->header - 2], *init = &program->code[loop->header - 1];
+  if (initial->op != OP_CRCT || initial->value.isReal || init->op != OP_ARMZ ||
+      init->label[0] != '\0' || init->b != offset ||
+      accessFrame(info, loop->header - 1, init->a) != frame)
+    return 0;
+  for (int i = 0; i < program->count; i++)
+    if (targets[i] == loop->header && (i < loop->header || i > loop->latch)) return 0;
+  start = initial->value.intValue;
+
+  // the step, which the check sees only after the test
+  store = findStep(program, info, loop, frame, offset, &step);
+  if (store == -1 || store < index || step == 0 ||
+      reachesInLoop(program, targets, loop, store, index) ||
+      reachesInLoop(program, targets, loop, store + 1, store))
+    return 0;
+
+  if (step > 0 && (op == OP_CMME || op == OP_CMEG)) {
+    *low = start;
+    *high = op == OP_CMME ? limit - 1 : limit;
+  } else if (step < 0 && (op == OP_CMMA || op == OP_CMAG)) {
+    *low = op == OP_CMMA ? limit + 1 : limit;
+    *high = start;
+  } else {
+    return 0;
+  }
+  // the step can't wrap the slot around past the limit
+  if ((op == OP_CMME && limit == LONG_MIN) || (op == OP_CMMA && limit == LONG_MAX) ||
+      __builtin_add_overflow(step > 0 ? *high : *low, step, &next))
+    return 0;
+  return 1;
+}
+
+// Removes the index checks of a loop whose index is a slot, plus a constant,
+// that the loop keeps within the bounds. Returns the number removed.
+static int removeLoopChecks(Program *program, FrameInfo *info, int *targets, Loop *loop) {
+  LoopEffects effects = loopEffects(program, info, loop);
+  int removed = 0, frame, offset, sign;
+  long delta, low, high, first, last;
+
+  for (int i = loop->header; i <= loop->latch; i++) {
+    Instr *check = &program->code[i];
+    if (check->op != OP_VERI || !matchIndex(program, info, i, &frame, &offset, &sign, &delta) ||
+        !slotRange(program, info, targets, loop, &effects, i, frame, offset, &low, &high))
+      continue;
+    if (sign < 0 && (low == LONG_MIN || high == LONG_MIN)) continue;
+    if (sign < 0) {
+      long negated = -low;
+      low = -high;
+      high = negated;
+    }
+    if (__builtin_add_overflow(low, delta, &first) ||
+        __builtin_add_overflow(high, delta, &last) || first < check->a || last > check->b)
+      continue;
+    deleteInstr(program, i);
+    removed++;
+  }
+  freeEffects(&effects);
+  return removed;
+}
+
+// Removes the checks of array indexes that the loops around them keep in
+// range, inner loops first. Returns the number of checks removed.
+int removeBoundsChecks(Program *program) {
+  FrameInfo *info = findFrames(program);
+  int *targets = labelTargets(program);
+  Loop *loops;
+  int count = findLoops(program, info, targets, &loops), removed = 0;
+
+  // checks are only marked as removed, so the indexes stay valid
+  for (int l = 0; l < count; l++)
+    removed += removeLoopChecks(program, info, targets, &loops[l]);
+  compactProgram(program);
+
+  if (printStats) fprintf(diagnostics, "bounds: removed %d index checks\n", removed);
+  free(loops);
+  free(targets);
+  freeFrames(info);
+  return removed;
+}
@@ -0,0 +1,615 @@
+#include "header/vm.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Stops the program with a runtime error raised by the instruction at pc.
+// A VM with somewhere to return to (a batch job) returns there instead of
+// exiting.
+void runtimeError(VM *vm, Code *pc, char *message) {
+  if (vm->abort != NULL) {
+    vm->error = message;
+    vm->errorAt = pc - vm->code;
+    siglongjmp(*vm->abort, 1);
+  }
+  flushOutput(&vm->output);
+  fprintf(stderr, "Error: %s at instruction %ld\n", message, (long)(pc - vm->code));
+  exit(1);
+}
+
+// Instructions a run with a deadline goes between two looks at the clock
+#define CLOCK_INTERVAL (1L << 22)
+
+// Called at a jump once a run has gone past the count it was given: stops it
+// when it is over its budget or past its deadline, and returns how far it
+// may run before the next call otherwise.
+long checkBudget(VM *vm, Code *pc, long executed) {
+  if (executed > vm->budget) runtimeError(vm, pc, "instruction budget exceeded");
+  if (vm->deadline == 0) return vm->budget;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec + now.tv_nsec / 1e9 > vm->deadline) runtimeError(vm, pc, "time limit exceeded");
+  return vm->budget - executed > CLOCK_INTERVAL ? executed + CLOCK_INTERVAL : vm->budget;
+}
+
+// Finds the level of the routine each instruction runs in, following the
+// code from the program entry and from each ENPR, and sets it in the
+// instructions where a single level reaches them. Levels are only kept when
+// every call names the level it is made from, as RTPR needs to know the
+// level it returns to, and no routine is at level 0.
+static void findLevels(VM *vm) {
+  int *levels = (int*)malloc((vm->count + 1) * sizeof(int));
+  int *worklist = (int*)malloc(3 * (vm->count + 1) * sizeof(int));
+  int pending = 0, known = 1;
+
+  // -2 is not reached yet, -1 reached with different levels
+  for (int i = 0; i <= vm->count; i++) {
+    Code *code = &vm->code[i];
+    levels[i] = -2;
+    if (i == 0 || code->op == OP_ENPR) {
+      levels[i] = i == 0 ? 0 : code->a;
+      worklist[pending++] = i;
+    }
+    if ((code->op == OP_ENPR || code->op == OP_RTPR) && code->a == 0) known = 0;
+  }
+
+  while (pending > 0 && known) {
+    int i = worklist[--pending], level = levels[i];
+    Code *code = &vm->code[i];
+    int next = i + 1, jump = -1, jumpLevel = level;
+
+    if (code->op == OP_CHPR && level >= 0 && code->a != level) known = 0;
+    switch (code->op) {
+      case OP_DSVS: next = -1; jump = code->target - vm->code; break;
+      case OP_DSVR: next = -1; jump = code->target - vm->code; jumpLevel = code->a; break;
+      case OP_RTPR: case OP_PARA: next = -1; break;
+      case OP_CHPR: jump = code->target - vm->code; break;
+      default: if (code->target != NULL) jump = code->target - vm->code; break;
+    }
+    int successors[2] = {next, jump}, successorLevels[2] = {level, jumpLevel};
+    for (int s = 0; s < 2; s++) {
+      int t = successors[s], merged;
+      if (t < 0 || t > vm->count || vm->code[t].op == OP_ENPR) continue;
+      merged = levels[t] == -2 || levels[t] == successorLevels[s] ? successorLevels[s] : -1;
+      if (merged == levels[t]) continue;
+      levels[t] = merged;
+      worklist[pending++] = t;
+    }
+  }
+
+  for (int i = 0; i <= vm->count; i++)
+    vm->code[i].level = known && levels[i] >= 0 ? levels[i] : -1;
+  free(levels);
+  free(worklist);
+}
+
+// Turns the program into an array of instructions with resolved jumps, and
+// sets reach to the farthest a variable it names is from its frame. Returns 0
+// and prints the instruction if it can't be run on a stack of stackSize.
+static int decode(VM *vm, Program *program, long stackSize, long *reach) {
+  int *targets = labelTargets(program);
+
+  *reach = 0;
+  vm->count = program->count;
+  vm->code = (Code*)calloc(program->count + 1, sizeof(Code));
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    Code *code = &vm->code[i];
+    OperandKind kind = operandKinds[instr->op];
+    int levels = kind == TWO_NUMBERS || kind == ONE_NUMBER || kind == FOUR_NUMBERS ||
+                 kind == LABEL_AND_NUMBER || kind == LABEL_AND_TWO_NUMBERS;
+
+    code->op = instr->op;
+    code->a = instr->a;
+    code->b = instr->b;
+    code->c = instr->c;
+    code->d = instr->d;
+    if (instr->value.isReal)
+      code->value.f = instr->value.realValue;
+    else
+      code->value.i = instr->value.intValue;
+    code->target = targets[i] != -1 ? &vm->code[targets[i]] : NULL;
+
+    char text[BUFFER_SIZE];
+    formatInstruction(instr, text);
+    if (instr->target[0] != '\0' && targets[i] == -1) {
+      fprintf(stderr, "Error: undefined label in \"%s\"\n", text);
+      free(targets);
+      return 0;
+    }
+    // counts that move the stack the other way would get past its checks
+    if (((instr->op == OP_AMEM || instr->op == OP_DMEM) && instr->a < 0) ||
+        (instr->op == OP_RTPR && instr->b < 0)) {
+      fprintf(stderr, "Error: invalid count in \"%s\"\n", text);
+      free(targets);
+      return 0;
+    }
+    // AMEM and DMEM take a count and VERI bounds, not a level
+    if (levels && instr->op != OP_AMEM && instr->op != OP_DMEM && instr->op != OP_VERI &&
+        (instr->a < 0 || instr->a >= DISPLAY_SIZE ||
+         (kind == LABEL_AND_TWO_NUMBERS && (instr->b < 0 || instr->b >= DISPLAY_SIZE)))) {
+      fprintf(stderr, "Error: invalid level in \"%s\"\n", text);
+      free(targets);
+      return 0;
+    }
+    // variables aren't checked when they are accessed, so their offsets must
+    // keep them in the stack or in the guard of reach cells around it
+    int compares = instr->op >= OP_DVME && instr->op <= OP_DVAG;
+    int variables = instr->op == OP_CRVL || instr->op == OP_ARMZ || instr->op == OP_CRVI ||
+                    instr->op == OP_ARMI || instr->op == OP_INCV || instr->op == OP_SOVV ||
+                    compares;
+    int offsets[3] = {instr->b, instr->op == OP_SOVV || compares ? instr->c : 0,
+                      instr->op == OP_SOVV ? instr->d : 0};
+    for (int k = 0; k < 3 && variables; k++) {
+      long offset = offsets[k] < 0 ? -(long)offsets[k] : offsets[k];
+      if (offset > stackSize) {
+        fprintf(stderr, "Error: invalid address in \"%s\"\n", text);
+        free(targets);
+        return 0;
+      }
+      if (offset > *reach) *reach = offset;
+    }
+    // an element is at n - lo + i from the frame, checked when it's accessed
+    if ((instr->op == OP_CRVX || instr->op == OP_ARMX) &&
+        ((long)instr->b - instr->c < INT_MIN || (long)instr->b - instr->c > INT_MAX)) {
+      fprintf(stderr, "Error: invalid address in \"%s\"\n", text);
+      free(targets);
+      return 0;
+    }
+  }
+  // running past the last instruction stops like PARA
+  vm->code[program->count].op = OP_PARA;
+  findLevels(vm);
+  free(targets);
+  return 1;
+}
+
+// Runs the program from its first instruction up to PARA, dispatching
+// through the handler address stored in each instruction.
+static void run(VM *vm) {
+  static void *handlers[OP_COUNT] = {
+    [OP_INPP] = &&INPP, [OP_PARA] = &&PARA, [OP_AMEM] = &&AMEM, [OP_DMEM] = &&DMEM,
+    [OP_NADA] = &&NADA, [OP_CRCT] = &&CRCT, [OP_CRVL] = &&CRVL, [OP_ARMZ] = &&ARMZ,
+    [OP_CRVI] = &&CRVI, [OP_ARMI] = &&ARMI, [OP_CREN] = &&CREN, [OP_SOMA] = &&SOMA,
+    [OP_SUBT] = &&SUBT, [OP_MULT] = &&MULT, [OP_DIVI] = &&DIVI, [OP_INVR] = &&INVR,
+    [OP_CONJ] = &&CONJ, [OP_DISJ] = &&DISJ, [OP_NEGA] = &&NEGA, [OP_CMME] = &&CMME,
+    [OP_CMMA] = &&CMMA, [OP_CMIG] = &&CMIG, [OP_CMDG] = &&CMDG, [OP_CMEG] = &&CMEG,
+    [OP_CMAG] = &&CMAG, [OP_DSVS] = &&DSVS, [OP_DSVF] = &&DSVF, [OP_DSVR] = &&DSVR,
+    [OP_ENRT] = &&ENRT, [OP_CHPR] = &&CHPR, [OP_ENPR] = &&ENPR, [OP_RTPR] = &&RTPR,
+    [OP_LEIT] = &&LEIT, [OP_IMPR] = &&IMPR, [OP_DIVF] = &&DIVF, [OP_SOMF] = &&SOMF,
+    [OP_SUBF] = &&SUBF, [OP_MULF] = &&MULF, [OP_INVF] = &&INVF, [OP_CMPF] = &&CMPF,
+    [OP_ITOF] = &&ITOF, [OP_LEIF] = &&LEIF, [OP_IMPF] = &&IMPF, [OP_INCV] = &&INCV,
+    [OP_SOVV] = &&SOVV, [OP_DVME] = &&DVME, [OP_DVMA] = &&DVMA, [OP_DVIG] = &&DVIG,
+    [OP_DVDG] = &&DVDG, [OP_DVEG] = &&DVEG, [OP_DVAG] = &&DVAG, [OP_CRVX] = &&CRVX,
+    [OP_ARMX] = &&ARMX, [OP_VERI] = &&VERI
+  };
+  // variable accesses that skip the display: globals address M directly and
+  // locals of the running routine address its frame, kept in fp
+  static void *globalHandlers[OP_COUNT] = {
+    [OP_CRVL] = &&CRVL_GLOBAL, [OP_ARMZ] = &&ARMZ_GLOBAL, [OP_CRVI] = &&CRVI_GLOBAL,
+    [OP_ARMI] = &&ARMI_GLOBAL, [OP_INCV] = &&INCV_GLOBAL, [OP_SOVV] = &&SOVV_GLOBAL,
+    [OP_DVME] = &&DVME_GLOBAL, [OP_DVMA] = &&DVMA_GLOBAL, [OP_DVIG] = &&DVIG_GLOBAL,
+    [OP_DVDG] = &&DVDG_GLOBAL, [OP_DVEG] = &&DVEG_GLOBAL, [OP_DVAG] = &&DVAG_GLOBAL,
+    [OP_CRVX] = &&CRVX_GLOBAL, [OP_ARMX] = &&ARMX_GLOBAL
+  };
+  static void *localHandlers[OP_COUNT] = {
+    [OP_CRVL] = &&CRVL_LOCAL, [OP_ARMZ] = &&ARMZ_LOCAL, [OP_CRVI] = &&CRVI_LOCAL,
+    [OP_ARMI] = &&ARMI_LOCAL, [OP_INCV] = &&INCV_LOCAL, [OP_SOVV] = &&SOVV_LOCAL,
+    [OP_DVME] = &&DVME_LOCAL, [OP_DVMA] = &&DVMA_LOCAL, [OP_DVIG] = &&DVIG_LOCAL,
+    [OP_DVDG] = &&DVDG_LOCAL, [OP_DVEG] = &&DVEG_LOCAL, [OP_DVAG] = &&DVAG_LOCAL,
+    [OP_CRVX] = &&CRVX_LOCAL, [OP_ARMX] = &&ARMX_LOCAL
+  };
+  // a profiled run counts at the start of each block, and follows calls
+  static void *profileHandlers[OP_COUNT] = {
+    [OP_CHPR] = &&CHPR_PROFILE, [OP_RTPR] = &&RTPR_PROFILE, [OP_ENRT] = &&ENRT_PROFILE
+  };
+  Profile *profile = vm->profile;
+  Cell *M = vm->memory, *sp = M - 1;
+  unsigned long size = vm->stackSize;
+  long D[DISPLAY_SIZE] = {0};
+  Cell *fp = M;             // M + D[level] for the level the running code is at
+  Code *pc = vm->code;
+  long executed = 1, budget = checkBudget(vm, pc, 0);
+
+  for (int i = 0; i <= vm->count; i++) {
+    Code *code = &vm->code[i];
+    code->handler = handlers[code->op];
+    if (code->level >= 0 && code->a == 0 && globalHandlers[code->op] != NULL)
+      code->handler = globalHandlers[code->op];
+    else if (code->level > 0 && code->a == code->level && localHandlers[code->op] != NULL)
+      code->handler = localHandlers[code->op];
+    if (profile == NULL) continue;
+    if (profileHandlers[code->op] != NULL) code->handler = profileHandlers[code->op];
+    profile->handlers[i] = code->handler;
+    if (profile->length[i] > 0) code->handler = &&PROFILE;
+  }
+
+#define NEXT do { executed++; goto *(++pc)->handler; } while (0)
+// p is in the stack, from INPP's cell below M[0] up to the limit
+#define CHECK_STACK(p) \
+  if ((unsigned long)((p) - M + 1) > size) \
+    runtimeError(vm, pc, (p) < M ? "stack underflow" : "stack overflow")
+// jumps also check the stack, which the instructions between them can only
+// take as far as the slack past either end, into the guard
+#define JUMP(to) do { \
+    if (++executed > budget) budget = checkBudget(vm, pc, executed); \
+    CHECK_STACK(sp); \
+    pc = (to); goto *pc->handler; \
+  } while (0)
+#define BINARY(field, expr) do { sp--; sp[0].field = (expr); NEXT; } while (0)
+#define VAR(k, n) M[D[k] + (n)]
+// the cell at an address the program computed, which must be in the stack
+#define AT(a) M[(unsigned long)(a) < size ? (a) : (runtimeError(vm, pc, "invalid address"), 0)]
+#define ELEMENT(base, i) AT((base) - M + pc->b - pc->c + (i))
+#define COMPARE_AT(base, cmp) \
+  do { if (!((base)[pc->b].i cmp (base)[pc->c].i)) JUMP(pc->target); NEXT; } while (0)
+#define COMPARE_BRANCH(cmp) COMPARE_AT(M + D[pc->a], cmp)
+
+  goto *pc->handler;
+
+INPP: sp = M - 1; D[0] = 0; fp = M; NEXT;
+PARA: flushOutput(&vm->output); vm->executed = executed; return;
+AMEM:
+  sp += pc->a;
+  CHECK_STACK(sp);
+  NEXT;
+DMEM:
+  sp -= pc->a;
+  CHECK_STACK(sp);
+  NEXT;
+NADA: NEXT;
+CRCT: *++sp = pc->value; NEXT;
+CRVL: *++sp = M[D[pc->a] + pc->b]; NEXT;
+ARMZ: M[D[pc->a] + pc->b] = *sp--; NEXT;
+CRVI: *++sp = AT(M[D[pc->a] + pc->b].i); NEXT;
+ARMI: AT(M[D[pc->a] + pc->b].i) = *sp--; NEXT;
+CREN: (++sp)->i = D[pc->a] + pc->b; NEXT;
+SOMA: BINARY(i, WRAP(sp[0].i, +, sp[1].i));
+SUBT: BINARY(i, WRAP(sp[0].i, -, sp[1].i));
+MULT: BINARY(i, WRAP(sp[0].i, *, sp[1].i));
+DIVI:
+  if (sp[0].i == 0) runtimeError(vm, pc, "division by zero");
+  if (sp[0].i == -1 && sp[-1].i == LONG_MIN) runtimeError(vm, pc, "integer overflow");
+  BINARY(i, sp[0].i / sp[1].i);
+INVR: sp->i = WRAP(0, -, sp->i); NEXT;
+CONJ: BINARY(i, sp[0].i && sp[1].i);
+DISJ: BINARY(i, sp[0].i || sp[1].i);
+NEGA: sp->i = 1 - sp->i; NEXT;
+CMME: BINARY(i, sp[0].i < sp[1].i);
+CMMA: BINARY(i, sp[0].i > sp[1].i);
+CMIG: BINARY(i, sp[0].i == sp[1].i);
+CMDG: BINARY(i, sp[0].i != sp[1].i);
+CMEG: BINARY(i, sp[0].i <= sp[1].i);
+CMAG: BINARY(i, sp[0].i >= sp[1].i);
+DSVS: JUMP(pc->target);
+DSVF:
+  if ((sp--)->i == 0) JUMP(pc->target);
+  NEXT;
+DSVR: {
+  // unwind the frames down to the level of the label, through links that
+  // the program may have overwritten
+  long k = pc->b;
+  for (unsigned long unwound = 0; k != pc->a; unwound++) {
+    long base = D[k];
+    if (unwound > size || (unsigned long)M[base - 1].i > size ||
+        (unsigned long)M[base - 2].i >= DISPLAY_SIZE)
+      runtimeError(vm, pc, "invalid frame");
+    D[k] = M[base - 1].i;
+    k = M[base - 2].i;
+  }
+  fp = M + D[pc->a];
+  JUMP(pc->target);
+}
+ENRT:
+  sp = M + D[pc->a] + pc->b - 1;
+  CHECK_STACK(sp);
+  NEXT;
+CHPR:
+  CHECK_STACK(sp + 2);
+  sp[1].i = pc - vm->code + 1;
+  sp[2].i = pc->a;
+  sp += 2;
+  JUMP(pc->target);
+ENPR:
+  (++sp)->i = D[pc->a];
+  D[pc->a] = sp - M + 1;
+  fp = sp + 1;
+  NEXT;
+RTPR: {
+  // the return address and the frame are cells the program may have written
+  if ((unsigned long)sp[-2].i > (unsigned long)vm->count || (unsigned long)sp->i > size)
+    runtimeError(vm, pc, "invalid frame");
+  Code *back = &vm->code[sp[-2].i];
+  D[pc->a] = sp->i;
+  if (back->level >= 0) fp = M + D[back->level];
+  sp -= pc->b + 3;
+  JUMP(back);
+}
+LEIT: (++sp)->i = readInteger(vm, pc); NEXT;
+IMPR: writeInteger(vm, (sp--)->i); NEXT;
+DIVF:
+  if (sp[0].f == 0.0) runtimeError(vm, pc, "division by zero");
+  BINARY(f, sp[0].f / sp[1].f);
+SOMF: BINARY(f, sp[0].f + sp[1].f);
+SUBF: BINARY(f, sp[0].f - sp[1].f);
+MULF: BINARY(f, sp[0].f * sp[1].f);
+INVF: sp->f = -sp->f; NEXT;
+CMPF: BINARY(i, (sp[0].f > sp[1].f) - (sp[0].f < sp[1].f));
+ITOF: sp->f = (double)sp->i; NEXT;
+LEIF: (++sp)->f = readReal(vm, pc); NEXT;
+IMPF: writeReal(vm, (sp--)->f); NEXT;
+
+  // arrays: CRVX k n lo hi and ARMX k n lo hi address the element of the
+  // index on the stack of the array at k n, whose first index is lo
+CRVX: *sp = ELEMENT(M + D[pc->a], sp->i); NEXT;
+ARMX: ELEMENT(M + D[pc->a], sp[-1].i) = sp[0]; sp -= 2; NEXT;
+VERI:
+  if (sp->i < pc->a || sp->i > pc->b) runtimeError(vm, pc, "index out of range");
+  NEXT;
+
+  // superinstructions
+INCV: VAR(pc->a, pc->b).i = WRAP(VAR(pc->a, pc->b).i, +, pc->value.i); NEXT;
+SOVV: VAR(pc->a, pc->d).i = WRAP(VAR(pc->a, pc->b).i, +, VAR(pc->a, pc->c).i); NEXT;
+DVME: COMPARE_BRANCH(<);
+DVMA: COMPARE_BRANCH(>);
+DVIG: COMPARE_BRANCH(==);
+DVDG: COMPARE_BRANCH(!=);
+DVEG: COMPARE_BRANCH(<=);
+DVAG: COMPARE_BRANCH(>=);
+
+  // variables at level 0 and at the level of the running routine
+CRVL_GLOBAL: *++sp = M[pc->b]; NEXT;
+ARMZ_GLOBAL: M[pc->b] = *sp--; NEXT;
+CRVI_GLOBAL: *++sp = AT(M[pc->b].i); NEXT;
+ARMI_GLOBAL: AT(M[pc->b].i) = *sp--; NEXT;
+INCV_GLOBAL: M[pc->b].i = WRAP(M[pc->b].i, +, pc->value.i); NEXT;
+SOVV_GLOBAL: M[pc->d].i = WRAP(M[pc->b].i, +, M[pc->c].i); NEXT;
+DVME_GLOBAL: COMPARE_AT(M, <);
+DVMA_GLOBAL: COMPARE_AT(M, >);
+DVIG_GLOBAL: COMPARE_AT(M, ==);
+DVDG_GLOBAL: COMPARE_AT(M, !=);
+DVEG_GLOBAL: COMPARE_AT(M, <=);
+DVAG_GLOBAL: COMPARE_AT(M, >=);
+CRVX_GLOBAL: *sp = ELEMENT(M, sp->i); NEXT;
+ARMX_GLOBAL: ELEMENT(M, sp[-1].i) = sp[0]; sp -= 2; NEXT;
+CRVL_LOCAL: *++sp = fp[pc->b]; NEXT;
+ARMZ_LOCAL: fp[pc->b] = *sp--; NEXT;
+CRVI_LOCAL: *++sp = AT(fp[pc->b].i); NEXT;
+ARMI_LOCAL: AT(fp[pc->b].i) = *sp--; NEXT;
+INCV_LOCAL: fp[pc->b].i = WRAP(fp[pc->b].i, +, pc->value.i); NEXT;
+SOVV_LOCAL: fp[pc->d].i = WRAP(fp[pc->b].i, +, fp[pc->c].i); NEXT;
+DVME_LOCAL: COMPARE_AT(fp, <);
+DVMA_LOCAL: COMPARE_AT(fp, >);
+DVIG_LOCAL: COMPARE_AT(fp, ==);
+DVDG_LOCAL: COMPARE_AT(fp, !=);
+DVEG_LOCAL: COMPARE_AT(fp, <=);
+DVAG_LOCAL: COMPARE_AT(fp, >=);
+CRVX_LOCAL: *sp = ELEMENT(fp, sp->i); NEXT;
+ARMX_LOCAL: ELEMENT(fp, sp[-1].i) = sp[0]; sp -= 2; NEXT;
+
+  // profiling
+PROFILE:
+  profile->entered[pc - vm->code]++;
+  profile->contexts[profile->context].instructions += profile->length[pc - vm->code];
+  goto *profile->handlers[pc - vm->code];
+CHPR_PROFILE: enterContext(profile, pc->target - vm->code, sp - M); goto CHPR;
+RTPR_PROFILE: leaveContext(profile); goto RTPR;
+ENRT_PROFILE: unwindContexts(profile, D[pc->a]); goto ENRT;
+
+#undef NEXT
+#undef CHECK_STACK
+#undef JUMP
+#undef BINARY
+#undef VAR
+#undef AT
+#undef ELEMENT
+#undef COMPARE_AT
+#undef COMPARE_BRANCH
+}
+
+// Sets the VM up to run the program on a stack of stackSize cells or, when
+// it is 0, of the size the program records it needs, with no input or output
+// open yet. Returns 0 and prints the instruction if it can't be run.
+int loadVM(VM *vm, Program *program, long stackSize, int registers) {
+  long reach;
+  // binary programs that know the stack they need get a stack of that size,
+  // and the rest the default one
+  if (stackSize == 0) stackSize = program->stackSize > 0 ? program->stackSize : STACK_SIZE;
+  if (!decode(vm, program, stackSize, &reach)) return 0;
+  vm->stackSize = stackSize;
+  // the stack is checked at jumps and calls, and the code between them may
+  // push slack cells past the limit or pop twice as many below M[0], where
+  // frames and the variables reach cells from them can then be
+  long slack = stackSlack(program), below = 2 * slack + reach + 4;
+  vm->cells = (Cell*)calloc(below + stackSize + slack + reach + 4, sizeof(Cell));
+  vm->memory = vm->cells + below;
+  vm->executed = 0;
+  vm->budget = LONG_MAX;
+  vm->deadline = 0;
+  openInput(&vm->input, -1);
+  vm->output.fd = -1;
+  vm->output.data = NULL;
+  vm->abort = NULL;
+  vm->error = NULL;
+  vm->profile = NULL;
+  vm->registerCode = NULL;
+  vm->constants = NULL;
+  if (registers) translateRegisters(vm);
+  return 1;
+}
+
+// Runs the register code when the program was translated to it, and the
+// MEPA code otherwise.
+void runVM(VM *vm) {
+  if (vm->registerCode != NULL)
+    runRegisters(vm);
+  else
+    run(vm);
+}
+
+void freeVM(VM *vm) {
+  if (vm->profile != NULL) freeProfile(vm->profile);
+  closeInput(&vm->input);
+  if (vm->output.data != NULL) closeOutput(&vm->output);
+  freeRegisters(vm);
+  free(vm->cells);
+  free(vm->code);
+}
+
+// Writes the report of a profiled run to the file at profilePath, or stderr
+// without one, and its collapsed stacks to stacksPath, if given. Returns 0
+// if a file can't be written.
+static int writeReports(VM *vm, char *profilePath, char *stacksPath) {
+  FILE *file = profilePath != NULL ? fopen(profilePath, "w") : stderr;
+  if (file == NULL) {
+    perror("Error writing profile");
+    return 0;
+  }
+  writeProfile(vm, file);
+  if (file != stderr) fclose(file);
+  if (stacksPath == NULL) return 1;
+  if ((file = fopen(stacksPath, "w")) == NULL) {
+    perror("Error writing stacks");
+    return 0;
+  }
+  writeStacks(vm, file);
+  fclose(file);
+  return 1;
+}
+
+// Reads a positive number from an option's value. Returns 0 if it isn't one.
+static int parseCount(char *text, long *value) {
+  char *end;
+  *value = strtol(text, &end, 10);
+  return end != text && *end == '\0' && *value > 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *programPath = NULL, *summaryPath = NULL;
+  char *lineTablePath = NULL, *profilePath = NULL, *stacksPath = NULL;
+  long stackSize = 0, budget = LONG_MAX, timeout = 0, threads = 0;
+  int validUsage = 1, fuse = 1, registers = 1, count = 0, jit = 0, timed = 0, emitC = 0, batch = 0;
+  int profiled = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--stack=", 8) == 0) {
+      if (!parseCount(argv[i] + 8, &stackSize)) validUsage = 0;
+    } else if (strncmp(argv[i], "--budget=", 9) == 0) {
+      if (!parseCount(argv[i] + 9, &budget)) validUsage = 0;
+    } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+      if (!parseCount(argv[i] + 10, &timeout)) validUsage = 0;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      if (!parseCount(argv[i] + 10, &threads)) validUsage = 0;
+    } else if (strncmp(argv[i], "--summary=", 10) == 0) {
+      summaryPath = argv[i] + 10;
+    } else if (strncmp(argv[i], "--line-table=", 13) == 0) {
+      lineTablePath = argv[i] + 13;
+    } else if (strcmp(argv[i], "--profile") == 0 || strncmp(argv[i], "--profile=", 10) == 0) {
+      profiled = 1;
+      profilePath = argv[i][9] == '=' ? argv[i] + 10 : NULL;
+    } else if (strncmp(argv[i], "--profile-stacks=", 17) == 0) {
+      profiled = 1;
+      stacksPath = argv[i] + 17;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = 1;
+    } else if (strcmp(argv[i], "--no-fuse") == 0) {
+      fuse = 0;
+    } else if (strcmp(argv[i], "--no-registers") == 0) {
+      registers = 0;
+    } else if (strcmp(argv[i], "--count") == 0) {
+      count = 1;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      jit = 1;
+    } else if (strcmp(argv[i], "--time") == 0) {
+      timed = 1;
+    } else if (strcmp(argv[i], "--emit=c") == 0) {
+      emitC = 1;
+    } else if (argv[i][0] != '-' && programPath == NULL) {
+      programPath = argv[i];
+    } else {
+      validUsage = 0;
+    }
+  }
+  // batch jobs always count their instructions, and can't be translated
+  if (batch && (jit || count || emitC)) validUsage = 0;
+  if ((threads > 0 || summaryPath != NULL) && !batch) validUsage = 0;
+  if ((batch || emitC) && profiled) validUsage = 0;
+  if (lineTablePath != NULL && !profiled) validUsage = 0;
+  if (!validUsage || programPath == NULL) {
+    fprintf(stderr, "Usage: %s [--stack=<cells>] [--budget=<instructions>] [--timeout=<seconds>] "
+            "[--no-fuse] [--no-registers] [--jit] [--count] [--time] [--emit=c] "
+            "[--profile[=<path>]] [--profile-stacks=<path>] [--line-table=<path>] <program.mepa>\n"
+            "       %s --batch [--threads=<n>] [--summary=<path>] [--stack=<cells>] "
+            "[--budget=<instructions>] [--timeout=<seconds>] [--no-fuse] [--no-registers] "
+            "[--time] <jobs>\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  if (batch) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ran = runBatch(programPath, summaryPath, threads, stackSize, budget,
+                       timeout > 0 ? timeout : BATCH_TIMEOUT, fuse, registers);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ran >= 0 && timed)
+      fprintf(stderr, "ran %d jobs in %.3f s\n", ran,
+              (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return ran < 0;
+  }
+
+  FILE *file = fopen(programPath, "rb");
+  if (file == NULL) {
+    perror("Error opening file");
+    return 1;
+  }
+  int errorLine;
+  Program *program = readProgram(file, &errorLine);
+  fclose(file);
+  if (program == NULL) {
+    if (errorLine > 0)
+      fprintf(stderr, "Error: invalid instruction at line %d\n", errorLine);
+    else
+      fprintf(stderr, "Error: invalid binary program\n");
+    return 1;
+  }
+
+  // profiles count the instructions as written, on the interpreter
+  VM vm;
+  if (fuse && !profiled) fuseInstructions(program);
+  if (!loadVM(&vm, program, stackSize, registers && !jit && !emitC && !profiled)) return 1;
+  if (profiled && (vm.profile = newProfile(&vm, program, lineTablePath)) == NULL) return 1;
+  if (emitC) {
+    // translate instead of running
+    writeCProgram(program, stdout);
+    freeProgram(program);
+    freeVM(&vm);
+    return 0;
+  }
+  freeProgram(program);
+  vm.budget = budget;
+  openInput(&vm.input, STDIN_FILENO);
+  openOutput(&vm.output, STDOUT_FILENO);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (timeout > 0) vm.deadline = start.tv_sec + start.tv_nsec / 1e9 + timeout;
+  // the JIT neither counts instructions nor keeps to a budget or a deadline
+  if (vm.registerCode != NULL || !jit || count || profiled || budget != LONG_MAX ||
+      timeout > 0 || !runJit(&vm))
+    runVM(&vm);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (count) fprintf(stderr, "executed %ld instructions\n", vm.executed);
+  if (profiled && !writeReports(&vm, profilePath, stacksPath)) {
+    freeVM(&vm);
+    return 1;
+  }
+  if (timed)
+    fprintf(stderr, "ran in %.3f s\n",
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  freeVM(&vm);
+  return 0;
+}
@@ -0,0 +1,704 @@
+#include "header/optimizer.h"
+#include "header/generator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int printStats = 0;
+
+// Frames
+
+// Finds the activation records of the program. The locals of a frame are
+// the AMEM right after its INPP/ENPR, released by the matching DMEM right
+// before its PARA/RTPR, both marked as frame locals: an AMEM reserving a
+// function result and the DMEM dropping a dead store's value can end up
+// in the same places.
+FrameInfo *findFrames(Program *program) {
+  FrameInfo *info = (FrameInfo*)calloc(1, sizeof(FrameInfo));
+  int *stack = (int*)malloc((program->count + 1) * sizeof(int));
+  int top = -1;
+
+  info->frames = (Frame*)malloc((program->count + 1) * sizeof(Frame));
+  info->frameOf = (int*)malloc((program->count + 1) * sizeof(int));
+
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+
+    if (instr->op == OP_INPP || instr->op == OP_ENPR) {
+      Frame *frame = &info->frames[info->count];
+      frame->level = instr->op == OP_INPP ? 0 : instr->a;
+      frame->entry = i;
+      frame->exit = -1;
+      frame->parent = top >= 0 ? stack[top] : -1;
+      frame->alloc = frame->release = -1;
+      frame->locals = 0;
+      if (i + 1 < program->count && program->code[i + 1].op == OP_AMEM &&
+          program->code[i + 1].frameLocals)
+        frame->alloc = i + 1;
+      stack[++top] = info->count++;
+    }
+    info->frameOf[i] = top >= 0 ? stack[top] : -1;
+
+    if ((instr->op == OP_RTPR || instr->op == OP_PARA) && top >= 0) {
+      Frame *frame = &info->frames[stack[top--]];
+      frame->exit = i;
+      if (frame->alloc != -1 && program->code[i - 1].op == OP_DMEM &&
+          program->code[i - 1].frameLocals &&
+          program->code[i - 1].a == program->code[frame->alloc].a) {
+        frame->release = i - 1;
+        frame->locals = program->code[frame->alloc].a;
+      } else {
+        // an AMEM that isn't released at the exit reserves a function result
+        frame->alloc = -1;
+      }
+    }
+  }
+
+  free(stack);
+  return info;
+}
+
+// Returns the frame addressed by an access to the given lexical level made
+// by the instruction at index, or -1.
+int accessFrame(FrameInfo *info, int index, int level) {
+  int frame = info->frameOf[index];
+  while (frame != -1 && info->frames[frame].level != level)
+    frame = info->frames[frame].parent;
+  return frame;
+}
+
+void freeFrames(FrameInfo *info) {
+  free(info->frames);
+  free(info->frameOf);
+  free(info);
+}
+
+// Control flow graph
+
+static int endsBlock(Opcode op) {
+  return op == OP_DSVS || op == OP_DSVF || op == OP_DSVR ||
+         op == OP_RTPR || op == OP_PARA;
+}
+
+// Splits the program into basic blocks. Calls don't end a block: the
+// routine returns to the next instruction.
+CFG *buildCFG(Program *program) {
+  CFG *cfg = (CFG*)calloc(1, sizeof(CFG));
+  int count = program->count;
+
+  cfg->targets = labelTargets(program);
+  cfg->blockOf = (int*)malloc((count + 1) * sizeof(int));
+  cfg->blocks = (Block*)malloc((count + 1) * sizeof(Block));
+
+  for (int i = 0; i < count; i++) {
+    if (i == 0 || program->code[i].label[0] != '\0' ||
+        endsBlock(program->code[i - 1].op)) {
+      cfg->blocks[cfg->count].start = i;
+      cfg->count++;
+    }
+    cfg->blocks[cfg->count - 1].end = i;
+    cfg->blockOf[i] = cfg->count - 1;
+  }
+
+  for (int b = 0; b < cfg->count; b++) {
+    Block *block = &cfg->blocks[b];
+    int last = block->end, target = cfg->targets[last];
+    Opcode op = program->code[last].op;
+
+    block->succCount = 0;
+    if (op != OP_DSVS && op != OP_DSVR && op != OP_RTPR && op != OP_PARA &&
+        b + 1 < cfg->count)
+      block->succ[block->succCount++] = b + 1;
+    if ((op == OP_DSVS || op == OP_DSVF || op == OP_DSVR) && target != -1)
+      block->succ[block->succCount++] = cfg->blockOf[target];
+  }
+  return cfg;
+}
+
+void freeCFG(CFG *cfg) {
+  free(cfg->blocks);
+  free(cfg->blockOf);
+  free(cfg->targets);
+  free(cfg);
+}
+
+// Helpers
+
+// Makes every jump to the old label go to the new one.
+static void renameLabel(Program *program, char *oldLabel, char *newLabel) {
+  for (int i = 0; i < program->count; i++) {
+    if (strcmp(program->code[i].target, oldLabel) == 0)
+      strcpy(program->code[i].target, newLabel);
+  }
+}
+
+// Marks an instruction as removed. Its label moves to the next instruction.
+void deleteInstr(Program *program, int index) {
+  Instr *instr = &program->code[index];
+  int next = index + 1;
+
+  while (next < program->count && program->code[next].op == OP_NONE) next++;
+  if (instr->label[0] != '\0' && next < program->count) {
+    if (program->code[next].label[0] == '\0')
+      strcpy(program->code[next].label, instr->label);
+    else
+      renameLabel(program, instr->label, program->code[next].label);
+  }
+  instr->op = OP_NONE;
+  instr->label[0] = '\0';
+}
+
+// Instructions without side effects, with the values they pop and push.
+int isPure(Opcode op, int *pops, int *pushes) {
+  switch (op) {
+    case OP_CRCT: case OP_CRVL: case OP_CRVI: case OP_CREN:
+      *pops = 0; *pushes = 1;
+      return 1;
+    case OP_INVR: case OP_NEGA: case OP_INVF: case OP_ITOF:
+      *pops = 1; *pushes = 1;
+      return 1;
+    case OP_SOMA: case OP_SUBT: case OP_MULT: case OP_CONJ: case OP_DISJ:
+    case OP_CMME: case OP_CMMA: case OP_CMIG: case OP_CMDG: case OP_CMEG: case OP_CMAG:
+    case OP_SOMF: case OP_SUBF: case OP_MULF: case OP_CMPF:
+      *pops = 2; *pushes = 1;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Returns where the side-effect free code computing the value consumed by
+// the instruction at index starts, or -1 if there is no such code.
+static int pureExpressionStart(Program *program, int index) {
+  int need = 1, pops, pushes;
+
+  if (program->code[index].label[0] != '\0') return -1;
+  for (int i = index - 1; i >= 0; i--) {
+    if (!isPure(program->code[i].op, &pops, &pushes)) return -1;
+    need += pops - pushes;
+    if (need == 0) return i;
+    if (need < 0 || program->code[i].label[0] != '\0') return -1;
+  }
+  return -1;
+}
+
+int isSlotAccess(Opcode op) {
+  return op == OP_CRVL || op == OP_ARMZ || op == OP_CRVI ||
+         op == OP_ARMI || op == OP_CREN || op == OP_CRVX || op == OP_ARMX;
+}
+
+// Returns the number of slots from instr->b that a slot access may reach:
+// the whole array for CRVX and ARMX, one slot for the others.
+static int accessedSlots(Instr *instr) {
+  return instr->op == OP_CRVX || instr->op == OP_ARMX ? instr->d - instr->c + 1 : 1;
+}
+
+// Adds locals to the frame of the instruction at index, allocating them
+// when the frame has none. Returns the first new slot.
+int addLocals(Program *program, int index, int count) {
+  FrameInfo *info = findFrames(program);
+  Frame *frame = &info->frames[info->frameOf[index]];
+  int first = frame->locals;
+
+  for (int i = frame->entry; i <= frame->exit; i++) {
+    if (program->code[i].op == OP_ENRT &&
+        accessFrame(info, i, program->code[i].a) == info->frameOf[index])
+      program->code[i].b += count;
+  }
+  if (frame->alloc != -1) {
+    program->code[frame->alloc].a += count;
+    program->code[frame->release].a += count;
+  } else {
+    // jumps to the exit have to release the locals too
+    Instr release = makeInstr(OP_DMEM, count, 0), alloc = makeInstr(OP_AMEM, count, 0);
+    release.frameLocals = alloc.frameLocals = 1;
+    strcpy(release.label, program->code[frame->exit].label);
+    program->code[frame->exit].label[0] = '\0';
+    insertInstr(program, frame->exit, release);
+    insertInstr(program, frame->entry + 1, alloc);
+  }
+  freeFrames(info);
+  return first;
+}
+
+// Values pushed (positive) or popped (negative) by an instruction, or
+// 0 with *known unset when it can't be told.
+int stackEffect(Program *program, FrameInfo *info, int *targets, int index,
+                int *known) {
+  Instr *instr = &program->code[index];
+  int pops, pushes;
+
+  *known = 1;
+  if (isPure(instr->op, &pops, &pushes)) return pushes - pops;
+  switch (instr->op) {
+    case OP_AMEM: return instr->a;
+    case OP_DMEM: return -instr->a;
+    case OP_LEIT: case OP_LEIF: return 1;
+    case OP_ARMZ: case OP_ARMI: case OP_IMPR: case OP_IMPF: return -1;
+    case OP_CRVX: case OP_VERI: return 0;
+    case OP_ARMX: return -2;
+    case OP_DIVI: case OP_DIVF: return -1;
+    case OP_CHPR:
+      if (targets[index] != -1) {
+        Frame *frame = &info->frames[info->frameOf[targets[index]]];
+        return -program->code[frame->exit].b;
+      }
+      break;
+    default:
+      break;
+  }
+  *known = 0;
+  return 0;
+}
+
+// Finds where each argument of the call at index starts, walking back over
+// the code pushing them. Returns 0 if it can't be told.
+int findArguments(Program *program, FrameInfo *info, int *targets, int call,
+                         int count, int *starts) {
+  int pushed = 0, known;
+
+  for (int j = call - 1; pushed < count; j--) {
+    if (j < 0 || program->code[j + 1].label[0] != '\0') return 0;
+    pushed += stackEffect(program, info, targets, j, &known);
+    if (!known || pushed > count) return 0;
+    // the first time n values are on the stack the last n arguments start
+    if (pushed > 0 && starts[count - pushed] == -1) starts[count - pushed] = j;
+  }
+  return 1;
+}
+
+// Dead code elimination
+
+// Turns conditional jumps over constants into unconditional jumps or
+// nothing at all.
+static int foldConstantBranches(Program *program) {
+  int changes = 0;
+
+  for (int i = 0; i + 1 < program->count; i++) {
+    Instr *value = &program->code[i], *jump = &program->code[i + 1];
+    if (value->op != OP_CRCT || jump->op != OP_DSVF || jump->label[0] != '\0')
+      continue;
+
+    int isTrue = value->value.isReal ? value->value.realValue != 0.0
+                                     : value->value.intValue != 0;
+    if (isTrue) {
+      deleteInstr(program, i + 1);
+    } else {
+      jump->op = OP_DSVS;
+    }
+    deleteInstr(program, i);
+    changes++;
+  }
+  compactProgram(program);
+  return changes;
+}
+
+// Removes the blocks that can't be reached from the program entry.
+static int removeUnreachable(Program *program) {
+  CFG *cfg = buildCFG(program);
+  char *reached = (char*)calloc(cfg->count + 1, 1);
+  int *worklist = (int*)malloc((cfg->count + 1) * sizeof(int));
+  int pending = 0, removed = 0;
+
+  if (cfg->count > 0) {
+    reached[0] = 1;
+    worklist[pending++] = 0;
+  }
+  while (pending > 0) {
+    Block *block = &cfg->blocks[worklist[--pending]];
+    for (int s = 0; s < block->succCount; s++) {
+      if (!reached[block->succ[s]]) {
+        reached[block->succ[s]] = 1;
+        worklist[pending++] = block->succ[s];
+      }
+    }
+    // called routines are reached too
+    for (int i = block->start; i <= block->end; i++) {
+      if (program->code[i].op != OP_CHPR || cfg->targets[i] == -1) continue;
+      int callee = cfg->blockOf[cfg->targets[i]];
+      if (!reached[callee]) {
+        reached[callee] = 1;
+        worklist[pending++] = callee;
+      }
+    }
+  }
+
+  for (int b = 0; b < cfg->count; b++) {
+    if (reached[b]) continue;
+    // only unreachable jumps can refer to these labels
+    for (int i = cfg->blocks[b].start; i <= cfg->blocks[b].end; i++) {
+      program->code[i].op = OP_NONE;
+      program->code[i].label[0] = '\0';
+      removed++;
+    }
+  }
+
+  free(reached);
+  free(worklist);
+  freeCFG(cfg);
+  compactProgram(program);
+  return removed;
+}
+
+// Removes jumps to the next instruction, NADA placeholders and labels
+// nothing jumps to.
+static int removeRedundantJumps(Program *program) {
+  int changes = 0;
+
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->op == OP_NADA) {
+      deleteInstr(program, i);
+      changes++;
+    } else if (instr->op == OP_DSVS && i + 1 < program->count &&
+               strcmp(instr->target, program->code[i + 1].label) == 0) {
+      deleteInstr(program, i);
+      changes++;
+    }
+  }
+  compactProgram(program);
+
+  int *targets = labelTargets(program);
+  char *used = (char*)calloc(program->count + 1, 1);
+  for (int i = 0; i < program->count; i++)
+    if (targets[i] != -1) used[targets[i]] = 1;
+  for (int i = 0; i < program->count; i++) {
+    if (program->code[i].label[0] != '\0' && !used[i]) {
+      program->code[i].label[0] = '\0';
+      changes++;
+    }
+  }
+  free(used);
+  free(targets);
+  return changes;
+}
+
+// Removes the stores to locals that are never read, along with the code
+// computing the stored value when it has no side effects.
+static int removeDeadStores(Program *program) {
+  FrameInfo *info = findFrames(program);
+  int **reads = (int**)malloc(info->count * sizeof(int*));
+  int changes = 0;
+
+  for (int f = 0; f < info->count; f++)
+    reads[f] = (int*)calloc(info->frames[f].locals + 1, sizeof(int));
+
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    if (!isSlotAccess(instr->op) || instr->op == OP_ARMZ || instr->b < 0) continue;
+    int f = accessFrame(info, i, instr->a);
+    if (f != -1 && instr->b < info->frames[f].locals) reads[f][instr->b]++;
+  }
+
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->op != OP_ARMZ || instr->b < 0) continue;
+    int f = accessFrame(info, i, instr->a);
+    if (f == -1 || instr->b >= info->frames[f].locals || reads[f][instr->b] > 0)
+      continue;
+
+    int start = pureExpressionStart(program, i);
+    if (start != -1) {
+      for (int j = start; j <= i; j++) deleteInstr(program, j);
+    } else {
+      // the value still has to leave the stack
+      instr->op = OP_DMEM;
+      instr->a = 1;
+      instr->b = 0;
+    }
+    changes++;
+  }
+
+  for (int f = 0; f < info->count; f++) free(reads[f]);
+  free(reads);
+  freeFrames(info);
+  compactProgram(program);
+  return changes;
+}
+
+// Drops the locals no instruction uses anymore, renumbering the others.
+// Returns the number of slots dropped.
+static int removeUnusedSlots(Program *program) {
+  FrameInfo *info = findFrames(program);
+  int dropped = 0;
+
+  for (int f = 0; f < info->count; f++) {
+    Frame *frame = &info->frames[f];
+    if (frame->alloc == -1) continue;
+
+    int *newSlot = (int*)calloc(frame->locals + 1, sizeof(int));
+    int count = 0;
+    for (int i = frame->entry; i <= frame->exit; i++) {
+      Instr *instr = &program->code[i];
+      if (isSlotAccess(instr->op) && instr->b >= 0 && instr->b < frame->locals &&
+          accessFrame(info, i, instr->a) == f) {
+        for (int n = 0; n < accessedSlots(instr) && instr->b + n < frame->locals; n++)
+          newSlot[instr->b + n] = 1;
+      }
+    }
+    for (int n = 0; n < frame->locals; n++)
+      newSlot[n] = newSlot[n] ? count++ : -1;
+
+    if (count < frame->locals) {
+      for (int i = frame->entry; i <= frame->exit; i++) {
+        Instr *instr = &program->code[i];
+        if (isSlotAccess(instr->op) && instr->b >= 0 && instr->b < frame->locals &&
+            accessFrame(info, i, instr->a) == f)
+          instr->b = newSlot[instr->b];
+        else if (instr->op == OP_ENRT && accessFrame(info, i, instr->a) == f)
+          instr->b = count;
+      }
+      program->code[frame->alloc].a = count;
+      program->code[frame->release].a = count;
+      if (count == 0) {
+        deleteInstr(program, frame->alloc);
+        deleteInstr(program, frame->release);
+      }
+      dropped += frame->locals - count;
+    }
+    free(newSlot);
+  }
+
+  freeFrames(info);
+  compactProgram(program);
+  return dropped;
+}
+
+// Removes unreachable blocks, branches over constant conditions and dead
+// stores, then the frame slots left unused. Returns the number of
+// instructions removed.
+int eliminateDeadCode(Program *program) {
+  int before = program->count, slots = 0, changes;
+
+  do {
+    changes = foldConstantBranches(program);
+    changes += removeUnreachable(program);
+    changes += removeRedundantJumps(program);
+    changes += removeDeadStores(program);
+    int dropped = removeUnusedSlots(program);
+    slots += dropped;
+    changes += dropped;
+  } while (changes > 0);
+
+  if (printStats)
+    fprintf(diagnostics, "dce: removed %d instructions and %d frame slots\n",
+            before - program->count, slots);
+  return before - program->count;
+}
+
+// Stack slot sharing
+
+// Checks if the instruction defines (ARMZ) or uses one of the locals of
+// the frame, returning the slot or -1.
+static int frameSlot(Program *program, FrameInfo *info, int index, int frame) {
+  Instr *instr = &program->code[index];
+  if (!isSlotAccess(instr->op) || instr->b < 0 ||
+      instr->b >= info->frames[frame].locals ||
+      accessFrame(info, index, instr->a) != frame)
+    return -1;
+  return instr->b;
+}
+
+// Gives the locals of a frame whose live ranges don't overlap the same slot.
+// Locals reached from nested routines or by address, and arrays, keep slots
+// of their own, so only the others are tracked. Returns the number of slots
+// saved.
+static int shareFrameSlots(Program *program, CFG *cfg, FrameInfo *info, int f) {
+  Frame *frame = &info->frames[f];
+  int locals = frame->locals, saved = 0, shared = 0;
+  char *pinned = (char*)calloc(locals, 1);
+  int *var = (int*)malloc(locals * sizeof(int));
+  int *color = (int*)malloc(locals * sizeof(int));
+
+  for (int i = frame->entry; i <= frame->exit; i++) {
+    int slot = frameSlot(program, info, i, f);
+    Opcode op = program->code[i].op;
+    if (slot == -1) continue;
+    if (info->frameOf[i] != f || op == OP_CREN || op == OP_CRVI || op == OP_ARMI)
+      pinned[slot] = 1;
+    // pinned slots keep their order, so an array stays in one piece
+    if (op == OP_CRVX || op == OP_ARMX) {
+      for (int n = 0; n < accessedSlots(&program->code[i]) && slot + n < locals; n++)
+        pinned[slot + n] = 1;
+    }
+  }
+  for (int n = 0; n < locals; n++) var[n] = pinned[n] ? -1 : shared++;
+
+  char *interferes = (char*)calloc((size_t)shared * shared, 1);
+  char *live = (char*)malloc(shared + 1);
+
+  // liveness over the blocks of the frame itself
+  int blocks = cfg->count;
+  char *in = (char*)calloc((size_t)blocks * shared, 1);
+  char *out = (char*)calloc((size_t)blocks * shared, 1);
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int b = blocks - 1; b >= 0; b--) {
+      Block *block = &cfg->blocks[b];
+      if (info->frameOf[block->start] != f) continue;
+
+      memset(live, 0, shared);
+      for (int s = 0; s < block->succCount; s++)
+        for (int n = 0; n < shared; n++) live[n] |= in[block->succ[s] * shared + n];
+      memcpy(&out[b * shared], live, shared);
+      for (int i = block->end; i >= block->start; i--) {
+        int slot = frameSlot(program, info, i, f);
+        if (slot == -1 || pinned[slot]) continue;
+        live[var[slot]] = program->code[i].op != OP_ARMZ;
+      }
+      if (memcmp(&in[b * shared], live, shared) != 0) {
+        memcpy(&in[b * shared], live, shared);
+        changed = 1;
+      }
+    }
+  }
+
+  // a store interferes with everything live right after it
+  for (int b = 0; b < blocks; b++) {
+    Block *block = &cfg->blocks[b];
+    if (info->frameOf[block->start] != f) continue;
+
+    memcpy(live, &out[b * shared], shared);
+    for (int i = block->end; i >= block->start; i--) {
+      int slot = frameSlot(program, info, i, f);
+      if (slot == -1 || pinned[slot]) continue;
+      int v = var[slot];
+      if (program->code[i].op == OP_ARMZ) {
+        for (int n = 0; n < shared; n++) {
+          if (live[n] && n != v)
+            interferes[v * shared + n] = interferes[n * shared + v] = 1;
+        }
+        live[v] = 0;
+      } else {
+        live[v] = 1;
+      }
+    }
+  }
+  // locals read before any store hold whatever the frame started with
+  int entryBlock = cfg->blockOf[frame->entry];
+  for (int n = 0; n < shared; n++)
+    for (int m = 0; m < shared; m++)
+      if (n != m && in[entryBlock * shared + n] && in[entryBlock * shared + m])
+        interferes[n * shared + m] = 1;
+
+  // pinned locals get slots of their own, the others are colored greedily
+  // with the colors left
+  int colors = 0, first;
+  for (int n = 0; n < locals; n++) color[n] = pinned[n] ? colors++ : -1;
+  first = colors;
+  for (int n = 0; n < locals; n++) {
+    if (pinned[n]) continue;
+    for (int c = first; color[n] == -1; c++) {
+      int taken = 0;
+      for (int m = 0; m < locals && !taken; m++)
+        taken = color[m] == c && interferes[var[n] * shared + var[m]];
+      if (!taken) color[n] = c;
+    }
+    if (color[n] >= colors) colors = color[n] + 1;
+  }
+
+  if (colors < locals) {
+    for (int i = frame->entry; i <= frame->exit; i++) {
+      int slot = frameSlot(program, info, i, f);
+      if (slot != -1) program->code[i].b = color[slot];
+    }
+    program->code[frame->alloc].a = colors;
+    program->code[frame->release].a = colors;
+    saved = locals - colors;
+  }
+
+  free(pinned);
+  free(var);
+  free(interferes);
+  free(live);
+  free(color);
+  free(in);
+  free(out);
+  return saved;
+}
+
+// Shares the frame slots of locals whose live ranges don't overlap.
+// Frames that are targets of gotos from nested routines are left alone.
+int shareSlots(Program *program) {
+  CFG *cfg = buildCFG(program);
+  FrameInfo *info = findFrames(program);
+  int saved = 0;
+
+  for (int f = 0; f < info->count; f++) {
+    int hasNonLocalTarget = 0;
+    if (info->frames[f].alloc == -1) continue;
+    for (int i = info->frames[f].entry; i <= info->frames[f].exit; i++)
+      if (program->code[i].op == OP_ENRT && accessFrame(info, i, program->code[i].a) == f)
+        hasNonLocalTarget = 1;
+    if (!hasNonLocalTarget) saved += shareFrameSlots(program, cfg, info, f);
+  }
+
+  if (printStats) fprintf(diagnostics, "slots: shared %d frame slots\n", saved);
+  freeFrames(info);
+  freeCFG(cfg);
+  return saved;
+}
+
+// Pass manager
+
+// Passes in pipeline order. Front end passes have no run function: the
+// parser checks passEnabled() itself.
+Pass passes[] = {
+  {"constfold", 1, NULL, 0},
+  {"callgraph", 1, removeDeadRoutines, 0},
+  {"purecall", 1, evaluatePureCalls, 0},
+  {"tailcall", 1, eliminateTailCalls, 0},
+  {"inline", 2, inlineCalls, 0},
+  {"varparams", 2, copyVarParams, 0},
+  {"dce", 1, eliminateDeadCode, 0},
+  {"bounds", 1, removeBoundsChecks, 0},
+  {"licm", 2, hoistInvariants, 0},
+  {"ivsr", 2, reduceStrength, 0},
+  {"slots", 1, shareSlots, 0}
+};
+int passCount = sizeof(passes) / sizeof(passes[0]);
+int optimizationLevel = 1;
+int timePasses = 0;
+
+// Checks if a pass runs at the current optimization level.
+int passEnabled(char *name) {
+  for (int i = 0; i < passCount; i++) {
+    if (strcmp(passes[i].name, name) == 0)
+      return !passes[i].disabled && passes[i].minLevel <= optimizationLevel;
+  }
+  return 0;
+}
+
+// Switches a pass off. Returns 0 if there is no such pass.
+int disablePass(char *name) {
+  for (int i = 0; i < passCount; i++) {
+    if (strcmp(passes[i].name, name) == 0) {
+      passes[i].disabled = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double elapsedMs(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// Runs the enabled passes over the generated code.
+void optimizeCode() {
+  struct timespec start, end;
+
+  for (int i = 0; i < passCount; i++) {
+    if (passes[i].run == NULL || !passEnabled(passes[i].name)) continue;
+
+    int before = code->count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    passes[i].run(code);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (timePasses)
+      fprintf(diagnostics, "pass %-10s %9.3f ms %7d -> %d instructions\n",
+              passes[i].name, elapsedMs(start, end), before, code->count);
+  }
+}
\ No newline at end of file
@@ -1,56 +1,84 @@
 #include "header/parser.h"
 #include "header/generator.h"
+#include "header/optimizer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
 
-SymbolNode *symbolTable = NULL;
-Node *currentTok;
+_Thread_local SymbolNode *symbolTable = NULL;
+_Thread_local Node *currentTok;
+_Thread_local SymbolNode *currentRoutine = NULL;
+_Thread_local int currentLevel = 0;
+_Thread_local int localCount = 0;
+// every symbol added, as routines keep their parameters after their scope
+_Thread_local SymbolNode *allocatedSymbols = NULL;
 
 // Handles a error based on it's error type
 void handleError(TokenType expectedType, char *expectedLexeme,
                  ErrorType error) {
   char *types[] = {
-    "keyword", "identifier", "number", "operator", 
+    "keyword", "identifier", "number", "operator",
     "compound_operator", "delimiter", "comments", "unknown"
   };
 
   switch (error) {
     case UNEXPECTED_TYPE:
-      fprintf(stderr, "Error: expected type %s but found %s at line %d\n",
+      fprintf(diagnostics, "Error: expected type %s but found %s at line %d\n",
               types[expectedType], types[currentTok->tok->type], currentTok->tok->line);
       break;
     case UNEXPECTED_LEXEME:
-      fprintf(stderr, "Error: expected \"%s\" but found \"%s\" at line %d\n",
+      fprintf(diagnostics, "Error: expected \"%s\" but found \"%s\" at line %d\n",
               expectedLexeme, currentTok->tok->lexeme, currentTok->tok->line);
       break;
     case INVALID_TYPE:
-      fprintf(stderr, "Error: expected valid type but found \"%s\" at line %d\n",
+      fprintf(diagnostics, "Error: expected valid type but found \"%s\" at line %d\n",
               currentTok->tok->lexeme, currentTok->tok->line);
       break;
     case INVALID_STATEMENT:
-      fprintf(stderr, "Error: expected valid statement but found \"%s\" at line %d\n",
+      fprintf(diagnostics, "Error: expected valid statement but found \"%s\" at line %d\n",
               currentTok->tok->lexeme, currentTok->tok->line);
       break;
     case INVALID_FACTOR:
-      fprintf(stderr, "Error: expected valid factor but found \"%s\" at line %d\n",
+      fprintf(diagnostics, "Error: expected valid factor but found \"%s\" at line %d\n",
               currentTok->tok->lexeme, currentTok->tok->line);
       break;
     case UNDECLARED_SYMBOL:
-      fprintf(stderr, "Error: undeclared symbol \"%s\" at line %d\n",
+      fprintf(diagnostics, "Error: undeclared symbol \"%s\" at line %d\n",
               currentTok->tok->lexeme, currentTok->tok->line);
       break;
     case INVALID_END:
-      fprintf(stderr, "Error: unexpected token after end of file \"%s\"",
+      fprintf(diagnostics, "Error: unexpected token after end of file \"%s\"",
               currentTok->tok->lexeme);
       break;
+    case INVALID_ASSIGNMENT:
+      fprintf(diagnostics, "Error: cannot assign to \"%s\" at line %d\n",
+              currentTok->tok->lexeme, currentTok->tok->line);
+      break;
+    case INVALID_CALL:
+      fprintf(diagnostics, "Error: \"%s\" is not a procedure at line %d\n",
+              currentTok->tok->lexeme, currentTok->tok->line);
+      break;
+    case INVALID_ARGUMENT:
+      fprintf(diagnostics, "Error: invalid argument list at \"%s\" at line %d\n",
+              currentTok->tok->lexeme, currentTok->tok->line);
+      break;
+    case TYPE_MISMATCH:
+      fprintf(diagnostics, "Error: type mismatch before \"%s\" at line %d\n",
+              currentTok->tok->lexeme, currentTok->tok->line);
+      break;
+    case INVALID_INDEX:
+      fprintf(diagnostics, "Error: index out of range before \"%s\" at line %d\n",
+              currentTok->tok->lexeme, currentTok->tok->line);
+      break;
     default:
-      fprintf(stderr, "Error: unknown error");
+      fprintf(diagnostics, "Error: unknown error");
       break;
   }
 
-  printf("Rejeito\n");
-  exit(1);
+  if (compileAbort == NULL) printf("Rejeito\n");
+  abortCompilation();
 }
 
 // Moves to the next token in the list
@@ -61,21 +89,29 @@ void nextToken() {
 }
 
 // Adds symbol to symbol table
-void addSymbol(char* name) {
-  SymbolNode *newNode = (SymbolNode*)malloc(sizeof(SymbolNode));
+SymbolNode *addSymbol(char* name) {
+  SymbolNode *newNode = (SymbolNode*)calloc(1, sizeof(SymbolNode));
   strcpy(newNode->name, name);
   newNode->next = symbolTable;
   symbolTable = newNode;
+  newNode->allocated = allocatedSymbols;
+  allocatedSymbols = newNode;
+  return newNode;
 }
 
-// Checks if symbol exists in the table
-int symbolExists(char* name) {
+// Finds the innermost symbol with the given name
+SymbolNode *findSymbol(char* name) {
   SymbolNode* current = symbolTable;
   while (current != NULL) {
-    if (strcmp(current->name, name) == 0) return 1;
+    if (strcmp(current->name, name) == 0) return current;
     current = current->next;
   }
-  return 0;
+  return NULL;
+}
+
+// Checks if symbol exists in the table
+int symbolExists(char* name) {
+  return findSymbol(name) != NULL;
 }
 
 // Checks if current token type is the expected type
@@ -109,7 +145,7 @@ void matchLexeme(TokenType tokType, char *expected) {
 
 // Checks if the token ahead is of expected type
 int lookaheadToken(TokenType expected) {
-  if (currentTok->next == NULL) return 0;  
+  if (currentTok->next == NULL) return 0;
   return currentTok->next->tok->type == expected;
 }
 
@@ -120,77 +156,509 @@ int lookaheadLexeme(TokenType tokType, char *expected) {
          (strcmp(currentTok->next->tok->lexeme, expected) == 0);
 }
 
+// Operators found by scanOperators()
+#define SCAN_RELATION 1
+#define SCAN_OR 2
+#define SCAN_ADDITION 4
+#define SCAN_AND 8
+#define SCAN_MULTIPLICATION 16
+
+// Checks if a token is a relational operator
+int isRelation(Token *tok) {
+  return (tok->type == OPERATOR && (strcmp(tok->lexeme, "=") == 0 ||
+                                    strcmp(tok->lexeme, "<") == 0 ||
+                                    strcmp(tok->lexeme, ">") == 0)) ||
+         (tok->type == COMPOUND_OPERATOR && (strcmp(tok->lexeme, "<>") == 0 ||
+                                             strcmp(tok->lexeme, "<=") == 0 ||
+                                             strcmp(tok->lexeme, ">=") == 0));
+}
+
+// Scans the rest of the expression from the current token, without moving,
+// and returns the operators found outside parentheses. When termOnly is set
+// the scan stops at the end of the current term.
+int scanOperators(int termOnly) {
+  int found = 0, depth = 0;
+
+  for (Node *node = currentTok; node != NULL; node = node->next) {
+    Token *tok = node->tok;
+    int operator = 0;
+
+    // array indexes are skipped like parentheses
+    if (tok->type == DELIMITER && (strcmp(tok->lexeme, "(") == 0 ||
+                                   strcmp(tok->lexeme, "[") == 0)) {
+      depth++;
+      continue;
+    }
+    if (tok->type == DELIMITER && (strcmp(tok->lexeme, ")") == 0 ||
+                                   strcmp(tok->lexeme, "]") == 0)) {
+      if (depth-- == 0) break;
+      continue;
+    }
+    if (depth > 0) {
+      if (tok->type == END_OF_FILE) break;
+      continue;
+    }
+
+    if (isRelation(tok)) operator = SCAN_RELATION;
+    else if (tok->type == KEYWORD && strcmp(tok->lexeme, "or") == 0) operator = SCAN_OR;
+    else if (tok->type == OPERATOR && (strcmp(tok->lexeme, "+") == 0 ||
+                                       strcmp(tok->lexeme, "-") == 0))
+      operator = SCAN_ADDITION;
+    else if (tok->type == KEYWORD && strcmp(tok->lexeme, "and") == 0) operator = SCAN_AND;
+    else if ((tok->type == OPERATOR && (strcmp(tok->lexeme, "*") == 0 ||
+                                        strcmp(tok->lexeme, "/") == 0)) ||
+             (tok->type == KEYWORD && strcmp(tok->lexeme, "div") == 0))
+      operator = SCAN_MULTIPLICATION;
+    else if (tok->type != IDENTIFIER && tok->type != NUMBER &&
+             !(tok->type == KEYWORD && strcmp(tok->lexeme, "not") == 0))
+      break;
+
+    if (termOnly && (operator & (SCAN_RELATION | SCAN_OR | SCAN_ADDITION))) break;
+    found |= operator;
+  }
+  return found;
+}
+
+// Finds the symbol named by the current token, which must be declared
+SymbolNode *currentSymbol() {
+  SymbolNode *symbol = findSymbol(currentTok->tok->lexeme);
+  if (symbol == NULL)
+    handleError(IDENTIFIER, currentTok->tok->lexeme, UNDECLARED_SYMBOL);
+  return symbol;
+}
+
+// Finds the label named by the current token. Labels used without a
+// 'label' declaration are declared in the current block.
+SymbolNode *currentLabel() {
+  SymbolNode *label = findSymbol(currentTok->tok->lexeme);
+  if (label == NULL) {
+    label = addSymbol(currentTok->tok->lexeme);
+    label->category = LABEL;
+    label->level = currentLevel;
+    newLabel(label->label);
+  }
+  if (label->category != LABEL)
+    handleError(NUMBER, "", INVALID_STATEMENT);
+  return label;
+}
+
+// Constant helpers
+
+Constant intConstant(long value) {
+  Constant c = {0, value, 0.0};
+  return c;
+}
+
+Constant realConstant(double value) {
+  Constant c = {1, 0, value};
+  return c;
+}
+
+double realValue(Constant c) {
+  return c.isReal ? c.realValue : (double)c.intValue;
+}
+
+int sameConstant(Constant a, Constant b) {
+  if (a.isReal != b.isReal) return 0;
+  if (a.isReal) return a.realValue == b.realValue;
+  return a.intValue == b.intValue;
+}
+
+ExprResult constantResult(Constant c, DataType type) {
+  ExprResult result = {1, c, type};
+  return result;
+}
+
+ExprResult valueResult(DataType type) {
+  ExprResult result = {0, {0, 0, 0.0}, type};
+  return result;
+}
+
+// Types
+
+// Rejects the program unless the types of an operation agree
+void checkTypes(int valid) {
+  if (!valid) handleError(UNKNOWN, "", TYPE_MISMATCH);
+}
+
+int isNumeric(DataType type) {
+  return type == INTEGER_TYPE || type == REAL_TYPE;
+}
+
+// Converts an integer operand to real where needed. The code of the
+// operand ends at mark, where the conversion goes.
+ExprResult convertResult(ExprResult result, DataType type, int mark) {
+  if (result.type != INTEGER_TYPE || type != REAL_TYPE) return result;
+  if (result.isConstant) result.value = realConstant(result.value.intValue);
+  else insertCode(mark, "ITOF");
+  result.type = REAL_TYPE;
+  return result;
+}
+
+// Converts a value that is about to be stored in a symbol of the given type
+ExprResult assignableResult(ExprResult result, DataType type) {
+  checkTypes(result.type == type || (result.type == INTEGER_TYPE && type == REAL_TYPE));
+  return convertResult(result, type, codeMark());
+}
+
+// Emits a pending constant, leaving the expression value on the stack
+void emitConstant(ExprResult result) {
+  char operand[64];
+  if (!result.isConstant) return;
+  formatConstant(result.value, operand);
+  addCodef("CRCT %s", operand);
+}
+
+// Constant folding
+
+// Folds a binary operation over two constants following Pascal semantics:
+// 'div' truncates integers, '/' always gives a real, and/or work on booleans.
+// Returns 0 when the operation must be left for runtime.
+int foldBinary(char *op, Constant a, Constant b, Constant *result) {
+  int isReal = a.isReal || b.isReal;
+  double x = realValue(a), y = realValue(b);
+  long value;
+
+  if (strcmp(op, "+") == 0 || strcmp(op, "-") == 0 || strcmp(op, "*") == 0) {
+    if (isReal) {
+      if (op[0] == '+') *result = realConstant(x + y);
+      else if (op[0] == '-') *result = realConstant(x - y);
+      else *result = realConstant(x * y);
+      return isfinite(result->realValue);
+    }
+    if (op[0] == '+' && __builtin_add_overflow(a.intValue, b.intValue, &value)) return 0;
+    if (op[0] == '-' && __builtin_sub_overflow(a.intValue, b.intValue, &value)) return 0;
+    if (op[0] == '*' && __builtin_mul_overflow(a.intValue, b.intValue, &value)) return 0;
+    *result = intConstant(value);
+    return 1;
+  }
+  if (strcmp(op, "/") == 0) {
+    if (y == 0.0) return 0;
+    *result = realConstant(x / y);
+    return isfinite(result->realValue);
+  }
+  if (strcmp(op, "div") == 0) {
+    if (isReal || b.intValue == 0) return 0;
+    if (a.intValue == LONG_MIN && b.intValue == -1) return 0;
+    *result = intConstant(a.intValue / b.intValue);
+    return 1;
+  }
+  if (strcmp(op, "and") == 0 || strcmp(op, "or") == 0) {
+    if (isReal) return 0;
+    if (op[0] == 'a') *result = intConstant(a.intValue && b.intValue);
+    else *result = intConstant(a.intValue || b.intValue);
+    return 1;
+  }
+
+  // relations
+  int cmp;
+  if (isReal) cmp = (x > y) - (x < y);
+  else cmp = (a.intValue > b.intValue) - (a.intValue < b.intValue);
+
+  if (strcmp(op, "=") == 0) *result = intConstant(cmp == 0);
+  else if (strcmp(op, "<>") == 0) *result = intConstant(cmp != 0);
+  else if (strcmp(op, "<") == 0) *result = intConstant(cmp < 0);
+  else if (strcmp(op, "<=") == 0) *result = intConstant(cmp <= 0);
+  else if (strcmp(op, ">=") == 0) *result = intConstant(cmp >= 0);
+  else if (strcmp(op, ">") == 0) *result = intConstant(cmp > 0);
+  else return 0;
+  return 1;
+}
+
+// Returns the MEPA instruction of a binary operator over integers or
+// booleans, or over reals when isReal is set
+char *binaryInstruction(char *op, int isReal) {
+  char *ops[] = {
+    "+", "-", "*", "/", "div", "and", "or",
+    "=", "<>", "<", "<=", ">=", ">"
+  };
+  char *instructions[] = {
+    "SOMA", "SUBT", "MULT", "DIVF", "DIVI", "CONJ", "DISJ",
+    "CMIG", "CMDG", "CMME", "CMEG", "CMAG", "CMMA"
+  };
+  char *realInstructions[] = {"SOMF", "SUBF", "MULF", "DIVF"};
+
+  for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(ops[i], op) != 0) continue;
+    return isReal && i < 4 ? realInstructions[i] : instructions[i];
+  }
+  return "NADA";
+}
+
+int isRelationOperator(char *op) {
+  return strcmp(op, "=") == 0 || strcmp(op, "<>") == 0 || strcmp(op, "<") == 0 ||
+         strcmp(op, "<=") == 0 || strcmp(op, ">=") == 0 || strcmp(op, ">") == 0;
+}
+
+// Combines two operands with a binary operator, folding them when both are
+// constants. The code of the right operand starts at mark, so a constant
+// left operand is emitted there if the operation can't be folded. Integer
+// operands are converted when the other one or the operator is real.
+ExprResult binaryOperation(ExprResult left, char *op, int mark,
+                           ExprResult right) {
+  DataType operandType, resultType;
+  Constant folded;
+  char operand[64], instruction[BUFFER_SIZE];
+
+  if (strcmp(op, "and") == 0 || strcmp(op, "or") == 0) {
+    checkTypes(left.type == BOOLEAN_TYPE && right.type == BOOLEAN_TYPE);
+    operandType = resultType = BOOLEAN_TYPE;
+  } else if (strcmp(op, "div") == 0) {
+    checkTypes(left.type == INTEGER_TYPE && right.type == INTEGER_TYPE);
+    operandType = resultType = INTEGER_TYPE;
+  } else if (isRelationOperator(op) && left.type == BOOLEAN_TYPE) {
+    checkTypes(right.type == BOOLEAN_TYPE);
+    operandType = resultType = BOOLEAN_TYPE;
+  } else {
+    checkTypes(isNumeric(left.type) && isNumeric(right.type));
+    if (strcmp(op, "/") == 0 || left.type == REAL_TYPE || right.type == REAL_TYPE)
+      operandType = REAL_TYPE;
+    else
+      operandType = INTEGER_TYPE;
+    resultType = isRelationOperator(op) ? BOOLEAN_TYPE : operandType;
+  }
+  left = convertResult(left, operandType, mark);
+  right = convertResult(right, operandType, codeMark());
+
+  if (left.isConstant && right.isConstant && passEnabled("constfold") &&
+      foldBinary(op, left.value, right.value, &folded))
+    return constantResult(folded, resultType);
+
+  if (left.isConstant) {
+    formatConstant(left.value, operand);
+    sprintf(instruction, "CRCT %s", operand);
+    insertCode(mark, instruction);
+  }
+  emitConstant(right);
+  if (operandType == REAL_TYPE && isRelationOperator(op)) {
+    // reals are compared to each other as -1, 0 or 1
+    addCode("CMPF");
+    addCode("CRCT 0");
+    addCode(binaryInstruction(op, 0));
+  } else {
+    addCode(binaryInstruction(op, operandType == REAL_TYPE));
+  }
+  return valueResult(resultType);
+}
+
+// Constant propagation
+
+// Forgets the known values of all symbols
+void clearConstants() {
+  for (SymbolNode *s = symbolTable; s != NULL; s = s->next) s->isConstant = 0;
+}
+
+// Forgets the known values of symbols from enclosing blocks, which a store
+// through a var parameter may have changed
+void clearNonLocalConstants() {
+  for (SymbolNode *s = symbolTable; s != NULL; s = s->next)
+    if (s->level < currentLevel) s->isConstant = 0;
+}
+
+// Saves the known values of the symbols in scope
+ConstState *saveConstants() {
+  ConstState *state = (ConstState*)calloc(1, sizeof(ConstState));
+  int size = 0;
+
+  for (SymbolNode *s = symbolTable; s != NULL; s = s->next)
+    if (s->isConstant) size++;
+  state->symbols = (SymbolNode**)malloc((size + 1) * sizeof(SymbolNode*));
+  state->values = (Constant*)malloc((size + 1) * sizeof(Constant));
+
+  for (SymbolNode *s = symbolTable; s != NULL; s = s->next) {
+    if (!s->isConstant) continue;
+    state->symbols[state->count] = s;
+    state->values[state->count] = s->value;
+    state->count++;
+  }
+  return state;
+}
+
+// Restores the known values saved in the state
+void restoreConstants(ConstState *state) {
+  clearConstants();
+  for (int i = 0; i < state->count; i++) {
+    state->symbols[i]->isConstant = 1;
+    state->symbols[i]->value = state->values[i];
+  }
+}
+
+// Keeps only the known values shared with the state (join of two paths)
+void mergeConstants(ConstState *state) {
+  for (SymbolNode *s = symbolTable; s != NULL; s = s->next) {
+    if (!s->isConstant) continue;
+    int found = 0;
+    for (int i = 0; i < state->count && !found; i++)
+      found = state->symbols[i] == s && sameConstant(state->values[i], s->value);
+    s->isConstant = found;
+  }
+}
+
+void freeConstants(ConstState *state) {
+  free(state->symbols);
+  free(state->values);
+  free(state);
+}
+
+// Code generation helpers
+
+// Emits the code that loads the value of a variable or parameter
+void emitLoad(SymbolNode *symbol) {
+  if (symbol->isReference) addCodef("CRVI %d %d", symbol->level, symbol->offset);
+  else addCodef("CRVL %d %d", symbol->level, symbol->offset);
+}
+
+// Emits the code that stores the stack top into a variable, parameter or
+// function result
+void emitStore(SymbolNode *symbol) {
+  if (symbol->isReference) addCodef("ARMI %d %d", symbol->level, symbol->offset);
+  else addCodef("ARMZ %d %d", symbol->level, symbol->offset);
+}
+
+// Emits the CRVX or ARMX that reaches the element of the array whose index
+// is on the stack
+void emitElement(char *instruction, SymbolNode *array) {
+  addCodef("%s %d %d %d %d", instruction, array->level, array->offset, array->low,
+           array->high);
+}
+
 // Parser functions
 void program();
 void block();
 void labelDeclaration();
 void varDeclaration();
 void identifierList(int isDeclaration);
-void identifier(int isDeclaration);
-void type();
+SymbolNode *identifier(int isDeclaration);
+DataType type();
+void arrayBounds(int *low, int *high);
+int arrayBound();
+void arrayIndex(SymbolNode *array);
 void subroutines();
 void procedure();
 void function();
-void params();
+void params(SymbolNode *routine);
+void routineBody(SymbolNode *routine);
 void statementList();
 void statement();
+void statementBody();
 void assignment();
 void subroutineCall();
+void arguments(SymbolNode *routine);
 void deviation();
 void ifStatement();
 void whileStatement();
 void writeStatement();
 void readStatement();
 void expressionList();
-void expression();
+void condition(char *label, int jumpOn);
+void conditionSimpleExpression(char *label, int jumpOn);
+void conditionTerm(char *label, int jumpOn);
+void conditionFactor(char *label, int jumpOn);
+ExprResult expression();
 void relation();
-void simpleExpression();
-void term();
-void factor();
+ExprResult simpleExpression();
+ExprResult term();
+ExprResult factor();
+
+// Gives the code generated from now on the position of the current token,
+// which records the column of its last character.
+void markPosition() {
+  codeLine = currentTok->tok->line;
+  codeColumn = currentTok->tok->column - (int)strlen(currentTok->tok->lexeme) + 1;
+}
 
 void program() {
+  markPosition();
   matchLexeme(KEYWORD, "program");
-  identifier(1);
+  SymbolNode *name = identifier(1);
+  name->category = PROGRAM_NAME;
+  nameRoutine("", name->name);
   if (checkLexeme(DELIMITER, "(")) {
     matchLexeme(DELIMITER, "(");
     identifierList(0);
-    matchLexeme(DELIMITER, ")");    
+    matchLexeme(DELIMITER, ")");
   }
   matchLexeme(DELIMITER, ";");
+  addCode("INPP");
   block();
   matchLexeme(DELIMITER, ".");
+  addCode("PARA");
 }
 
 void block() {
+  char bodyLabel[LABEL_SIZE];
+  int enclosingLocals = localCount;
+
+  localCount = 0;
   if (checkLexeme(KEYWORD, "label")) labelDeclaration();
   if (checkLexeme(KEYWORD, "var")) varDeclaration();
   if (checkLexeme(KEYWORD, "procedure") ||
-      checkLexeme(KEYWORD, "function")) subroutines();
+      checkLexeme(KEYWORD, "function")) {
+    newLabel(bodyLabel);
+    addCodef("DSVS %s", bodyLabel);
+    subroutines();
+    addCodef("%s: NADA", bodyLabel);
+  }
+  clearConstants();
   statementList();
+  if (localCount > 0) {
+    addCodef("DMEM %d", localCount);
+    markFrameLocals();
+  }
+  localCount = enclosingLocals;
 }
 
 void labelDeclaration() {
   matchLexeme(KEYWORD, "label");
-  matchToken(NUMBER);
-  while (checkLexeme(DELIMITER, ",")) {
-    matchLexeme(DELIMITER, ",");
+  do {
+    if (checkLexeme(DELIMITER, ",")) matchLexeme(DELIMITER, ",");
+    if (checkToken(NUMBER)) {
+      SymbolNode *label = addSymbol(currentTok->tok->lexeme);
+      label->category = LABEL;
+      label->level = currentLevel;
+      newLabel(label->label);
+    }
     matchToken(NUMBER);
-  }
+  } while (checkLexeme(DELIMITER, ","));
   matchLexeme(DELIMITER, ";");
 }
 
 void varDeclaration() {
   matchLexeme(KEYWORD, "var");
-  identifierList(1);
-  matchLexeme(DELIMITER, ":");
-  type();
-  matchLexeme(DELIMITER, ";");
-  while (checkToken(IDENTIFIER)) {
+  do {
+    SymbolNode *mark = symbolTable;
+    int count = 0, isArray = 0, low = 0, high = 0;
+
     identifierList(1);
+    for (SymbolNode *s = symbolTable; s != mark; s = s->next) {
+      s->category = VARIABLE;
+      s->level = currentLevel;
+      count++;
+    }
+
     matchLexeme(DELIMITER, ":");
-    type();
+    if (checkLexeme(KEYWORD, "array")) {
+      isArray = 1;
+      arrayBounds(&low, &high);
+    }
+    DataType dataType = type();
+    // each variable takes the cells of its elements, one for other types
+    long size = high - low + 1;
+    if (localCount + size * count > INT_MAX / 2)
+      handleError(IDENTIFIER, "", INVALID_TYPE);
+    // the table holds the list in reverse order
+    for (SymbolNode *s = symbolTable; s != mark; s = s->next) {
+      s->type = dataType;
+      s->isArray = isArray;
+      s->low = low;
+      s->high = high;
+      s->offset = localCount + --count * size;
+    }
+    for (SymbolNode *s = symbolTable; s != mark; s = s->next) localCount += size;
     matchLexeme(DELIMITER, ";");
-  }
+  } while (checkToken(IDENTIFIER));
+  addCodef("AMEM %d", localCount);
+  markFrameLocals();
 }
 
 void identifierList(int isDeclaration) {
@@ -201,25 +669,75 @@ void identifierList(int isDeclaration) {
   }
 }
 
-void identifier(int isDeclaration) {
-  if (isDeclaration) addSymbol(currentTok->tok->lexeme);
-  else if (!symbolExists(currentTok->tok->lexeme))
-    handleError(IDENTIFIER, currentTok->tok->lexeme, UNDECLARED_SYMBOL);
+SymbolNode *identifier(int isDeclaration) {
+  SymbolNode *symbol;
+  if (isDeclaration) symbol = addSymbol(currentTok->tok->lexeme);
+  else symbol = currentSymbol();
   matchToken(IDENTIFIER);
+  return symbol;
 }
 
-void type() {
+DataType type() {
+  DataType dataType = NO_TYPE;
   if (!checkToken(IDENTIFIER)) {
     handleError(IDENTIFIER, "", UNEXPECTED_TYPE);
   }
 
-  if (checkLexeme(IDENTIFIER, "integer") ||
-      checkLexeme(IDENTIFIER, "real") ||
-      checkLexeme(IDENTIFIER, "boolean")) {
-    identifier(0);
+  if (checkLexeme(IDENTIFIER, "integer")) dataType = INTEGER_TYPE;
+  else if (checkLexeme(IDENTIFIER, "real")) dataType = REAL_TYPE;
+  else if (checkLexeme(IDENTIFIER, "boolean")) dataType = BOOLEAN_TYPE;
+  else handleError(IDENTIFIER, "", INVALID_TYPE);
+  identifier(0);
+  return dataType;
+}
+
+// Parses the "array [low..high] of" before the type of the elements of an
+// array
+void arrayBounds(int *low, int *high) {
+  matchLexeme(KEYWORD, "array");
+  matchLexeme(DELIMITER, "[");
+  *low = arrayBound();
+  matchLexeme(COMPOUND_OPERATOR, "..");
+  *high = arrayBound();
+  if (*high < *low) handleError(IDENTIFIER, "", INVALID_TYPE);
+  matchLexeme(DELIMITER, "]");
+  matchLexeme(KEYWORD, "of");
+}
+
+// Parses a bound of an array, an integer that may be signed
+int arrayBound() {
+  int negative = 0;
+  long value;
+
+  if (checkLexeme(OPERATOR, "+") || checkLexeme(OPERATOR, "-")) {
+    negative = checkLexeme(OPERATOR, "-");
+    matchToken(OPERATOR);
+  }
+  if (!checkToken(NUMBER) || strchr(currentTok->tok->lexeme, '.') != NULL)
+    handleError(NUMBER, "", INVALID_TYPE);
+  // bounds and offsets have to fit the operands of the instructions
+  value = strtol(currentTok->tok->lexeme, NULL, 10);
+  if (value > INT_MAX / 2) handleError(NUMBER, "", INVALID_TYPE);
+  matchToken(NUMBER);
+  return negative ? -value : value;
+}
+
+// Compiles the index of an element of the array, leaving it on the stack.
+// Constant indexes are checked here and the others when the program runs.
+void arrayIndex(SymbolNode *array) {
+  ExprResult index;
+
+  matchLexeme(DELIMITER, "[");
+  index = expression();
+  checkTypes(index.type == INTEGER_TYPE);
+  if (index.isConstant) {
+    if (index.value.intValue < array->low || index.value.intValue > array->high)
+      handleError(UNKNOWN, "", INVALID_INDEX);
+    emitConstant(index);
   } else {
-    handleError(IDENTIFIER, "", INVALID_TYPE);
+    addCodef("VERI %d %d", array->low, array->high);
   }
+  matchLexeme(DELIMITER, "]");
 }
 
 void subroutines() {
@@ -232,39 +750,100 @@ void subroutines() {
 }
 
 void procedure() {
+  int line = codeLine, column = codeColumn;
+
+  markPosition();
   matchLexeme(KEYWORD, "procedure");
-  identifier(1);
+  SymbolNode *routine = identifier(1);
+  SymbolNode *scope = symbolTable;
+
+  routine->category = PROCEDURE;
+  routine->level = ++currentLevel;
+  newLabel(routine->label);
   if (checkLexeme(DELIMITER, "("))
-    params();
+    params(routine);
   matchLexeme(DELIMITER, ";");
-  block();
+  routineBody(routine);
+
+  symbolTable = scope;
+  currentLevel--;
+  codeLine = line;
+  codeColumn = column;
 }
 
 void function() {
+  int line = codeLine, column = codeColumn;
+
+  markPosition();
   matchLexeme(KEYWORD, "function");
-  identifier(1);
+  SymbolNode *routine = identifier(1);
+  SymbolNode *scope = symbolTable;
+
+  routine->category = FUNCTION;
+  routine->level = ++currentLevel;
+  newLabel(routine->label);
   if (checkLexeme(DELIMITER, "("))
-    params();
+    params(routine);
+  // the caller reserves the result right below the parameters
+  routine->offset = -(routine->paramCount + 4);
   matchLexeme(DELIMITER, ":");
-  identifier(0);
+  routine->type = type();
   matchLexeme(DELIMITER, ";");
-  block();  
+  routineBody(routine);
+
+  symbolTable = scope;
+  currentLevel--;
+  codeLine = line;
+  codeColumn = column;
 }
 
-void params() {
+void params(SymbolNode *routine) {
+  SymbolNode *mark = symbolTable;
+  int count = 0;
+
   matchLexeme(DELIMITER, "(");
-  if (checkLexeme(KEYWORD, "var")) matchLexeme(KEYWORD, "var");
-  identifierList(1);
-  matchLexeme(DELIMITER, ":");
-  identifier(0);
-  while (checkLexeme(DELIMITER, ";")) {
-    matchLexeme(DELIMITER, ";");
-    if (checkLexeme(KEYWORD, "var")) matchLexeme(KEYWORD, "var");
+  do {
+    SymbolNode *group = symbolTable;
+    int isReference = 0;
+
+    if (checkLexeme(DELIMITER, ";")) matchLexeme(DELIMITER, ";");
+    if (checkLexeme(KEYWORD, "var")) {
+      matchLexeme(KEYWORD, "var");
+      isReference = 1;
+    }
     identifierList(1);
+    for (SymbolNode *s = symbolTable; s != group; s = s->next) {
+      s->category = PARAMETER;
+      s->level = currentLevel;
+      s->isReference = isReference;
+    }
     matchLexeme(DELIMITER, ":");
-    identifier(0);
-  }
+    DataType dataType = type();
+    for (SymbolNode *s = symbolTable; s != group; s = s->next) s->type = dataType;
+  } while (checkLexeme(DELIMITER, ";"));
   matchLexeme(DELIMITER, ")");
+
+  // parameters sit below the return address, caller level and saved display
+  for (SymbolNode *s = symbolTable; s != mark; s = s->next) count++;
+  routine->paramCount = count;
+  routine->params = (SymbolNode**)malloc(count * sizeof(SymbolNode*));
+  for (SymbolNode *s = symbolTable; s != mark; s = s->next) {
+    count--;
+    s->offset = -(routine->paramCount + 3) + count;
+    routine->params[count] = s;
+  }
+}
+
+// Compiles the block of a procedure or function whose parameters are in scope
+void routineBody(SymbolNode *routine) {
+  SymbolNode *enclosingRoutine = currentRoutine;
+
+  currentRoutine = routine;
+  nameRoutine(routine->label, routine->name);
+  addCodef("%s: ENPR %d", routine->label, currentLevel);
+  block();
+  addCodef("RTPR %d %d", currentLevel, routine->paramCount);
+  currentRoutine = enclosingRoutine;
 }
 
 void statementList() {
@@ -277,16 +856,37 @@ void statementList() {
   matchLexeme(KEYWORD, "end");
 }
 
+// Compiles a statement, giving the code generated for it its position
 void statement() {
+  int line = codeLine, column = codeColumn;
+
+  markPosition();
+  statementBody();
+  codeLine = line;
+  codeColumn = column;
+}
+
+void statementBody() {
   if (checkToken(NUMBER)) {
+    SymbolNode *label = currentLabel();
+    if (label->level != currentLevel)
+      handleError(NUMBER, "", INVALID_STATEMENT);
     matchToken(NUMBER);
     matchLexeme(DELIMITER, ":");
-  } 
+
+    // gotos from nested routines must also discard their frames
+    if (label->isNonLocal)
+      addCodef("%s: ENRT %d %d", label->label, currentLevel, localCount);
+    else
+      addCodef("%s: NADA", label->label);
+    clearConstants();
+  }
 
   if (checkToken(IDENTIFIER)) {
-    if (lookaheadLexeme(COMPOUND_OPERATOR, ":=")) assignment();
+    if (lookaheadLexeme(COMPOUND_OPERATOR, ":=") || lookaheadLexeme(DELIMITER, "["))
+      assignment();
     else subroutineCall();
-  } 
+  }
   else if (checkLexeme(KEYWORD, "if")) ifStatement();
   else if (checkLexeme(KEYWORD, "while")) whileStatement();
   else if (checkLexeme(KEYWORD, "write")) writeStatement();
@@ -295,83 +895,295 @@ void statement() {
   else if (checkLexeme(KEYWORD, "readln")) readStatement();
   else if (checkLexeme(KEYWORD, "begin")) statementList();
   else if (checkLexeme(KEYWORD, "goto")) deviation();
-  else if (checkLexeme(KEYWORD, "end")) return; 
+  else if (checkLexeme(KEYWORD, "end")) return;
   else {
     handleError(KEYWORD, "", INVALID_STATEMENT);
   }
 }
 
 void assignment() {
-  identifier(0);
+  SymbolNode *target = currentSymbol();
+  ExprResult value;
+
+  if (!(target->category == VARIABLE || target->category == PARAMETER ||
+        (target->category == FUNCTION && target == currentRoutine)))
+    handleError(IDENTIFIER, "", INVALID_ASSIGNMENT);
+  matchToken(IDENTIFIER);
+  if (target->isArray) arrayIndex(target);
   matchLexeme(COMPOUND_OPERATOR, ":=");
-  expression();
-} 
+  value = assignableResult(expression(), target->type);
+  emitConstant(value);
+  if (target->isArray) emitElement("ARMX", target);
+  else emitStore(target);
+
+  if (target->isReference) {
+    clearNonLocalConstants();
+  } else if (target->category != FUNCTION && !target->isArray && passEnabled("constfold")) {
+    target->isConstant = value.isConstant;
+    target->value = value.value;
+  }
+}
 
 void subroutineCall() {
-  identifier(0);
+  SymbolNode *routine = currentSymbol();
+  if (routine->category != PROCEDURE)
+    handleError(IDENTIFIER, "", INVALID_CALL);
+  matchToken(IDENTIFIER);
+  arguments(routine);
+}
+
+// Compiles the arguments of a call and the call itself
+void arguments(SymbolNode *routine) {
+  int count = 0;
+
   if (checkLexeme(DELIMITER, "(")) {
     matchLexeme(DELIMITER, "(");
-    expressionList();
+    do {
+      if (count > 0) matchLexeme(DELIMITER, ",");
+      if (count >= routine->paramCount)
+        handleError(DELIMITER, "", INVALID_ARGUMENT);
+
+      if (routine->params[count]->isReference) {
+        // var arguments pass the address of a variable
+        SymbolNode *arg;
+        if (!checkToken(IDENTIFIER))
+          handleError(IDENTIFIER, "", INVALID_ARGUMENT);
+        arg = currentSymbol();
+        if ((arg->category != VARIABLE && arg->category != PARAMETER) || arg->isArray)
+          handleError(IDENTIFIER, "", INVALID_ARGUMENT);
+        // the routine stores into the variable, so no conversion is possible
+        checkTypes(arg->type == routine->params[count]->type);
+        if (arg->isReference) addCodef("CRVL %d %d", arg->level, arg->offset);
+        else addCodef("CREN %d %d", arg->level, arg->offset);
+        matchToken(IDENTIFIER);
+      } else {
+        emitConstant(assignableResult(expression(), routine->params[count]->type));
+      }
+      count++;
+    } while (checkLexeme(DELIMITER, ","));
     matchLexeme(DELIMITER, ")");
   }
+  if (count != routine->paramCount)
+    handleError(DELIMITER, "", INVALID_ARGUMENT);
+
+  addCodef("CHPR %s %d", routine->label, currentLevel);
+  // the routine may change any variable it can see
+  clearConstants();
 }
 
 void deviation() {
   matchLexeme(KEYWORD, "goto");
+  SymbolNode *label = currentLabel();
   matchToken(NUMBER);
+
+  if (label->level == currentLevel) {
+    addCodef("DSVS %s", label->label);
+  } else {
+    label->isNonLocal = 1;
+    addCodef("DSVR %s %d %d", label->label, label->level, currentLevel);
+  }
 }
 
 void ifStatement() {
+  char elseLabel[LABEL_SIZE], endLabel[LABEL_SIZE];
+  ConstState *before, *afterThen;
+
   matchLexeme(KEYWORD, "if");
-  expression();
+  newLabel(elseLabel);
+  condition(elseLabel, 0);
   matchLexeme(KEYWORD, "then");
+
+  before = saveConstants();
   statement();
   if (checkLexeme(KEYWORD, "else")) {
+    newLabel(endLabel);
+    addCodef("DSVS %s", endLabel);
+    addCodef("%s: NADA", elseLabel);
+
+    afterThen = saveConstants();
+    restoreConstants(before);
     matchLexeme(KEYWORD, "else");
     statement();
+    mergeConstants(afterThen);
+    freeConstants(afterThen);
+    addCodef("%s: NADA", endLabel);
+  } else {
+    addCodef("%s: NADA", elseLabel);
+    mergeConstants(before);
   }
+  freeConstants(before);
 }
 
 void whileStatement() {
+  char loopLabel[LABEL_SIZE], endLabel[LABEL_SIZE];
+
+  newLabel(loopLabel);
+  newLabel(endLabel);
+  // the body may run any number of times
+  clearConstants();
+  addCodef("%s: NADA", loopLabel);
+
   matchLexeme(KEYWORD, "while");
-  expression();
+  condition(endLabel, 0);
   matchLexeme(KEYWORD, "do");
   statement();
+  addCodef("DSVS %s", loopLabel);
+  addCodef("%s: NADA", endLabel);
+  clearConstants();
+}
+
+// Prints a value with the instruction of its type
+void writeValue(ExprResult value) {
+  emitConstant(value);
+  addCode(value.type == REAL_TYPE ? "IMPF" : "IMPR");
 }
 
 void writeStatement() {
   matchToken(KEYWORD);
   matchLexeme(DELIMITER, "(");
-  expressionList();
+  writeValue(expression());
+  while (checkLexeme(DELIMITER, ",")) {
+    matchLexeme(DELIMITER, ",");
+    writeValue(expression());
+  }
   matchLexeme(DELIMITER, ")");
 }
 
 void readStatement() {
   matchToken(KEYWORD);
   matchLexeme(DELIMITER, "(");
-  identifierList(0);
+  do {
+    if (checkLexeme(DELIMITER, ",")) matchLexeme(DELIMITER, ",");
+    SymbolNode *target = currentSymbol();
+    if (target->category != VARIABLE && target->category != PARAMETER)
+      handleError(IDENTIFIER, "", INVALID_ASSIGNMENT);
+    matchToken(IDENTIFIER);
+    if (target->isArray) arrayIndex(target);
+    addCode(target->type == REAL_TYPE ? "LEIF" : "LEIT");
+    if (target->isArray) emitElement("ARMX", target);
+    else emitStore(target);
+    target->isConstant = 0;
+    if (target->isReference) clearNonLocalConstants();
+  } while (checkLexeme(DELIMITER, ","));
   matchLexeme(DELIMITER, ")");
 }
 
 void expressionList() {
-  expression();
+  emitConstant(expression());
   while (checkLexeme(DELIMITER, ",")) {
     matchLexeme(DELIMITER, ",");
-    expression();
+    emitConstant(expression());
+  }
+}
+
+// Conditions
+
+// Returns the relational operator with the opposite result
+char *invertedRelation(char *op) {
+  char *ops[] = {"=", "<>", "<", ">=", ">", "<="};
+  char *inverted[] = {"<>", "=", ">=", "<", "<=", ">"};
+
+  for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(ops[i], op) == 0) return inverted[i];
   }
+  return op;
 }
 
-void expression() {
-  simpleExpression();
+// Emits a jump to the label taken when the boolean value is jumpOn
+void jumpOnValue(ExprResult result, char *label, int jumpOn) {
+  checkTypes(result.type == BOOLEAN_TYPE);
+  if (jumpOn && result.isConstant && !result.value.isReal && passEnabled("constfold")) {
+    result.value.intValue = !result.value.intValue;
+    jumpOn = 0;
+  }
+  emitConstant(result);
+  if (jumpOn) addCode("NEGA");
+  addCodef("DSVF %s", label);
+}
+
+// Compiles the condition of an if or while statement into jumps: the code
+// goes to the label when the condition is jumpOn and falls through
+// otherwise. The operands of and/or are evaluated only as far as needed.
+void condition(char *label, int jumpOn) {
+  int operators = scanOperators(0);
+
+  if (operators & SCAN_RELATION) {
+    // a jump on true tests the opposite relation
+    ExprResult left = simpleExpression();
+    char *op = currentTok->tok->lexeme;
+    relation();
+    int mark = codeMark();
+    ExprResult right = simpleExpression();
+    jumpOnValue(binaryOperation(left, jumpOn ? invertedRelation(op) : op, mark, right),
+                label, 0);
+  } else if (operators & SCAN_ADDITION) {
+    jumpOnValue(expression(), label, jumpOn);
+  } else {
+    conditionSimpleExpression(label, jumpOn);
+  }
+}
+
+void conditionSimpleExpression(char *label, int jumpOn) {
+  char trueLabel[LABEL_SIZE];
+  int hasOr = 0;
+
+  // any true operand of or decides the condition
+  while (scanOperators(0) & SCAN_OR) {
+    if (!hasOr) newLabel(trueLabel);
+    hasOr = 1;
+    conditionTerm(jumpOn ? label : trueLabel, 1);
+    matchLexeme(KEYWORD, "or");
+  }
+  conditionTerm(label, jumpOn);
+  if (hasOr && !jumpOn) addCodef("%s: NADA", trueLabel);
+}
+
+void conditionTerm(char *label, int jumpOn) {
+  char falseLabel[LABEL_SIZE];
+  int operators = scanOperators(1), hasAnd = 0;
+
+  if (operators & SCAN_MULTIPLICATION) {
+    jumpOnValue(term(), label, jumpOn);
+    return;
+  }
+  // any false operand of and decides the condition
+  while (scanOperators(1) & SCAN_AND) {
+    if (!hasAnd) newLabel(falseLabel);
+    hasAnd = 1;
+    conditionFactor(jumpOn ? falseLabel : label, 0);
+    matchLexeme(KEYWORD, "and");
+  }
+  conditionFactor(label, jumpOn);
+  if (hasAnd && jumpOn) addCodef("%s: NADA", falseLabel);
+}
+
+void conditionFactor(char *label, int jumpOn) {
+  if (checkLexeme(KEYWORD, "not")) {
+    matchLexeme(KEYWORD, "not");
+    conditionFactor(label, !jumpOn);
+  } else if (checkLexeme(DELIMITER, "(")) {
+    matchLexeme(DELIMITER, "(");
+    condition(label, jumpOn);
+    matchLexeme(DELIMITER, ")");
+  } else {
+    jumpOnValue(factor(), label, jumpOn);
+  }
+}
+
+ExprResult expression() {
+  ExprResult result = simpleExpression();
   if (checkLexeme(OPERATOR, "=") ||
       checkLexeme(COMPOUND_OPERATOR, "<>") ||
       checkLexeme(OPERATOR, "<") ||
       checkLexeme(COMPOUND_OPERATOR, "<=") ||
       checkLexeme(COMPOUND_OPERATOR, ">=") ||
       checkLexeme(OPERATOR, ">")) {
+    char *op = currentTok->tok->lexeme;
     relation();
-    simpleExpression();
+    int mark = codeMark();
+    result = binaryOperation(result, op, mark, simpleExpression());
   }
+  return result;
 }
 
 void relation() {
@@ -385,46 +1197,107 @@ void relation() {
   }
 }
 
-void simpleExpression() {
+ExprResult simpleExpression() {
+  ExprResult result;
+  int negate = 0;
+
   if (checkLexeme(OPERATOR, "+") ||
       checkLexeme(OPERATOR, "-")) {
+    negate = checkLexeme(OPERATOR, "-");
     matchToken(OPERATOR);
   }
-  term();
+  result = term();
+  if (negate) {
+    checkTypes(isNumeric(result.type));
+    if (!result.isConstant) addCode(result.type == REAL_TYPE ? "INVF" : "INVR");
+    else if (result.value.isReal) result.value.realValue = -result.value.realValue;
+    else if (result.value.intValue != LONG_MIN) result.value.intValue = -result.value.intValue;
+    else {
+      emitConstant(result);
+      addCode("INVR");
+      result = valueResult(INTEGER_TYPE);
+    }
+  }
+
   while (checkLexeme(OPERATOR, "+") ||
          checkLexeme(OPERATOR, "-") ||
          checkLexeme(KEYWORD, "or")) {
+    char *op = currentTok->tok->lexeme;
     nextToken();
-    term();
+    int mark = codeMark();
+    result = binaryOperation(result, op, mark, term());
   }
+  return result;
 }
 
-void term() {
-  factor();
+ExprResult term() {
+  ExprResult result = factor();
   while (checkLexeme(OPERATOR, "*") ||
          checkLexeme(OPERATOR, "/") ||
          checkLexeme(KEYWORD, "div") ||
          checkLexeme(KEYWORD, "and")) {
+    char *op = currentTok->tok->lexeme;
     nextToken();
-    factor();
+    int mark = codeMark();
+    result = binaryOperation(result, op, mark, factor());
   }
+  return result;
 }
 
-void factor() {
+ExprResult factor() {
+  ExprResult result = valueResult(NO_TYPE);
+
   if (checkToken(IDENTIFIER)) {
-    if (lookaheadLexeme(DELIMITER, "(")) subroutineCall();
-    else identifier(0);
+    SymbolNode *symbol = currentSymbol();
+    if (symbol->category == FUNCTION) {
+      matchToken(IDENTIFIER);
+      addCode("AMEM 1");
+      arguments(symbol);
+      result.type = symbol->type;
+    } else if (symbol->category == VARIABLE || symbol->category == PARAMETER) {
+      matchToken(IDENTIFIER);
+      if (symbol->isArray) {
+        arrayIndex(symbol);
+        emitElement("CRVX", symbol);
+      } else if (symbol->isConstant) {
+        result = constantResult(symbol->value, symbol->type);
+      } else {
+        emitLoad(symbol);
+      }
+      result.type = symbol->type;
+    } else if (strcmp(symbol->name, "true") == 0 ||
+               strcmp(symbol->name, "false") == 0) {
+      result = constantResult(intConstant(symbol->name[0] == 't'), BOOLEAN_TYPE);
+      matchToken(IDENTIFIER);
+    } else {
+      handleError(UNKNOWN, "", INVALID_FACTOR);
+    }
   } else if (checkToken(NUMBER)) {
+    char *lexeme = currentTok->tok->lexeme;
+    if (strchr(lexeme, '.') != NULL)
+      result = constantResult(realConstant(strtod(lexeme, NULL)), REAL_TYPE);
+    else
+      result = constantResult(intConstant(strtol(lexeme, NULL, 10)), INTEGER_TYPE);
     matchToken(NUMBER);
   } else if (checkLexeme(DELIMITER, "(")) {
     matchLexeme(DELIMITER, "(");
-    expression();
+    result = expression();
     matchLexeme(DELIMITER, ")");
   } else if (checkLexeme(KEYWORD, "not")) {
-    factor();
+    matchLexeme(KEYWORD, "not");
+    result = factor();
+    checkTypes(result.type == BOOLEAN_TYPE);
+    if (result.isConstant && passEnabled("constfold")) {
+      result.value.intValue = !result.value.intValue;
+    } else {
+      emitConstant(result);
+      addCode("NEGA");
+      result = valueResult(BOOLEAN_TYPE);
+    }
   } else {
     handleError(UNKNOWN, "", INVALID_FACTOR);
   }
+  return result;
 }
 
 // Adds all pre-declared symbols to symbol table
@@ -439,8 +1312,23 @@ void addPreDeclaredSymbols() {
   addSymbol("false");
 }
 
+// Frees the symbols of the last compilation.
+void freeSymbols() {
+  while (allocatedSymbols != NULL) {
+    SymbolNode *symbol = allocatedSymbols;
+    allocatedSymbols = symbol->allocated;
+    free(symbol->params);
+    free(symbol);
+  }
+  symbolTable = NULL;
+  currentRoutine = NULL;
+  currentLevel = 0;
+  localCount = 0;
+}
+
 // Main parser function
 void parser(Node *tokenList) {
+  freeSymbols();
   currentTok = tokenList->next;
   addPreDeclaredSymbols();
   initCodeGenerator();
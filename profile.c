@@ -0,0 +1,294 @@
+#include "header/vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define REPORT_ROWS 10          // rows of each table of the report
+
+// A count and what it counts, to sort the tables of the report.
+typedef struct Ranked {
+  long value;
+  int index;
+} Ranked;
+
+// Reads the line table the compiler wrote for the program into the profile.
+// Returns 0 and prints the line if it doesn't fit the program.
+static int readLineTable(Profile *profile, Program *program, char *path) {
+  FILE *file = fopen(path, "r");
+  char line[BUFFER_SIZE], label[BUFFER_SIZE], name[BUFFER_SIZE];
+  int number = 0, index, source, column;
+
+  if (file == NULL) {
+    perror("Error opening line table");
+    return 0;
+  }
+  while (fgets(line, BUFFER_SIZE, file) != NULL) {
+    number++;
+    if (sscanf(line, "program %2047s", name) == 1) {
+      free(profile->names[0]);
+      profile->names[0] = strdup(name);
+    } else if (sscanf(line, "routine %2047s %2047s", label, name) == 2 &&
+               (index = findLabel(program, label)) != -1) {
+      free(profile->names[index]);
+      profile->names[index] = strdup(name);
+    } else if (sscanf(line, "%d %d %d", &index, &source, &column) == 3 &&
+               index >= 0 && index < program->count) {
+      profile->lines[index] = source;
+      profile->columns[index] = column;
+    } else {
+      fprintf(stderr, "Error: invalid line table entry at line %d\n", number);
+      fclose(file);
+      return 0;
+    }
+  }
+  fclose(file);
+  return 1;
+}
+
+// Sets up the counts of a profiled run of the loaded program: finds its
+// basic blocks and the routine each instruction belongs to, and reads the
+// source positions from the line table, if there is one. Returns NULL if
+// the line table can't be read.
+Profile *newProfile(VM *vm, Program *program, char *lineTablePath) {
+  Profile *profile = (Profile*)calloc(1, sizeof(Profile));
+  int size = vm->count + 1, *open = (int*)malloc(size * sizeof(int)), depth = 0;
+
+  profile->count = size;
+  profile->handlers = (void**)calloc(size, sizeof(void*));
+  profile->entered = (long*)calloc(size, sizeof(long));
+  profile->length = (int*)calloc(size, sizeof(int));
+  profile->lines = (int*)calloc(size, sizeof(int));
+  profile->columns = (int*)calloc(size, sizeof(int));
+  profile->routines = (int*)calloc(size, sizeof(int));
+  profile->names = (char**)calloc(size, sizeof(char*));
+
+  // blocks start at the program entry, at jump targets and after jumps
+  profile->length[0] = 1;
+  for (int i = 0; i < vm->count; i++) {
+    Code *code = &vm->code[i];
+    if (code->target != NULL) profile->length[code->target - vm->code] = 1;
+    if (code->target != NULL || code->op == OP_DSVS || code->op == OP_RTPR || code->op == OP_PARA)
+      profile->length[i + 1] = 1;
+  }
+  for (int i = vm->count, next = size; i >= 0; i--) {
+    if (profile->length[i] == 0) continue;
+    profile->length[i] = next - i;
+    next = i;
+  }
+
+  // a routine runs from its ENPR to its RTPR, around the routines nested in it
+  for (int i = 0; i < vm->count; i++) {
+    if (vm->code[i].op == OP_ENPR) open[depth++] = i;
+    profile->routines[i] = depth > 0 ? open[depth - 1] : 0;
+    if (vm->code[i].op == OP_RTPR && depth > 0) depth--;
+  }
+  free(open);
+  for (int i = 0; i < program->count; i++) {
+    if (vm->code[i].op == OP_ENPR && program->code[i].label[0] != '\0')
+      profile->names[i] = strdup(program->code[i].label);
+  }
+  profile->names[0] = strdup("program");
+  if (lineTablePath != NULL && !readLineTable(profile, program, lineTablePath)) {
+    freeProfile(profile);
+    return NULL;
+  }
+
+  profile->contextCapacity = 16;
+  profile->contexts = (Context*)malloc(profile->contextCapacity * sizeof(Context));
+  profile->contexts[0] = (Context){0, -1, -1, -1, 0};
+  profile->contextCount = 1;
+  profile->callCapacity = 16;
+  profile->calls = (ProfileCall*)malloc(profile->callCapacity * sizeof(ProfileCall));
+  return profile;
+}
+
+// Calls
+
+// Enters the routine from the running context, on a CHPR made with the
+// stack at sp.
+void enterContext(Profile *profile, int routine, long sp) {
+  int parent = profile->context, context = profile->contexts[parent].child;
+
+  while (context != -1 && profile->contexts[context].routine != routine)
+    context = profile->contexts[context].sibling;
+  if (context == -1) {
+    if (profile->contextCount == profile->contextCapacity) {
+      profile->contextCapacity *= 2;
+      profile->contexts = (Context*)realloc(profile->contexts,
+                                            profile->contextCapacity * sizeof(Context));
+    }
+    context = profile->contextCount++;
+    profile->contexts[context] = (Context){routine, parent, -1, profile->contexts[parent].child, 0};
+    profile->contexts[parent].child = context;
+  }
+  if (profile->callCount == profile->callCapacity) {
+    profile->callCapacity *= 2;
+    profile->calls = (ProfileCall*)realloc(profile->calls,
+                                           profile->callCapacity * sizeof(ProfileCall));
+  }
+  profile->calls[profile->callCount++] = (ProfileCall){parent, sp};
+  profile->context = context;
+}
+
+void leaveContext(Profile *profile) {
+  if (profile->callCount > 0) profile->context = profile->calls[--profile->callCount].context;
+}
+
+// Leaves the calls a goto out of nested routines discards, down to the
+// routine whose frame starts at base. Its CHPR was made with the stack at
+// base - 4, and the calls it made after that.
+void unwindContexts(Profile *profile, long base) {
+  while (profile->callCount > 0 && profile->calls[profile->callCount - 1].sp > base - 4)
+    leaveContext(profile);
+}
+
+// Reports
+
+static int compareRanked(const void *a, const void *b) {
+  long x = ((Ranked*)a)->value, y = ((Ranked*)b)->value;
+  return x < y ? 1 : x > y ? -1 : ((Ranked*)a)->index - ((Ranked*)b)->index;
+}
+
+// Writes the lines of source the instructions from first to last came from.
+static void formatLines(Profile *profile, int first, int last, char *text) {
+  int low = 0, high = 0;
+  for (int i = first; i <= last; i++) {
+    int line = profile->lines[i];
+    if (line == 0) continue;
+    if (low == 0 || line < low) low = line;
+    if (line > high) high = line;
+  }
+  if (low == 0)
+    strcpy(text, "-");
+  else if (low == high)
+    sprintf(text, "%d", low);
+  else
+    sprintf(text, "%d-%d", low, high);
+}
+
+static double percent(long part, long total) {
+  return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+// Writes the report of a profiled run: the source lines, loops and basic
+// blocks that ran the most instructions.
+void writeProfile(VM *vm, FILE *file) {
+  Profile *profile = vm->profile;
+  int size = vm->count + 1, maxLine = 0, rows;
+  long *counts = (long*)malloc(size * sizeof(long)), total = 0, entered = 0;
+  Ranked *ranked = (Ranked*)malloc(size * sizeof(Ranked));
+  char lines[64];
+
+  for (int i = 0; i < size; i++) {
+    if (profile->length[i] > 0) entered = profile->entered[i];
+    counts[i] = entered;
+    total += entered;
+    if (profile->lines[i] > maxLine) maxLine = profile->lines[i];
+  }
+  fprintf(file, "%ld instructions\n", total);
+
+  if (maxLine > 0) {
+    long *byLine = (long*)calloc(maxLine + 1, sizeof(long));
+    int *first = (int*)malloc((maxLine + 1) * sizeof(int));
+    for (int line = 0; line <= maxLine; line++) first[line] = -1;
+    for (int i = 0; i < size; i++) {
+      int line = profile->lines[i];
+      byLine[line] += counts[i];
+      if (first[line] == -1) first[line] = i;
+    }
+    rows = 0;
+    for (int line = 1; line <= maxLine; line++) {
+      if (byLine[line] > 0) ranked[rows++] = (Ranked){byLine[line], line};
+    }
+    qsort(ranked, rows, sizeof(Ranked), compareRanked);
+    fprintf(file, "\nhottest lines\n%6s %6s  %-16s %14s %7s\n",
+            "line", "column", "routine", "instructions", "%");
+    for (int r = 0; r < rows && r < REPORT_ROWS; r++) {
+      int line = ranked[r].index, i = first[line];
+      fprintf(file, "%6d %6d  %-16s %14ld %6.1f%%\n", line, profile->columns[i],
+              profile->names[profile->routines[i]], ranked[r].value, percent(ranked[r].value, total));
+    }
+    free(byLine);
+    free(first);
+  }
+
+  // a jump back to an earlier instruction of the same routine closes a loop
+  rows = 0;
+  for (int j = 0; j < vm->count; j++) {
+    Code *code = &vm->code[j];
+    int header = code->target != NULL ? (int)(code->target - vm->code) : -1;
+    long inside = 0;
+    if (code->op == OP_CHPR || header == -1 || header > j ||
+        profile->routines[header] != profile->routines[j])
+      continue;
+    for (int i = header; i <= j; i++) {
+      if (profile->routines[i] == profile->routines[j]) inside += counts[i];
+    }
+    if (inside > 0) ranked[rows++] = (Ranked){inside, j};
+  }
+  qsort(ranked, rows, sizeof(Ranked), compareRanked);
+  fprintf(file, "\nhottest loops\n%-12s %-16s %12s %12s %14s %7s\n",
+          "lines", "routine", "code", "iterations", "instructions", "%");
+  for (int r = 0; r < rows && r < REPORT_ROWS; r++) {
+    int j = ranked[r].index, header = vm->code[j].target - vm->code;
+    char range[32];
+    formatLines(profile, header, j, lines);
+    sprintf(range, "%d-%d", header, j);
+    fprintf(file, "%-12s %-16s %12s %12ld %14ld %6.1f%%\n", lines,
+            profile->names[profile->routines[j]], range, counts[j], ranked[r].value,
+            percent(ranked[r].value, total));
+  }
+
+  rows = 0;
+  for (int i = 0; i < size; i++) {
+    if (profile->length[i] > 0 && profile->entered[i] > 0)
+      ranked[rows++] = (Ranked){profile->entered[i] * profile->length[i], i};
+  }
+  qsort(ranked, rows, sizeof(Ranked), compareRanked);
+  fprintf(file, "\nhottest blocks\n%-12s %-16s %12s %12s %14s %7s\n",
+          "lines", "routine", "code", "entered", "instructions", "%");
+  for (int r = 0; r < rows && r < REPORT_ROWS; r++) {
+    int i = ranked[r].index, last = i + profile->length[i] - 1;
+    char range[32];
+    formatLines(profile, i, last, lines);
+    sprintf(range, "%d-%d", i, last);
+    fprintf(file, "%-12s %-16s %12s %12ld %14ld %6.1f%%\n", lines,
+            profile->names[profile->routines[i]], range, profile->entered[i], ranked[r].value,
+            percent(ranked[r].value, total));
+  }
+  free(counts);
+  free(ranked);
+}
+
+// Writes the instructions run in each chain of calls as collapsed stacks,
+// a line of routine names from the program down separated by ';' and the
+// count, as flame graph tools read them.
+void writeStacks(VM *vm, FILE *file) {
+  Profile *profile = vm->profile;
+  int *chain = (int*)malloc(profile->contextCount * sizeof(int));
+
+  for (int c = 0; c < profile->contextCount; c++) {
+    int depth = 0;
+    if (profile->contexts[c].instructions == 0) continue;
+    for (int k = c; k != -1; k = profile->contexts[k].parent) chain[depth++] = k;
+    while (depth-- > 0) {
+      char *name = profile->names[profile->contexts[chain[depth]].routine];
+      fprintf(file, "%s%c", name != NULL ? name : "?", depth > 0 ? ';' : ' ');
+    }
+    fprintf(file, "%ld\n", profile->contexts[c].instructions);
+  }
+  free(chain);
+}
+
+void freeProfile(Profile *profile) {
+  for (int i = 0; i < profile->count; i++) free(profile->names[i]);
+  free(profile->names);
+  free(profile->handlers);
+  free(profile->entered);
+  free(profile->length);
+  free(profile->lines);
+  free(profile->columns);
+  free(profile->routines);
+  free(profile->contexts);
+  free(profile->calls);
+  free(profile);
+}
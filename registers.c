@@ -0,0 +1,536 @@
+#include "header/vm.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Translation
+
+// The block being translated: the values it pushed and hasn't stored on the
+// stack yet, as operands, so that an operation reads its operands where they
+// are and writes its result where it goes.
+typedef struct Translation {
+  VM *vm;
+  RegisterCode *code;
+  int *jumps;                 // MEPA target of each instruction, or -1
+  int count, capacity;
+  Operand pending[REGISTER_COUNT];
+  int depth;
+  int blockStart;             // first instruction of the current block
+  int popped;                 // values popped from memory by the instruction
+  int constants;
+} Translation;
+
+static Operand registerOperand(int index) {
+  Operand operand = {REGISTERS, index};
+  return operand;
+}
+
+static Operand variable(int level, int offset) {
+  Operand operand = {level, offset};
+  return operand;
+}
+
+static Operand constant(Translation *t, Cell value) {
+  Operand operand = {CONSTANTS, t->constants};
+  t->vm->constants[t->constants++] = value;
+  return operand;
+}
+
+static int sameOperand(Operand x, Operand y) {
+  return x.base == y.base && x.offset == y.offset;
+}
+
+static RegisterCode *emit(Translation *t, RegisterOp op, int source) {
+  if (t->count == t->capacity) {
+    t->capacity *= 2;
+    t->code = (RegisterCode*)realloc(t->code, t->capacity * sizeof(RegisterCode));
+    t->jumps = (int*)realloc(t->jumps, t->capacity * sizeof(int));
+  }
+  RegisterCode *code = &t->code[t->count];
+  memset(code, 0, sizeof(RegisterCode));
+  code->op = op;
+  code->source = source;
+  t->jumps[t->count++] = -1;
+  return code;
+}
+
+// Pushes the pending values on the stack in memory.
+static void flush(Translation *t, int source) {
+  for (int i = 0; i < t->depth; i++) emit(t, REG_PUSH, source)->a = t->pending[i];
+  t->depth = 0;
+}
+
+static void push(Translation *t, Operand operand, int source) {
+  if (t->depth == REGISTER_COUNT) flush(t, source);
+  t->pending[t->depth++] = operand;
+}
+
+// Pushes the result of an operation, which goes to the register of its
+// position on the stack. Called before the operation is emitted, since it
+// may push the pending values first.
+static Operand pushResult(Translation *t, int source) {
+  if (t->depth == REGISTER_COUNT) flush(t, source);
+  t->pending[t->depth] = registerOperand(t->depth);
+  return t->pending[t->depth++];
+}
+
+// Pops the operand on top of the stack, from memory if nothing is pending.
+static Operand pop(Translation *t, int source) {
+  if (t->depth > 0) return t->pending[--t->depth];
+  Operand popped = registerOperand(REGISTER_COUNT + t->popped++);
+  emit(t, REG_POP, source)->dst = popped;
+  return popped;
+}
+
+// Checks if a pending value reads a variable that a store to the cell can
+// change. Cells of different levels may overlap, and an indirect store
+// (base -1) may change any of them.
+static int aliases(Operand pendingValue, Operand cell) {
+  if (pendingValue.base >= DISPLAY_SIZE) return 0;
+  return cell.base == -1 || pendingValue.base != cell.base ||
+         pendingValue.offset == cell.offset;
+}
+
+// Copies to registers the pending variables a store to the cell can change.
+// Returns the number copied.
+static int materialize(Translation *t, Operand cell, int source) {
+  int copied = 0;
+  for (int i = 0; i < t->depth; i++) {
+    if (!aliases(t->pending[i], cell)) continue;
+    RegisterCode *move = emit(t, REG_MOV, source);
+    move->dst = registerOperand(i);
+    move->a = t->pending[i];
+    t->pending[i] = move->dst;
+    copied++;
+  }
+  return copied;
+}
+
+static int writesResult(RegisterOp op) {
+  return op <= REG_ADDR && op != REG_STOREI && op != REG_STOREX ? 1 :
+         op == REG_POP || op == REG_READ || op == REG_READF;
+}
+
+// Stores the value in the cell, by making the instruction that computed it
+// write there when nothing pending needs the old value.
+static void store(Translation *t, Operand value, Operand cell, int source) {
+  RegisterCode *last = t->count > t->blockStart ? &t->code[t->count - 1] : NULL;
+  if (materialize(t, cell, source) == 0 && last != NULL && value.base == REGISTERS &&
+      writesResult(last->op) && sameOperand(last->dst, value)) {
+    last->dst = cell;
+    return;
+  }
+  RegisterCode *move = emit(t, REG_MOV, source);
+  move->dst = cell;
+  move->a = value;
+}
+
+static RegisterOp registerOp(Opcode op) {
+  switch (op) {
+    case OP_SOMA: case OP_INCV: case OP_SOVV: return REG_ADD;
+    case OP_SUBT: return REG_SUB;
+    case OP_MULT: return REG_MUL;
+    case OP_DIVI: return REG_DIV;
+    case OP_CONJ: return REG_AND;
+    case OP_DISJ: return REG_OR;
+    case OP_CMME: return REG_LT;
+    case OP_CMMA: return REG_GT;
+    case OP_CMIG: return REG_EQ;
+    case OP_CMDG: return REG_NE;
+    case OP_CMEG: return REG_LE;
+    case OP_CMAG: return REG_GE;
+    case OP_SOMF: return REG_ADDF;
+    case OP_SUBF: return REG_SUBF;
+    case OP_MULF: return REG_MULF;
+    case OP_DIVF: return REG_DIVF;
+    case OP_CMPF: return REG_CMPF;
+    case OP_INVR: return REG_NEG;
+    case OP_NEGA: return REG_NOT;
+    case OP_INVF: return REG_NEGF;
+    case OP_ITOF: return REG_ITOF;
+    case OP_DVME: return REG_JLT;
+    case OP_DVMA: return REG_JGT;
+    case OP_DVIG: return REG_JEQ;
+    case OP_DVDG: return REG_JNE;
+    case OP_DVEG: return REG_JLE;
+    case OP_DVAG: return REG_JGE;
+    default: return REG_COUNT;
+  }
+}
+
+// Emits a jump to the MEPA instruction.
+static RegisterCode *emitJump(Translation *t, RegisterOp op, int source, int target) {
+  RegisterCode *jump = emit(t, op, source);
+  t->jumps[t->count - 1] = target;
+  return jump;
+}
+
+// Translates the MEPA instruction at index.
+static void translateInstr(Translation *t, int index) {
+  Code *pc = &t->vm->code[index];
+  int target = pc->target != NULL ? (int)(pc->target - t->vm->code) : -1;
+  RegisterOp op = registerOp(pc->op);
+  RegisterCode *code;
+  Operand x, y;
+
+  t->popped = 0;
+  switch (pc->op) {
+    case OP_NADA:
+      break;
+    case OP_CRCT:
+      push(t, constant(t, pc->value), index);
+      break;
+    case OP_CRVL:
+      push(t, variable(pc->a, pc->b), index);
+      break;
+    case OP_ARMZ:
+      x = pop(t, index);
+      store(t, x, variable(pc->a, pc->b), index);
+      break;
+    case OP_CRVI:
+      y = pushResult(t, index);
+      code = emit(t, REG_LOADI, index);
+      code->a = variable(pc->a, pc->b);
+      code->dst = y;
+      break;
+    case OP_ARMI:
+      x = pop(t, index);
+      materialize(t, variable(-1, 0), index);
+      code = emit(t, REG_STOREI, index);
+      code->a = variable(pc->a, pc->b);
+      code->b = x;
+      break;
+    case OP_CRVX:
+      x = pop(t, index);
+      y = pushResult(t, index);
+      code = emit(t, REG_LOADX, index);
+      code->level = pc->a;
+      code->count = pc->b - pc->c;
+      code->a = x;
+      code->dst = y;
+      break;
+    case OP_ARMX:
+      y = pop(t, index);
+      x = pop(t, index);
+      materialize(t, variable(-1, 0), index);
+      code = emit(t, REG_STOREX, index);
+      code->level = pc->a;
+      code->count = pc->b - pc->c;
+      code->a = x;
+      code->b = y;
+      break;
+    case OP_VERI:
+      // the index stays on the stack for the access
+      x = pop(t, index);
+      code = emit(t, REG_CHECK, index);
+      code->level = pc->a;
+      code->count = pc->b;
+      code->a = x;
+      push(t, x, index);
+      break;
+    case OP_CREN:
+      y = pushResult(t, index);
+      code = emit(t, REG_ADDR, index);
+      code->level = pc->a;
+      code->count = pc->b;
+      code->dst = y;
+      break;
+    case OP_INVR: case OP_NEGA: case OP_INVF: case OP_ITOF:
+      x = pop(t, index);
+      y = pushResult(t, index);
+      code = emit(t, op, index);
+      code->a = x;
+      code->dst = y;
+      break;
+    case OP_DSVS:
+      flush(t, index);
+      emitJump(t, REG_JUMP, index, target);
+      break;
+    case OP_DSVF: {
+      x = pop(t, index);
+      RegisterCode *last = t->count > t->blockStart ? &t->code[t->count - 1] : NULL;
+      // a comparison followed by the jump becomes a compare and branch
+      if (x.base == REGISTERS && last != NULL && last->op >= REG_LT && last->op <= REG_GE &&
+          sameOperand(last->dst, x)) {
+        RegisterCode compare = *last;
+        t->count--;
+        flush(t, index);
+        code = emitJump(t, REG_JLT + (compare.op - REG_LT), index, target);
+        code->a = compare.a;
+        code->b = compare.b;
+      } else {
+        flush(t, index);
+        emitJump(t, REG_JF, index, target)->a = x;
+      }
+      break;
+    }
+    case OP_LEIT: case OP_LEIF:
+      y = pushResult(t, index);
+      emit(t, pc->op == OP_LEIT ? REG_READ : REG_READF, index)->dst = y;
+      break;
+    case OP_IMPR: case OP_IMPF:
+      x = pop(t, index);
+      emit(t, pc->op == OP_IMPR ? REG_WRITE : REG_WRITEF, index)->a = x;
+      break;
+    case OP_INCV: case OP_SOVV: {
+      Operand cell = variable(pc->a, pc->op == OP_INCV ? pc->b : pc->d);
+      materialize(t, cell, index);
+      code = emit(t, REG_ADD, index);
+      code->dst = cell;
+      code->a = variable(pc->a, pc->b);
+      code->b = pc->op == OP_INCV ? constant(t, pc->value) : variable(pc->a, pc->c);
+      break;
+    }
+    case OP_DVME: case OP_DVMA: case OP_DVIG: case OP_DVDG: case OP_DVEG: case OP_DVAG:
+      flush(t, index);
+      code = emitJump(t, op, index, target);
+      code->a = variable(pc->a, pc->b);
+      code->b = variable(pc->a, pc->c);
+      break;
+    case OP_INPP: case OP_PARA: case OP_AMEM: case OP_DMEM: case OP_DSVR: case OP_ENRT:
+    case OP_CHPR: case OP_ENPR: case OP_RTPR: {
+      // frame instructions work on the stack in memory
+      RegisterOp frameOps[] = {
+        [OP_INPP] = REG_INPP, [OP_PARA] = REG_PARA, [OP_AMEM] = REG_AMEM,
+        [OP_DMEM] = REG_DMEM, [OP_DSVR] = REG_DSVR, [OP_ENRT] = REG_ENRT,
+        [OP_CHPR] = REG_CHPR, [OP_ENPR] = REG_ENPR, [OP_RTPR] = REG_RTPR
+      };
+      flush(t, index);
+      code = target != -1 ? emitJump(t, frameOps[pc->op], index, target)
+                          : emit(t, frameOps[pc->op], index);
+      code->level = pc->a;
+      code->count = pc->op == OP_CHPR ? index + 1 :
+                    pc->op == OP_AMEM || pc->op == OP_DMEM ? pc->a : pc->b;
+      break;
+    }
+    default:
+      // binary operations
+      y = pop(t, index);
+      x = pop(t, index);
+      code = emit(t, op, index);
+      code->a = x;
+      code->b = y;
+      code->dst = pushResult(t, index);   // after two pops, nothing is flushed
+      break;
+  }
+}
+
+// Translates the decoded program into register code. Basic blocks keep the
+// values they push in registers, or read them straight from their variables
+// and constants, and store them on the stack in memory only where the block
+// ends.
+void translateRegisters(VM *vm) {
+  Translation t;
+  char *leader = (char*)calloc(vm->count + 1, 1);
+  int *start = (int*)malloc((vm->count + 1) * sizeof(int));
+
+  memset(&t, 0, sizeof(Translation));
+  t.vm = vm;
+  t.capacity = 2 * vm->count + 16;
+  t.code = (RegisterCode*)malloc(t.capacity * sizeof(RegisterCode));
+  t.jumps = (int*)malloc(t.capacity * sizeof(int));
+  vm->constants = (Cell*)malloc((vm->count + 1) * sizeof(Cell));
+
+  leader[0] = 1;
+  for (int i = 0; i < vm->count; i++) {
+    Opcode op = vm->code[i].op;
+    if (vm->code[i].target != NULL) leader[vm->code[i].target - vm->code] = 1;
+    if (vm->code[i].target != NULL || op == OP_RTPR || op == OP_PARA) leader[i + 1] = 1;
+  }
+
+  for (int i = 0; i <= vm->count; i++) {
+    if (leader[i]) {
+      flush(&t, i);
+      t.blockStart = t.count;
+    }
+    start[i] = t.count;
+    translateInstr(&t, i);
+  }
+
+  for (int i = 0; i < t.count; i++) {
+    if (t.jumps[i] != -1) t.code[i].target = &t.code[start[t.jumps[i]]];
+    // CHPR pushes where its call returns in the register code
+    if (t.code[i].op == REG_CHPR) t.code[i].count = start[t.code[i].count];
+  }
+
+  vm->registerCode = t.code;
+  vm->registerCount = t.count;
+  free(t.jumps);
+  free(leader);
+  free(start);
+}
+
+void freeRegisters(VM *vm) {
+  free(vm->registerCode);
+  free(vm->constants);
+  vm->registerCode = NULL;
+  vm->constants = NULL;
+}
+
+// Execution
+
+// Runs the register code like run() runs the MEPA code. Operands are found
+// through a table of bases, so that a cell of a frame, a register and a
+// constant are all read the same way.
+void runRegisters(VM *vm) {
+  static void *handlers[REG_COUNT] = {
+    [REG_MOV] = &&MOV, [REG_ADD] = &&ADD, [REG_SUB] = &&SUB, [REG_MUL] = &&MUL,
+    [REG_DIV] = &&DIV, [REG_AND] = &&AND, [REG_OR] = &&OR, [REG_LT] = &&LT,
+    [REG_GT] = &&GT, [REG_EQ] = &&EQ, [REG_NE] = &&NE, [REG_LE] = &&LE, [REG_GE] = &&GE,
+    [REG_ADDF] = &&ADDF, [REG_SUBF] = &&SUBF, [REG_MULF] = &&MULF, [REG_DIVF] = &&DIVF,
+    [REG_CMPF] = &&CMPF, [REG_NEG] = &&NEG, [REG_NOT] = &&NOT, [REG_NEGF] = &&NEGF,
+    [REG_ITOF] = &&ITOF, [REG_LOADI] = &&LOADI, [REG_STOREI] = &&STOREI,
+    [REG_LOADX] = &&LOADX, [REG_STOREX] = &&STOREX, [REG_ADDR] = &&ADDR,
+    [REG_CHECK] = &&CHECK, [REG_JUMP] = &&JUMP, [REG_JF] = &&JF, [REG_JLT] = &&JLT,
+    [REG_JGT] = &&JGT, [REG_JEQ] = &&JEQ, [REG_JNE] = &&JNE, [REG_JLE] = &&JLE,
+    [REG_JGE] = &&JGE, [REG_PUSH] = &&PUSH, [REG_POP] = &&POP, [REG_READ] = &&READ,
+    [REG_READF] = &&READF, [REG_WRITE] = &&WRITE, [REG_WRITEF] = &&WRITEF,
+    [REG_INPP] = &&INPP, [REG_PARA] = &&PARA, [REG_AMEM] = &&AMEM, [REG_DMEM] = &&DMEM,
+    [REG_DSVR] = &&DSVR, [REG_ENRT] = &&ENRT, [REG_CHPR] = &&CHPR, [REG_ENPR] = &&ENPR,
+    [REG_RTPR] = &&RTPR
+  };
+  Cell *M = vm->memory, *sp = M - 1;
+  unsigned long size = vm->stackSize;
+  Cell registers[REGISTER_COUNT + 2];
+  Cell *bases[CONSTANTS + 1];
+  long D[DISPLAY_SIZE] = {0};
+  RegisterCode *code = vm->registerCode, *pc = code;
+  long executed = 1, budget = checkBudget(vm, vm->code, 0);
+
+  for (int k = 0; k < DISPLAY_SIZE; k++) bases[k] = M;
+  bases[REGISTERS] = registers;
+  bases[CONSTANTS] = vm->constants;
+  for (int i = 0; i < vm->registerCount; i++) code[i].handler = handlers[code[i].op];
+
+#define NEXT do { executed++; goto *(++pc)->handler; } while (0)
+#define CHECK_STACK(p) \
+  if ((unsigned long)((p) - M + 1) > size) ERROR((p) < M ? "stack underflow" : "stack overflow")
+#define JUMP(to) do { \
+    if (++executed > budget) budget = checkBudget(vm, &vm->code[pc->source], executed); \
+    CHECK_STACK(sp); \
+    pc = (to); goto *pc->handler; \
+  } while (0)
+#define OPERAND(o) bases[(o).base][(o).offset]
+#define DST OPERAND(pc->dst)
+#define A OPERAND(pc->a)
+#define B OPERAND(pc->b)
+#define SET_DISPLAY(k, value) do { D[k] = (value); bases[k] = M + D[k]; } while (0)
+#define ERROR(message) runtimeError(vm, &vm->code[pc->source], message)
+#define AT(a) M[(unsigned long)(a) < size ? (a) : (ERROR("invalid address"), 0)]
+#define BRANCH(cmp) do { if (!(A.i cmp B.i)) JUMP(pc->target); NEXT; } while (0)
+
+  goto *pc->handler;
+
+MOV: DST = A; NEXT;
+ADD: DST.i = WRAP(A.i, +, B.i); NEXT;
+SUB: DST.i = WRAP(A.i, -, B.i); NEXT;
+MUL: DST.i = WRAP(A.i, *, B.i); NEXT;
+DIV:
+  if (B.i == 0) ERROR("division by zero");
+  if (B.i == -1 && A.i == LONG_MIN) ERROR("integer overflow");
+  DST.i = A.i / B.i;
+  NEXT;
+AND: DST.i = A.i && B.i; NEXT;
+OR: DST.i = A.i || B.i; NEXT;
+LT: DST.i = A.i < B.i; NEXT;
+GT: DST.i = A.i > B.i; NEXT;
+EQ: DST.i = A.i == B.i; NEXT;
+NE: DST.i = A.i != B.i; NEXT;
+LE: DST.i = A.i <= B.i; NEXT;
+GE: DST.i = A.i >= B.i; NEXT;
+ADDF: DST.f = A.f + B.f; NEXT;
+SUBF: DST.f = A.f - B.f; NEXT;
+MULF: DST.f = A.f * B.f; NEXT;
+DIVF:
+  if (B.f == 0.0) ERROR("division by zero");
+  DST.f = A.f / B.f;
+  NEXT;
+CMPF: DST.i = (A.f > B.f) - (A.f < B.f); NEXT;
+NEG: DST.i = WRAP(0, -, A.i); NEXT;
+NOT: DST.i = 1 - A.i; NEXT;
+NEGF: DST.f = -A.f; NEXT;
+ITOF: DST.f = (double)A.i; NEXT;
+LOADI: DST = AT(A.i); NEXT;
+STOREI: AT(A.i) = B; NEXT;
+LOADX: DST = AT(D[pc->level] + pc->count + A.i); NEXT;
+STOREX: AT(D[pc->level] + pc->count + A.i) = B; NEXT;
+ADDR: DST.i = D[pc->level] + pc->count; NEXT;
+CHECK:
+  if (A.i < pc->level || A.i > pc->count) ERROR("index out of range");
+  NEXT;
+JUMP: JUMP(pc->target);
+JF:
+  if (A.i == 0) JUMP(pc->target);
+  NEXT;
+JLT: BRANCH(<);
+JGT: BRANCH(>);
+JEQ: BRANCH(==);
+JNE: BRANCH(!=);
+JLE: BRANCH(<=);
+JGE: BRANCH(>=);
+PUSH: *++sp = A; NEXT;
+POP: DST = *sp--; NEXT;
+READ: DST.i = readInteger(vm, &vm->code[pc->source]); NEXT;
+READF: DST.f = readReal(vm, &vm->code[pc->source]); NEXT;
+WRITE: writeInteger(vm, A.i); NEXT;
+WRITEF: writeReal(vm, A.f); NEXT;
+
+  // frame instructions
+INPP: sp = M - 1; SET_DISPLAY(0, 0); NEXT;
+PARA: flushOutput(&vm->output); vm->executed = executed; return;
+AMEM:
+  sp += pc->count;
+  CHECK_STACK(sp);
+  NEXT;
+DMEM:
+  sp -= pc->count;
+  CHECK_STACK(sp);
+  NEXT;
+DSVR: {
+  long k = pc->count;
+  for (unsigned long unwound = 0; k != pc->level; unwound++) {
+    long base = D[k];
+    if (unwound > size || (unsigned long)M[base - 1].i > size ||
+        (unsigned long)M[base - 2].i >= DISPLAY_SIZE)
+      ERROR("invalid frame");
+    SET_DISPLAY(k, M[base - 1].i);
+    k = M[base - 2].i;
+  }
+  JUMP(pc->target);
+}
+ENRT:
+  sp = M + D[pc->level] + pc->count - 1;
+  CHECK_STACK(sp);
+  NEXT;
+CHPR:
+  CHECK_STACK(sp + 2);
+  sp[1].i = pc->count;
+  sp[2].i = pc->level;
+  sp += 2;
+  JUMP(pc->target);
+ENPR:
+  (++sp)->i = D[pc->level];
+  SET_DISPLAY(pc->level, sp - M + 1);
+  NEXT;
+RTPR: {
+  if ((unsigned long)sp[-2].i >= (unsigned long)vm->registerCount || (unsigned long)sp->i > size)
+    ERROR("invalid frame");
+  RegisterCode *back = &code[sp[-2].i];
+  SET_DISPLAY(pc->level, sp->i);
+  sp -= pc->count + 3;
+  JUMP(back);
+}
+
+#undef NEXT
+#undef CHECK_STACK
+#undef JUMP
+#undef OPERAND
+#undef DST
+#undef A
+#undef B
+#undef SET_DISPLAY
+#undef ERROR
+#undef AT
+#undef BRANCH
+}
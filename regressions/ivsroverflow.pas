@@ -0,0 +1,14 @@
+program ivsroverflow;
+var i, k, last: integer;
+
+begin
+  k := 0;
+  i := 4294967290;
+  while i < 4294967299 do
+  begin
+    last := i * 2147483647;
+    k := k + i * 2147483647 - last;
+    i := i + 1
+  end;
+  write(last, k)
+end.
@@ -0,0 +1,27 @@
+program resultslot;
+var total: integer;
+
+function g(a: integer): integer;
+begin
+  total := total + a;
+  g := a * 2
+end;
+
+procedure p(b: integer);
+var x: integer;
+begin
+  x := g(b)
+end;
+
+procedure q;
+var y: integer;
+begin
+  y := 5;
+  p(y);
+  write(y, total + 2)
+end;
+
+begin
+  total := 0;
+  q
+end.
@@ -0,0 +1,18 @@
+program tailaddress;
+var total: integer;
+
+procedure p(n: integer; var r: integer);
+var x: integer;
+begin
+  x := 0;
+  r := r + n * 100;
+  write(r);
+  x := r;
+  if n > 0 then p(n - 1, x)
+end;
+
+begin
+  total := 1;
+  p(3, total);
+  write(total)
+end.
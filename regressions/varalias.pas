@@ -0,0 +1,31 @@
+program varalias;
+var g: integer;
+
+procedure q(var a, b: integer);
+var n: integer;
+begin
+  n := 0;
+  while n < 3 do
+  begin
+    b := b + 1;
+    a := a + 10;
+    n := n + 1
+  end
+end;
+
+procedure p(var r: integer);
+begin
+  q(r, g)
+end;
+
+procedure s(var r: integer);
+begin
+  q(r, g)
+end;
+
+begin
+  g := 0;
+  p(g);
+  s(g);
+  write(g)
+end.
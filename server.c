@@ -0,0 +1,331 @@
+#include "header/driver.h"
+#include "header/generator.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_SIZE 256          // connections accepted and waiting for a worker
+#define MAX_REQUEST (64 << 20)  // bytes of source in a request
+#define REQUEST_TIMEOUT 10      // seconds a client has to send its request
+
+// A connection waiting for a worker, and when it was accepted.
+typedef struct Connection {
+  int fd;
+  struct timespec accepted;
+} Connection;
+
+typedef struct Server {
+  Connection queue[QUEUE_SIZE];
+  int head, count;
+  int stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, room;
+  CompileOptions *options;
+  double *latencies;          // ms from accept to the last byte of each answer
+  int served, capacity;
+  int compiled, rejected, failed;
+} Server;
+
+// SIGINT and SIGTERM write to this pipe, which the accept loop watches
+// along with the socket.
+static int stopPipe[2];
+
+static void requestStop(int number) {
+  char byte = 1;
+  if (write(stopPipe[1], &byte, 1) < 0) return;
+}
+
+static double elapsedMs(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// Protocol
+
+// Waits for something to read on fd until the deadline. Returns 0 once it
+// has passed.
+static int waitInput(int fd, struct timespec deadline) {
+  struct timespec now;
+  struct pollfd watched = {fd, POLLIN, 0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double left = elapsedMs(now, deadline);
+  return poll(&watched, 1, left > 0 ? (int)left + 1 : 0) == 1;
+}
+
+static int readFully(int fd, char *buffer, long size, struct timespec deadline) {
+  for (long done = 0; done < size;) {
+    if (!waitInput(fd, deadline)) return 0;
+    ssize_t count = read(fd, buffer + done, size - done);
+    if (count <= 0) return 0;
+    done += count;
+  }
+  return 1;
+}
+
+static int writeFully(int fd, char *buffer, long size) {
+  for (long done = 0; done < size;) {
+    ssize_t count = write(fd, buffer + done, size - done);
+    if (count <= 0) return 0;
+    done += count;
+  }
+  return 1;
+}
+
+// Reads the header line of a request, without its newline.
+static int readHeader(int fd, char *line, struct timespec deadline) {
+  for (int length = 0; length < BUFFER_SIZE - 1; length++) {
+    if (!waitInput(fd, deadline) || read(fd, &line[length], 1) != 1) return 0;
+    if (line[length] == '\n') {
+      line[length] = '\0';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Answers a client whose request didn't arrive by the deadline with an
+// error, if that is why it couldn't be read.
+static void timedOut(int fd, struct timespec deadline) {
+  char line[64], *message = "Error: request not received in time\n";
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (elapsedMs(now, deadline) > 0) return;
+  snprintf(line, sizeof(line), "failed 0 %zu\n", strlen(message));
+  if (writeFully(fd, line, strlen(line))) writeFully(fd, message, strlen(message));
+}
+
+// Answers a request, made of a header line and a body of the size it gives:
+//   source <size>    the body is the program
+//   path <size>      the body is the path of the program, as the server sees it
+//   shutdown         stops the server once the requests accepted are answered
+// The answer is a line "<ok|rejected|failed> <code size> <diagnostics size>"
+// followed by the code and what the compiler reported. A request that hasn't
+// arrived REQUEST_TIMEOUT seconds after the connection was accepted fails
+// with an error. Returns the status, or -1 if the request was a shutdown or
+// couldn't be read.
+static int answer(Server *server, Connection *connection) {
+  char header[BUFFER_SIZE], kind[16], line[64];
+  char *body = NULL, *text = NULL, *messages = NULL;
+  size_t textSize = 0, messagesSize = 0;
+  struct timespec deadline = connection->accepted;
+  long size;
+  int fd = connection->fd, status = -1, instructions;
+
+  deadline.tv_sec += REQUEST_TIMEOUT;
+  if (!readHeader(fd, header, deadline)) {
+    timedOut(fd, deadline);
+    return -1;
+  }
+  if (strcmp(header, "shutdown") == 0) {
+    requestStop(SIGTERM);
+    return -1;
+  }
+  if (sscanf(header, "%15s %ld", kind, &size) != 2 || size < 0 || size > MAX_REQUEST ||
+      (strcmp(kind, "source") != 0 && strcmp(kind, "path") != 0))
+    return -1;
+  body = (char*)malloc(size + 1);
+  if (!readFully(fd, body, size, deadline)) {
+    timedOut(fd, deadline);
+    free(body);
+    return -1;
+  }
+  body[size] = '\0';
+
+  FILE *output = open_memstream(&text, &textSize);
+  FILE *source = strcmp(kind, "path") == 0 ? fopen(body, "r") : fmemopen(body, size, "r");
+  diagnostics = open_memstream(&messages, &messagesSize);
+  if (source == NULL) {
+    fprintf(diagnostics, "Error opening file: %s\n", strerror(errno));
+    status = COMPILE_FAILED;
+  } else {
+    status = compileStream(source, output, server->options, &instructions);
+    fclose(source);
+  }
+  fclose(output);
+  fclose(diagnostics);
+  diagnostics = NULL;
+  if (status != COMPILE_OK) textSize = 0;
+
+  snprintf(line, sizeof(line), "%s %zu %zu\n",
+           status == COMPILE_OK ? "ok" : status == COMPILE_REJECTED ? "rejected" : "failed",
+           textSize, messagesSize);
+  if (!writeFully(fd, line, strlen(line)) || !writeFully(fd, text, textSize) ||
+      !writeFully(fd, messages, messagesSize))
+    status = -1;
+  free(body);
+  free(text);
+  free(messages);
+  return status;
+}
+
+// Server
+
+static void *work(void *argument) {
+  Server *server = (Server*)argument;
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (server->count == 0 && !server->stopping)
+      pthread_cond_wait(&server->ready, &server->lock);
+    if (server->count == 0) {
+      pthread_mutex_unlock(&server->lock);
+      return NULL;
+    }
+    Connection connection = server->queue[server->head];
+    server->head = (server->head + 1) % QUEUE_SIZE;
+    server->count--;
+    pthread_cond_signal(&server->room);
+    pthread_mutex_unlock(&server->lock);
+
+    int status = answer(server, &connection);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(connection.fd);
+    if (status == -1) continue;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->served == server->capacity) {
+      server->capacity *= 2;
+      server->latencies = (double*)realloc(server->latencies,
+                                           server->capacity * sizeof(double));
+    }
+    server->latencies[server->served++] = elapsedMs(connection.accepted, end);
+    server->compiled += status == COMPILE_OK;
+    server->rejected += status == COMPILE_REJECTED;
+    server->failed += status == COMPILE_FAILED;
+    pthread_mutex_unlock(&server->lock);
+  }
+}
+
+static int compareLatencies(const void *a, const void *b) {
+  double x = *(double*)a, y = *(double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// The latency below which the given fraction of the requests were answered.
+static double percentile(double *sorted, int count, double fraction) {
+  int rank = (int)(fraction * count + 0.999999);
+  if (count == 0) return 0.0;
+  return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static void writeLatencies(Server *server) {
+  qsort(server->latencies, server->served, sizeof(double), compareLatencies);
+  fprintf(stderr, "served %d requests (%d ok, %d rejected, %d failed), "
+                  "p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+          server->served, server->compiled, server->rejected, server->failed,
+          percentile(server->latencies, server->served, 0.50),
+          percentile(server->latencies, server->served, 0.99),
+          server->served > 0 ? server->latencies[server->served - 1] : 0.0);
+}
+
+// Compiles the programs sent to the Unix socket at the path, on a pool of
+// threads (one per processor when threads is 0), until SIGINT, SIGTERM or a
+// shutdown request. The requests accepted by then are still answered, and
+// the latencies of the answers are written to stderr. Returns 0, or 1 if the
+// socket can't be opened.
+int runServer(char *socketPath, int threads, CompileOptions *options) {
+  struct sockaddr_un address;
+  struct sigaction action;
+  sigset_t signals, previous;
+  struct stat info;
+  Server *server = (Server*)calloc(1, sizeof(Server));
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (listener == -1 || strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error opening socket: %s\n",
+            listener == -1 ? strerror(errno) : "path too long");
+    free(server);
+    return 1;
+  }
+  strcpy(address.sun_path, socketPath);
+  // a socket left by a server that didn't stop cleanly, but nothing else
+  if (stat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socketPath);
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    perror("Error opening socket");
+    close(listener);
+    free(server);
+    return 1;
+  }
+
+  if (pipe(stopPipe) == -1) {
+    perror("Error opening socket");
+    close(listener);
+    free(server);
+    return 1;
+  }
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->ready, NULL);
+  pthread_cond_init(&server->room, NULL);
+  server->options = options;
+  server->capacity = 1024;
+  server->latencies = (double*)malloc(server->capacity * sizeof(double));
+
+  // the workers leave the signals to this thread, whose accept they stop
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  pthread_t *workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+  for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, work, server);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  fprintf(stderr, "listening on %s with %d threads\n", socketPath, threads);
+
+  for (;;) {
+    struct pollfd watched[2] = {{listener, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+    if (poll(watched, 2, -1) == -1 || watched[1].revents != 0) {
+      if (errno == EINTR && watched[1].revents == 0) continue;
+      break;
+    }
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1) continue;
+    // reads give up at the deadline of the request, and writes to a client that
+    // doesn't read its answer after as long
+    struct timeval timeout = {REQUEST_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    Connection connection = {fd};
+    clock_gettime(CLOCK_MONOTONIC, &connection.accepted);
+    pthread_mutex_lock(&server->lock);
+    while (server->count == QUEUE_SIZE) pthread_cond_wait(&server->room, &server->lock);
+    server->queue[(server->head + server->count++) % QUEUE_SIZE] = connection;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+  }
+
+  close(listener);
+  close(stopPipe[0]);
+  close(stopPipe[1]);
+  unlink(socketPath);
+  pthread_mutex_lock(&server->lock);
+  server->stopping = 1;
+  pthread_cond_broadcast(&server->ready);
+  pthread_mutex_unlock(&server->lock);
+  for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+  writeLatencies(server);
+
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->ready);
+  pthread_cond_destroy(&server->room);
+  free(workers);
+  free(server->latencies);
+  free(server);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,414 @@
+#include "header/ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define MAX_LEVELS 64
+
+// What the translated program needs besides its code: the stack size and the
+// runtime helpers, which behave as those of the mepa VM.
+static const char *prelude =
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <string.h>\n"
+  "#include <limits.h>\n"
+  "\n"
+  "#define STACK_SIZE (1 << 20)\n"
+  "\n"
+  "// integer arithmetic wraps around as in the VM\n"
+  "#define WRAP(x, op, y) ((long)((unsigned long)(x) op (unsigned long)(y)))\n"
+  "\n"
+  "typedef union Cell {\n"
+  "  long i;\n"
+  "  double f;\n"
+  "} Cell;\n"
+  "\n"
+  "static void fail(char *message, int at) {\n"
+  "  fflush(stdout);\n"
+  "  fprintf(stderr, \"Error: %s at instruction %d\\n\", message, at);\n"
+  "  exit(1);\n"
+  "}\n"
+  "\n"
+  "// jumps check the stack, which the code between them can only take as far\n"
+  "// as STACK_SLACK past its size\n"
+  "#define JUMP(to, at) \\\n"
+  "  do { if (s >= STACK_SIZE) fail(\"stack overflow\", at); goto to; } while (0)\n"
+  "\n"
+  "static inline long readInteger(int at) {\n"
+  "  long value;\n"
+  "  if (scanf(\"%ld\", &value) != 1) fail(\"invalid or missing input\", at);\n"
+  "  return value;\n"
+  "}\n"
+  "\n"
+  "static inline double readReal(int at) {\n"
+  "  double value;\n"
+  "  if (scanf(\"%lf\", &value) != 1) fail(\"invalid or missing input\", at);\n"
+  "  return value;\n"
+  "}\n"
+  "\n"
+  "static inline void writeReal(double value) {\n"
+  "  double magnitude = value < 0 ? -value : value;\n"
+  "  char text[64];\n"
+  "  for (int precision = 1; precision <= 17; precision++) {\n"
+  "    sprintf(text, \"%.*g\", precision, value);\n"
+  "    if (strtod(text, NULL) == value &&\n"
+  "        (strchr(text, 'e') == NULL || magnitude >= 1e15 || magnitude < 1e-4))\n"
+  "      break;\n"
+  "  }\n"
+  "  if (strpbrk(text, \".e\") == NULL) strcat(text, \".0\");\n"
+  "  printf(\"%s\\n\", text);\n"
+  "}\n"
+  "\n";
+
+// The values pushed in the current block, held in C variables (t0, t1, ...)
+// until the block ends or something needs them in memory.
+typedef struct Translator {
+  FILE *file;
+  int pending[BUFFER_SIZE];
+  int count;
+  int temps;                  // variables declared in the block
+} Translator;
+
+// Writes a cell of a frame as M[dk + n].
+static void formatCell(char *buffer, int level, int offset) {
+  if (offset < 0)
+    sprintf(buffer, "M[d%d - %d]", level, -offset);
+  else
+    sprintf(buffer, "M[d%d + %d]", level, offset);
+}
+
+// Writes the element of an array at dk + n whose first index is low, for
+// the index in a variable, as M[dk + ti.i + n - low].
+static void formatElement(char *buffer, Instr *instr, int index) {
+  int offset = instr->b - instr->c;
+  if (offset < 0)
+    sprintf(buffer, "M[d%d + t%d.i - %d]", instr->a, index, -offset);
+  else
+    sprintf(buffer, "M[d%d + t%d.i + %d]", instr->a, index, offset);
+}
+
+// Stores the pending values on the stack in memory.
+static void flushStack(Translator *t) {
+  for (int i = 0; i < t->count; i++)
+    fprintf(t->file, "  M[s + %d] = t%d;\n", i + 1, t->pending[i]);
+  if (t->count > 0) fprintf(t->file, "  s += %d;\n", t->count);
+  t->count = 0;
+}
+
+// Declares a new variable with the value and pushes it.
+static void pushValue(Translator *t, char *value) {
+  if (t->count == BUFFER_SIZE) flushStack(t);
+  fprintf(t->file, "  Cell t%d = %s;\n", t->temps, value);
+  t->pending[t->count++] = t->temps++;
+}
+
+// Pops the value on top of the stack, loading it from memory if it isn't
+// pending. Returns the number of its variable.
+static int popValue(Translator *t) {
+  if (t->count > 0) return t->pending[--t->count];
+  fprintf(t->file, "  Cell t%d = M[s--];\n", t->temps);
+  return t->temps++;
+}
+
+// Ends the current block, with the stack in memory.
+static void endBlock(Translator *t) {
+  flushStack(t);
+  fprintf(t->file, "}\n");
+  t->temps = 0;
+}
+
+static char *binaryExpression(Opcode op) {
+  switch (op) {
+    case OP_SOMA: return "{.i = WRAP(t%d.i, +, t%d.i)}";
+    case OP_SUBT: return "{.i = WRAP(t%d.i, -, t%d.i)}";
+    case OP_MULT: return "{.i = WRAP(t%d.i, *, t%d.i)}";
+    case OP_DIVI: return "{.i = t%d.i / t%d.i}";
+    case OP_CONJ: return "{.i = t%d.i && t%d.i}";
+    case OP_DISJ: return "{.i = t%d.i || t%d.i}";
+    case OP_CMME: return "{.i = t%d.i < t%d.i}";
+    case OP_CMMA: return "{.i = t%d.i > t%d.i}";
+    case OP_CMIG: return "{.i = t%d.i == t%d.i}";
+    case OP_CMDG: return "{.i = t%d.i != t%d.i}";
+    case OP_CMEG: return "{.i = t%d.i <= t%d.i}";
+    case OP_CMAG: return "{.i = t%d.i >= t%d.i}";
+    case OP_SOMF: return "{.f = t%d.f + t%d.f}";
+    case OP_SUBF: return "{.f = t%d.f - t%d.f}";
+    case OP_MULF: return "{.f = t%d.f * t%d.f}";
+    case OP_DIVF: return "{.f = t%d.f / t%d.f}";
+    default: return NULL;
+  }
+}
+
+static char *compareOperator(Opcode op) {
+  switch (op) {
+    case OP_DVME: return "<";
+    case OP_DVMA: return ">";
+    case OP_DVIG: return "==";
+    case OP_DVDG: return "!=";
+    case OP_DVEG: return "<=";
+    default: return ">=";
+  }
+}
+
+// Checks if the instruction takes a display level as its first operand.
+static int usesLevel(Instr *instr) {
+  OperandKind kind = operandKinds[instr->op];
+  if (instr->op == OP_AMEM || instr->op == OP_DMEM || instr->op == OP_VERI) return 0;
+  return kind == ONE_NUMBER || kind == TWO_NUMBERS || kind == LABEL_AND_TWO_NUMBERS ||
+         kind == TWO_NUMBERS_AND_CONSTANT || kind == FOUR_NUMBERS ||
+         kind == LABEL_AND_THREE_NUMBERS;
+}
+
+// Writes the C code of the instruction at index.
+static void translateInstr(Translator *t, Program *program, int *targets, char *levels,
+                           int index) {
+  Instr *instr = &program->code[index];
+  FILE *file = t->file;
+  char cell[64], other[64], value[BUFFER_SIZE];
+  int target = targets[index], x, y;
+
+  switch (instr->op) {
+    case OP_INPP:
+      flushStack(t);
+      fprintf(file, "  s = -1;\n  d0 = 0;\n");
+      break;
+    case OP_PARA:
+      flushStack(t);
+      fprintf(file, "  fflush(stdout);\n  return 0;\n");
+      break;
+    case OP_AMEM:
+      flushStack(t);
+      fprintf(file, "  s += %d;\n", instr->a);
+      fprintf(file, "  if (s >= STACK_SIZE) fail(\"stack overflow\", %d);\n", index);
+      break;
+    case OP_DMEM:
+      flushStack(t);
+      fprintf(file, "  s -= %d;\n", instr->a);
+      break;
+    case OP_NADA:
+      break;
+    case OP_CRCT:
+      if (instr->value.isReal) {
+        strcpy(value, "{.f = ");
+        formatConstant(instr->value, value + strlen(value));
+        strcat(value, "}");
+      } else if (instr->value.intValue == LONG_MIN) {
+        strcpy(value, "{.i = LONG_MIN}");
+      } else {
+        sprintf(value, "{.i = %ldL}", instr->value.intValue);
+      }
+      pushValue(t, value);
+      break;
+    case OP_CRVL:
+      formatCell(cell, instr->a, instr->b);
+      pushValue(t, cell);
+      break;
+    case OP_ARMZ:
+      x = popValue(t);
+      formatCell(cell, instr->a, instr->b);
+      fprintf(file, "  %s = t%d;\n", cell, x);
+      break;
+    case OP_CRVI:
+      formatCell(cell, instr->a, instr->b);
+      sprintf(value, "M[%s.i]", cell);
+      pushValue(t, value);
+      break;
+    case OP_ARMI:
+      x = popValue(t);
+      formatCell(cell, instr->a, instr->b);
+      fprintf(file, "  M[%s.i] = t%d;\n", cell, x);
+      break;
+    case OP_CRVX:
+      x = popValue(t);
+      formatElement(value, instr, x);
+      pushValue(t, value);
+      break;
+    case OP_ARMX:
+      y = popValue(t);
+      x = popValue(t);
+      formatElement(cell, instr, x);
+      fprintf(file, "  %s = t%d;\n", cell, y);
+      break;
+    case OP_VERI:
+      // the index stays on the stack for the access
+      x = popValue(t);
+      fprintf(file, "  if (t%d.i < %d || t%d.i > %d) fail(\"index out of range\", %d);\n", x,
+              instr->a, x, instr->b, index);
+      t->pending[t->count++] = x;
+      break;
+    case OP_CREN:
+      sprintf(value, "{.i = d%d + %d}", instr->a, instr->b);
+      pushValue(t, value);
+      break;
+    case OP_INVR: case OP_NEGA: case OP_INVF: case OP_ITOF:
+      x = popValue(t);
+      sprintf(value, instr->op == OP_INVR ? "{.i = WRAP(0, -, t%d.i)}" :
+                     instr->op == OP_NEGA ? "{.i = 1 - t%d.i}" :
+                     instr->op == OP_INVF ? "{.f = -t%d.f}" : "{.f = (double)t%d.i}", x);
+      pushValue(t, value);
+      break;
+    case OP_CMPF:
+      y = popValue(t);
+      x = popValue(t);
+      sprintf(value, "{.i = (t%d.f > t%d.f) - (t%d.f < t%d.f)}", x, y, x, y);
+      pushValue(t, value);
+      break;
+    case OP_DSVS:
+      flushStack(t);
+      fprintf(file, "  JUMP(I%d, %d);\n", target, index);
+      break;
+    case OP_DSVF:
+      x = popValue(t);
+      flushStack(t);
+      fprintf(file, "  if (t%d.i == 0) JUMP(I%d, %d);\n", x, target, index);
+      break;
+    case OP_DSVR:
+      // unwind the frames down to the level of the label
+      flushStack(t);
+      fprintf(file, "  for (long k = %d, base = 0; k != %d; k = M[base - 2].i) {\n", instr->b,
+              instr->a);
+      fprintf(file, "    switch (k) {\n");
+      for (int k = 0; k < MAX_LEVELS; k++) {
+        if (levels[k])
+          fprintf(file, "      case %d: base = d%d; d%d = M[base - 1].i; break;\n", k, k, k);
+      }
+      fprintf(file, "      default: fail(\"invalid level\", %d);\n", index);
+      fprintf(file, "    }\n  }\n  JUMP(I%d, %d);\n", target, index);
+      break;
+    case OP_ENRT:
+      flushStack(t);
+      fprintf(file, "  s = d%d + %d;\n", instr->a, instr->b - 1);
+      fprintf(file, "  if (s >= STACK_SIZE) fail(\"stack overflow\", %d);\n", index);
+      break;
+    case OP_CHPR:
+      flushStack(t);
+      fprintf(file, "  if (s + 2 >= STACK_SIZE) fail(\"stack overflow\", %d);\n", index);
+      fprintf(file, "  M[s + 1].i = %d;\n  M[s + 2].i = %d;\n  s += 2;\n", index + 1,
+              instr->a);
+      fprintf(file, "  goto I%d;\n", target);
+      break;
+    case OP_ENPR:
+      flushStack(t);
+      fprintf(file, "  M[++s].i = d%d;\n  d%d = s + 1;\n", instr->a, instr->a);
+      break;
+    case OP_RTPR:
+      flushStack(t);
+      fprintf(file, "  back = M[s - 2].i;\n  d%d = M[s].i;\n  s -= %d;\n  JUMP(ret, %d);\n",
+              instr->a, instr->b + 3, index);
+      break;
+    case OP_LEIT:
+      sprintf(value, "{.i = readInteger(%d)}", index);
+      pushValue(t, value);
+      break;
+    case OP_LEIF:
+      sprintf(value, "{.f = readReal(%d)}", index);
+      pushValue(t, value);
+      break;
+    case OP_IMPR:
+      x = popValue(t);
+      fprintf(file, "  printf(\"%%ld\\n\", t%d.i);\n", x);
+      break;
+    case OP_IMPF:
+      x = popValue(t);
+      fprintf(file, "  writeReal(t%d.f);\n", x);
+      break;
+    case OP_INCV:
+      formatCell(cell, instr->a, instr->b);
+      fprintf(file, "  %s.i = WRAP(%s.i, +, %ldL);\n", cell, cell, instr->value.intValue);
+      break;
+    case OP_SOVV:
+      formatCell(cell, instr->a, instr->b);
+      formatCell(other, instr->a, instr->c);
+      formatCell(value, instr->a, instr->d);
+      fprintf(file, "  %s.i = WRAP(%s.i, +, %s.i);\n", value, cell, other);
+      break;
+    case OP_DVME: case OP_DVMA: case OP_DVIG: case OP_DVDG: case OP_DVEG: case OP_DVAG:
+      flushStack(t);
+      formatCell(cell, instr->a, instr->b);
+      formatCell(other, instr->a, instr->c);
+      fprintf(file, "  if (!(%s.i %s %s.i)) JUMP(I%d, %d);\n", cell, compareOperator(instr->op),
+              other, target, index);
+      break;
+    default:
+      // binary operations
+      y = popValue(t);
+      x = popValue(t);
+      if (instr->op == OP_DIVI)
+        fprintf(file, "  if (t%d.i == 0) fail(\"division by zero\", %d);\n"
+                "  if (t%d.i == -1 && t%d.i == LONG_MIN) fail(\"integer overflow\", %d);\n",
+                y, index, y, x, index);
+      if (instr->op == OP_DIVF)
+        fprintf(file, "  if (t%d.f == 0.0) fail(\"division by zero\", %d);\n", y, index);
+      sprintf(value, binaryExpression(instr->op), x, y);
+      pushValue(t, value);
+      break;
+  }
+}
+
+// Writes the program as a C program that runs it natively. Each basic block
+// becomes a labelled C block whose pushes and pops are C variables, the
+// display registers are variables of main() and returns go through a switch
+// over the return points.
+void writeCProgram(Program *program, FILE *file) {
+  int *targets = labelTargets(program);
+  char *leader = (char*)calloc(program->count + 1, 1);
+  char *labelled = (char*)calloc(program->count + 1, 1);
+  char levels[MAX_LEVELS] = {0};
+  int returns = 0;
+  Translator t = {file, {0}, 0, 0};
+
+  leader[0] = 1;
+  levels[0] = 1;
+  for (int i = 0; i < program->count; i++) {
+    Instr *instr = &program->code[i];
+    if (targets[i] != -1) leader[targets[i]] = labelled[targets[i]] = 1;
+    if (instr->op == OP_CHPR) labelled[i + 1] = 1;
+    if (instr->target[0] != '\0' || instr->op == OP_RTPR || instr->op == OP_PARA)
+      leader[i + 1] = 1;
+    if (instr->op == OP_RTPR) returns = 1;
+    if (usesLevel(instr) && instr->a >= 0 && instr->a < MAX_LEVELS) levels[instr->a] = 1;
+    if (instr->op == OP_DSVR && instr->b >= 0 && instr->b < MAX_LEVELS) levels[instr->b] = 1;
+  }
+  for (int i = 0; i <= program->count; i++)
+    if (labelled[i]) leader[i] = 1;
+
+  fputs(prelude, file);
+  fprintf(file, "#define STACK_SLACK %ld\n\n", stackSlack(program));
+  fprintf(file, "int main(void) {\n");
+  fprintf(file, "  static Cell M[STACK_SIZE + STACK_SLACK];\n");
+  fprintf(file, "  long s = -1;\n");
+  if (returns) fprintf(file, "  long back;\n");
+  for (int k = 0; k < MAX_LEVELS; k++)
+    if (levels[k]) fprintf(file, "  long d%d = 0;\n", k);
+  fprintf(file, "\n");
+
+  for (int i = 0; i < program->count; i++) {
+    if (leader[i]) {
+      if (i > 0) endBlock(&t);
+      if (labelled[i]) fprintf(file, "I%d:\n", i);
+      fprintf(file, "{\n");
+    }
+    char text[BUFFER_SIZE];
+    formatInstruction(&program->code[i], text);
+    fprintf(file, "  // %s\n", text);
+    translateInstr(&t, program, targets, levels, i);
+  }
+  if (program->count > 0) endBlock(&t);
+
+  // running past the last instruction stops like PARA
+  if (labelled[program->count]) fprintf(file, "I%d:\n", program->count);
+  fprintf(file, "  fflush(stdout);\n  return 0;\n");
+  if (returns) {
+    fprintf(file, "\nret:\n  switch (back) {\n");
+    for (int i = 0; i < program->count; i++) {
+      if (program->code[i].op == OP_CHPR) fprintf(file, "    case %d: goto I%d;\n", i + 1, i + 1);
+    }
+    fprintf(file, "  }\n  fail(\"invalid return address\", (int)back);\n  return 1;\n");
+  }
+  fprintf(file, "}\n");
+
+  free(targets);
+  free(leader);
+  free(labelled);
+}